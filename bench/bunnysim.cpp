@@ -0,0 +1,477 @@
+#include "pch.h"
+#include "Garbage.hpp"
+#include "Snapshot.hpp"
+#include "Profile.hpp"
+#include "Trace.hpp"
+#include "Timeline.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Headless version of the bunny churn loop in main.cpp: no window, no
+// texture, a fixed timestep and a scripted mouse. Reports the frame-time
+// distribution and how much of every frame was spent inside the collector.
+
+const int screenWidth = 1024;
+const int screenHeight = 720;
+const int bunnyWidth = 26;
+const int bunnyHeight = 37;
+
+double gravity = 0.5;
+int maxX = screenWidth - bunnyWidth;
+int maxY = screenHeight - bunnyHeight;
+int minX = bunnyWidth;
+int minY = bunnyHeight;
+
+static const double rand_scale = 1.0 / (1 << 16) / (1 << 16);
+double range()
+{
+    unsigned int lo = rand() & 0xfff;
+    unsigned int mid = rand() & 0xfff;
+    unsigned int hi = rand() & 0xff;
+    double result = (lo | (mid << 12) | (hi << 24)) * rand_scale;
+    return result;
+}
+
+struct Bunny
+{
+    double speedX;
+    double speedY;
+    double x;
+    double y;
+    double life;
+    unsigned char color[4];
+    bool die;
+
+    Bunny(int mouseX, int mouseY, double lifetime)
+    {
+        x = mouseX;
+        y = mouseY;
+        speedX = range() * 8;
+        speedY = range() * 5 - 2.5;
+        color[0] = range() * 255;
+        color[1] = range() * 255;
+        color[2] = range() * 255;
+        color[3] = 255;
+        life = lifetime;
+        die = false;
+    }
+
+    void update(double step)
+    {
+        life -= step;
+
+        if (life <= 0)
+        {
+            die = true;
+            return;
+        }
+        x += speedX * step;
+        y += speedY * step;
+        speedY += gravity * step;
+
+        if (x > maxX)
+        {
+            speedX *= -1;
+            x = maxX;
+        }
+        else if (x < minX)
+        {
+            speedX *= -1;
+            x = minX;
+        }
+
+        if (y > maxY)
+        {
+            speedY *= -0.8;
+            y = maxY;
+
+            if (range() > 0.5)
+                speedY -= 3 + range() * 4;
+        }
+        else if (y < minY)
+        {
+            speedY = 0;
+            y = minY;
+        }
+    }
+};
+
+// the same bunny as plain data, kept column by column in a RecordStore
+struct BunnyRecord
+{
+    double x;
+    double y;
+    double speedX;
+    double speedY;
+    double life;
+    uint32_t color;
+};
+
+enum BunnyField
+{
+    FIELD_X,
+    FIELD_Y,
+    FIELD_SPEED_X,
+    FIELD_SPEED_Y,
+    FIELD_LIFE,
+    FIELD_COLOR,
+};
+
+static RecordType bunnyLayout()
+{
+    return RecordType::of<BunnyRecord>()
+        .field(&BunnyRecord::x)
+        .field(&BunnyRecord::y)
+        .field(&BunnyRecord::speedX)
+        .field(&BunnyRecord::speedY)
+        .field(&BunnyRecord::life)
+        .field(&BunnyRecord::color);
+}
+
+static void spawnRecords(RecordStore *store, int count, int mouseX, int mouseY, double lifetime)
+{
+    for (int j = 0; j < count; j++)
+    {
+        BunnyRecord bunny;
+        bunny.x = mouseX;
+        bunny.y = mouseY;
+        bunny.speedX = range() * 8;
+        bunny.speedY = range() * 5 - 2.5;
+        bunny.color = (uint32_t)(range() * 255) | (uint32_t)(range() * 255) << 8 | (uint32_t)(range() * 255) << 16 | 0xff000000u;
+        bunny.life = lifetime;
+        store->add(bunny);
+    }
+}
+
+static void updateRecords(RecordStore *store, double step)
+{
+    size_t count = store->size();
+    double *x = store->column<double>(FIELD_X);
+    double *y = store->column<double>(FIELD_Y);
+    double *speedX = store->column<double>(FIELD_SPEED_X);
+    double *speedY = store->column<double>(FIELD_SPEED_Y);
+    double *life = store->column<double>(FIELD_LIFE);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        life[i] -= step;
+        if (life[i] <= 0)
+            continue;
+        x[i] += speedX[i] * step;
+        y[i] += speedY[i] * step;
+        speedY[i] += gravity * step;
+
+        if (x[i] > maxX)
+        {
+            speedX[i] *= -1;
+            x[i] = maxX;
+        }
+        else if (x[i] < minX)
+        {
+            speedX[i] *= -1;
+            x[i] = minX;
+        }
+
+        if (y[i] > maxY)
+        {
+            speedY[i] *= -0.8;
+            y[i] = maxY;
+
+            if (range() > 0.5)
+                speedY[i] -= 3 + range() * 4;
+        }
+        else if (y[i] < minY)
+        {
+            speedY[i] = 0;
+            y[i] = minY;
+        }
+    }
+}
+
+static void on_delete(Pointer *p)
+{
+    delete static_cast<Bunny *>(p->value);
+}
+
+static double frameGc = 0.0;
+
+static void on_collect(const GCStats &stats)
+{
+    frameGc += stats.lastPause;
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t index = (size_t)(p * (values.size() - 1) + 0.5);
+    return values[index];
+}
+
+static void printDistribution(const char *name, const std::vector<double> &values)
+{
+    double total = 0.0;
+    for (double v : values)
+        total += v;
+    printf("\"%s\":{\"total\":%.4f,\"mean\":%.4f,\"p50\":%.4f,\"p90\":%.4f,\"p99\":%.4f,\"max\":%.4f}",
+           name, total, values.empty() ? 0.0 : total / values.size(),
+           percentile(values, 0.50), percentile(values, 0.90),
+           percentile(values, 0.99), percentile(values, 1.0));
+}
+
+int main(int argc, char **argv)
+{
+    int frames = 3000;
+    int spawn = 50;
+    double lifetime = 500;
+    double step = 1.0;
+    const char *snapshot = nullptr;
+    const char *profile = nullptr;
+    const char *trace = nullptr;
+    const char *timeline = nullptr;
+    const char *finalize = "inline";
+    const char *expire = "compact";
+    const char *alloc = "single";
+    const char *entities = "pointer";
+    const char *scope = "local";
+    size_t budget = 2000;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "--frames") == 0)
+            frames = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--spawn") == 0)
+            spawn = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--life") == 0)
+            lifetime = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "--step") == 0)
+            step = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "--snapshot") == 0)
+            snapshot = argv[i + 1];
+        else if (strcmp(argv[i], "--profile") == 0)
+            profile = argv[i + 1];
+        else if (strcmp(argv[i], "--trace") == 0)
+            trace = argv[i + 1];
+        else if (strcmp(argv[i], "--timeline") == 0)
+            timeline = argv[i + 1];
+        else if (strcmp(argv[i], "--expire") == 0)
+            expire = argv[i + 1];
+        else if (strcmp(argv[i], "--entities") == 0)
+            entities = argv[i + 1];
+        else if (strcmp(argv[i], "--scope") == 0)
+            scope = argv[i + 1];
+        else if (strcmp(argv[i], "--alloc") == 0)
+            alloc = argv[i + 1];
+        else if (strcmp(argv[i], "--finalize") == 0)
+            finalize = argv[i + 1];
+        else if (strcmp(argv[i], "--budget") == 0)
+            budget = (size_t)atol(argv[i + 1]);
+        else
+        {
+            fprintf(stderr, "usage: bunnysim [--frames N] [--spawn N] [--life FRAMES] [--step DT] [--snapshot FILE]\n"
+                            "                [--profile FILE|FILE.pb] [--trace FILE] [--timeline FILE.json]\n"
+                            "                [--finalize inline|deferred|thread] [--budget N]\n"
+                            "                [--expire erase|swap|compact] [--alloc single|batch]\n"
+                            "                [--entities pointer|record] [--scope local|frame|region]\n");
+            return 1;
+        }
+    }
+    srand(1);
+
+    // the collector logs to std::cout; the report goes to stdout on its own
+    std::cout.setstate(std::ios::failbit);
+
+    if (trace != nullptr && !startTrace(trace))
+        fprintf(stderr, "failed to open trace %s\n", trace);
+    if (timeline != nullptr)
+        startTimeline();
+
+    Scope *global = NEW_SCOPE(nullptr);
+    Scope *local = NEW_SCOPE(global);
+
+    Factory::as().setOnDelete(on_delete);
+    Factory::as().setOnCollect(on_collect);
+
+    bool deferred = strcmp(finalize, "deferred") == 0;
+    Factory::as().setDeferredFinalization(deferred);
+    if (strcmp(finalize, "thread") == 0)
+        Factory::as().startFinalizerThread();
+
+    ADD_ROOT(global);
+    ADD_ROOT(local);
+
+    if (profile != nullptr)
+        startAllocationProfile();
+
+    List *list = NEW_LIST();
+    ADD_ROOT(list);
+
+    bool records = strcmp(entities, "record") == 0;
+    bool frameScopes = strcmp(scope, "local") != 0;
+    bool regions = strcmp(scope, "region") == 0;
+    RecordStore *store = NEW_RECORD_STORE(bunnyLayout());
+    ADD_ROOT(store);
+
+    std::vector<double> frameTimes;
+    std::vector<double> gcTimes;
+    frameTimes.reserve(frames);
+    gcTimes.reserve(frames);
+    size_t peakBunnies = 0;
+    size_t framesWithGc = 0;
+    int count = 0;
+
+    for (int frame = 0; frame < frames; frame++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        frameGc = 0.0;
+
+        // the input goes to local itself, or to a child scope dropped at the
+        // end of the frame's input, made in a Region with --scope region
+        bool region = regions && Factory::as().beginRegion();
+        Scope *input = local;
+        if (frameScopes)
+        {
+            input = NEW_SCOPE(local);
+            ADD_ROOT(input);
+        }
+
+        // scripted mouse: sweep across the screen, button held 2 of every 3 seconds
+        input->define("mouse_x", (frame * 7) % screenWidth);
+        input->define("mouse_y", screenHeight / 3 + (frame * 3) % (screenHeight / 3));
+        input->define("down", (int)((frame / 60) % 3 != 2));
+
+        int mouse_x = input->getInt("mouse_x");
+        int mouse_y = input->getInt("mouse_y");
+        int down = input->getInt("down");
+        if (frameScopes)
+            REMOVE_ROOT(input);
+        if (region)
+            Factory::as().endRegion();
+        if (records)
+        {
+            if (down)
+                spawnRecords(store, spawn, mouse_x, mouse_y, lifetime);
+        }
+        else if (down && strcmp(alloc, "batch") == 0)
+        {
+            std::vector<Pointer *> batch(spawn);
+            // no spawn this frame when the batch cannot be had
+            bool spawned = Factory::as().newPointers(spawn, 0, batch.data());
+            for (int j = 0; spawned && j < spawn; j++)
+            {
+                batch[j]->tag = ++count;
+                batch[j]->value = (void *)new Bunny(mouse_x, mouse_y, lifetime);
+                Factory::as().setExternalSize(batch[j], sizeof(Bunny));
+                list->add(batch[j]);
+            }
+        }
+        else if (down)
+        {
+            for (int j = 0; j < spawn; j++)
+            {
+                count++;
+                Pointer *buffer = NEW_POINTER(count);
+                buffer->value = (void *)new Bunny(mouse_x, mouse_y, lifetime);
+                Factory::as().setExternalSize(buffer, sizeof(Bunny));
+                list->add(buffer);
+            }
+        }
+
+        if (records)
+        {
+            double *life = store->column<double>(FIELD_LIFE);
+            store->removeIf([&](size_t i)
+                            { return life[i] <= 0; });
+            updateRecords(store, step);
+        }
+        else if (strcmp(expire, "compact") == 0)
+        {
+            list->removeIf([](Object *p)
+                           { return static_cast<Bunny *>(static_cast<Pointer *>(p)->value)->die; });
+            for (Object *p : list->values)
+                static_cast<Bunny *>(static_cast<Pointer *>(p)->value)->update(step);
+        }
+        else
+        {
+            bool swap = strcmp(expire, "swap") == 0;
+            int i = 0;
+            while (i < list->size())
+            {
+                Pointer *ob = static_cast<Pointer *>(list->get(i));
+                Bunny *bunny = static_cast<Bunny *>(ob->value);
+                if (bunny->die)
+                {
+                    if (swap)
+                        list->swapRemove(i);
+                    else
+                        list->erase(i);
+                    continue;
+                }
+                bunny->update(step);
+                i++;
+            }
+        }
+        peakBunnies = std::max(peakBunnies, (size_t)(records ? store->size() : list->size()));
+
+        if (deferred)
+            Factory::as().runFinalizers(budget);
+
+        auto end = std::chrono::steady_clock::now();
+        timelineSpan("frame", start, end);
+        std::chrono::duration<double, std::milli> elapsed = end - start;
+        frameTimes.push_back(elapsed.count());
+        gcTimes.push_back(frameGc);
+        if (frameGc > 0.0)
+            framesWithGc++;
+    }
+
+    double total = 0.0;
+    for (double f : frameTimes)
+        total += f;
+
+    const GCStats &stats = Factory::as().stats();
+    printf("{\"entities\":\"%s\",\"scope\":\"%s\",\"expire\":\"%s\",\"alloc\":\"%s\",\"frames\":%d,\"spawn_per_frame\":%d,\"peak_bunnies\":%zu,\"collections\":%zu,"
+           "\"frames_with_gc\":%zu,\"gc_share\":%.4f,",
+           entities, scope, expire, alloc, frames, spawn, peakBunnies, stats.collections, framesWithGc,
+           total > 0.0 ? stats.totalPause / total : 0.0);
+    printDistribution("frame_ms", frameTimes);
+    printf(",");
+    printDistribution("gc_ms", gcTimes);
+    printf("}\n");
+    fflush(stdout);
+
+    if (snapshot != nullptr && !writeHeapSnapshot(snapshot))
+        fprintf(stderr, "failed to write heap snapshot %s\n", snapshot);
+
+    if (profile != nullptr)
+    {
+        stopAllocationProfile();
+        size_t length = strlen(profile);
+        bool pprof = length > 3 && strcmp(profile + length - 3, ".pb") == 0;
+        if (!(pprof ? writePprofProfile(profile) : writeFoldedProfile(profile)))
+            fprintf(stderr, "failed to write allocation profile %s\n", profile);
+    }
+
+    REMOVE_ROOT(store);
+    REMOVE_ROOT(list);
+    REMOVE_ROOT(local);
+    REMOVE_ROOT(global);
+
+    if (trace != nullptr && tracing() && !stopTrace())
+        fprintf(stderr, "failed to write trace %s\n", trace);
+    if (timeline != nullptr)
+    {
+        stopTimeline();
+        if (!writeChromeTrace(timeline))
+            fprintf(stderr, "failed to write timeline %s\n", timeline);
+    }
+
+    Factory::as().stopFinalizerThread();
+    Factory::as().clean();
+    return 0;
+}
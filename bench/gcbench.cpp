@@ -0,0 +1,1317 @@
+#include "pch.h"
+#include "Garbage.hpp"
+#include "Image.hpp"
+#include "Persistent.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Headless collector benchmarks. Every workload runs in its own forked
+// process so peak RSS and GC statistics are not polluted by the others,
+// and the results are printed to stdout as one JSON document.
+
+static std::vector<double> pauses;
+static std::string extra;
+
+static void onCollect(const GCStats &stats)
+{
+    pauses.push_back(stats.lastPause);
+}
+
+static double percentile(std::vector<double> &values, double p)
+{
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t index = (size_t)(p * (values.size() - 1) + 0.5);
+    return values[index];
+}
+
+static long peakRss()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+//**************************************************************************** */
+// workloads
+
+static void fillTree(List *node, int depth)
+{
+    if (depth <= 0)
+        return;
+    List *left = NEW_LIST();
+    node->add(left);
+    fillTree(left, depth - 1);
+    List *right = NEW_LIST();
+    node->add(right);
+    fillTree(right, depth - 1);
+}
+
+static size_t checkTree(List *node)
+{
+    size_t count = 1;
+    for (Object *child : node->values)
+        count += checkTree(static_cast<List *>(child));
+    return count;
+}
+
+static size_t binaryTrees(int scale)
+{
+    const int maxDepth = 12 + scale;
+    size_t ops = 0;
+
+    List *longLived = NEW_LIST();
+    ADD_ROOT(longLived);
+    fillTree(longLived, maxDepth);
+
+    for (int depth = 4; depth <= maxDepth; depth += 2)
+    {
+        int iterations = 1 << (maxDepth - depth + 4);
+        for (int i = 0; i < iterations; i++)
+        {
+            List *tree = NEW_LIST();
+            ADD_ROOT(tree);
+            fillTree(tree, depth);
+            ops += checkTree(tree);
+            REMOVE_ROOT(tree);
+        }
+    }
+    ops += checkTree(longLived);
+    REMOVE_ROOT(longLived);
+    return ops;
+}
+
+// binary_trees again, with nodes of a type made through Factory::make
+struct TreeNode : Object
+{
+    TreeNode *left = nullptr;
+    TreeNode *right = nullptr;
+
+    void trace(const Tracer &visit) const
+    {
+        visit(left);
+        visit(right);
+    }
+};
+
+static void fillNode(TreeNode *node, int depth)
+{
+    if (depth <= 0)
+        return;
+    node->left = Factory::as().make<TreeNode>();
+    fillNode(node->left, depth - 1);
+    node->right = Factory::as().make<TreeNode>();
+    fillNode(node->right, depth - 1);
+}
+
+static size_t checkNode(TreeNode *node)
+{
+    if (node == nullptr)
+        return 0;
+    return 1 + checkNode(node->left) + checkNode(node->right);
+}
+
+static size_t userTrees(int scale)
+{
+    const int maxDepth = 12 + scale;
+    size_t ops = 0;
+
+    TreeNode *longLived = Factory::as().make<TreeNode>();
+    ADD_ROOT(longLived);
+    fillNode(longLived, maxDepth);
+
+    for (int depth = 4; depth <= maxDepth; depth += 2)
+    {
+        int iterations = 1 << (maxDepth - depth + 4);
+        for (int i = 0; i < iterations; i++)
+        {
+            TreeNode *tree = Factory::as().make<TreeNode>();
+            ADD_ROOT(tree);
+            fillNode(tree, depth);
+            ops += checkNode(tree);
+            REMOVE_ROOT(tree);
+        }
+    }
+    ops += checkNode(longLived);
+    REMOVE_ROOT(longLived);
+    return ops;
+}
+
+static size_t integerChurn(int scale)
+{
+    const int names = 64;
+    const int rounds = 20000 * scale;
+    size_t ops = 0;
+
+    Scope *scope = NEW_SCOPE(nullptr);
+    ADD_ROOT(scope);
+
+    std::vector<std::string> keys;
+    for (int i = 0; i < names; i++)
+        keys.push_back("v" + std::to_string(i));
+
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < names; i++)
+        {
+            scope->define(keys[i], r + i);
+            ops++;
+        }
+    }
+    REMOVE_ROOT(scope);
+    return ops;
+}
+
+struct Payload
+{
+    double data[8];
+};
+
+static size_t finalized = 0;
+
+static void onDeletePayload(Pointer *p)
+{
+    delete static_cast<Payload *>(p->value);
+    finalized++;
+}
+
+static size_t pointerLists(int scale)
+{
+    const int rounds = 50 * scale;
+    const int batch = 20000;
+    size_t ops = 0;
+
+    Factory::as().setOnDelete(onDeletePayload);
+    List *list = NEW_LIST();
+    ADD_ROOT(list);
+
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < batch; i++)
+        {
+            Pointer *p = NEW_POINTER(i);
+            p->value = new Payload();
+            list->add(p);
+            ops++;
+        }
+        // drop the older half so every round leaves garbage with finalizers
+        size_t keep = list->values.size() / 2;
+        list->values.erase(list->values.begin(), list->values.end() - keep);
+    }
+    REMOVE_ROOT(list);
+    Factory::as().collect();
+    return ops;
+}
+
+// pointer_lists with the batch allocator
+static size_t batchPointers(int scale)
+{
+    const int rounds = 50 * scale;
+    const int batch = 20000;
+    const int burst = 50;
+    size_t ops = 0;
+
+    Factory::as().setOnDelete(onDeletePayload);
+    List *list = NEW_LIST();
+    ADD_ROOT(list);
+
+    size_t failed = 0;
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < batch; i += burst)
+        {
+            Pointer *pointers[burst];
+            if (!Factory::as().newPointers(burst, i, pointers))
+            {
+                failed++;
+                continue;
+            }
+            for (int j = 0; j < burst; j++)
+            {
+                pointers[j]->value = new Payload();
+                list->add(pointers[j]);
+                ops++;
+            }
+        }
+        size_t keep = list->values.size() / 2;
+        list->values.erase(list->values.begin(), list->values.end() - keep);
+    }
+    REMOVE_ROOT(list);
+    Factory::as().collect();
+
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), ",\"failed_batches\":%zu", failed);
+    extra = buffer;
+    return ops;
+}
+
+static size_t nativeLive = 0;
+static size_t nativePeak = 0;
+static const size_t nativeSize = 256 * 1024;
+
+static void onDeleteNative(Pointer *p)
+{
+    std::free(p->value);
+    nativeLive -= nativeSize;
+    finalized++;
+}
+
+// small Pointers owning large native buffers; only the last few stay alive
+static size_t nativePayloads(int scale, bool accounted)
+{
+    const int count = 2000 * scale;
+    const size_t keep = 16;
+
+    Factory::as().setOnDelete(onDeleteNative);
+    List *list = NEW_LIST();
+    ADD_ROOT(list);
+    for (int i = 0; i < count; i++)
+    {
+        Pointer *p = NEW_POINTER(i);
+        p->value = std::malloc(nativeSize);
+        memset(p->value, 1, nativeSize);
+        if (accounted)
+            Factory::as().setExternalSize(p, nativeSize);
+        nativeLive += nativeSize;
+        nativePeak = std::max(nativePeak, nativeLive);
+        list->add(p);
+        if (list->values.size() > keep)
+            list->erase(0);
+    }
+    REMOVE_ROOT(list);
+    Factory::as().collect();
+
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), ",\"peak_native_kb\":%zu", nativePeak / 1024);
+    extra = buffer;
+    return count;
+}
+
+static size_t nativeAccounted(int scale)
+{
+    return nativePayloads(scale, true);
+}
+
+static size_t nativeUnaccounted(int scale)
+{
+    return nativePayloads(scale, false);
+}
+
+static size_t stringMaps(int scale)
+{
+    const int keys = 20000;
+    const int rounds = 10 * scale;
+    size_t ops = 0;
+
+    Map *map = NEW_MAP();
+    ADD_ROOT(map);
+    List *scratch = NEW_LIST();
+    ADD_ROOT(scratch);
+
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < keys; i++)
+        {
+            Integer *value = NEW_INTEGER(i);
+            scratch->add(value);
+            String *key = NEW_STRING("key_" + std::to_string(i) + "_" + std::to_string(r % 3));
+            map->insert(key, value);
+            scratch->values.clear();
+            ops++;
+        }
+        for (int i = 0; i < keys; i++)
+        {
+            String *probe = NEW_STRING("key_" + std::to_string(i) + "_0");
+            if (map->get(probe) != nullptr)
+                ops++;
+        }
+    }
+    REMOVE_ROOT(scratch);
+    REMOVE_ROOT(map);
+    return ops;
+}
+
+static size_t scopeChains(int scale)
+{
+    const int depth = 256;
+    const int rounds = 200 * scale;
+    size_t ops = 0;
+
+    Scope *global = NEW_SCOPE(nullptr);
+    ADD_ROOT(global);
+    global->define("answer", 42);
+
+    List *holder = NEW_LIST();
+    ADD_ROOT(holder);
+
+    for (int r = 0; r < rounds; r++)
+    {
+        Scope *current = global;
+        for (int d = 0; d < depth; d++)
+        {
+            Scope *child = NEW_SCOPE(current);
+            holder->add(child);
+            child->define("x", d);
+            child->define("y", (double)d);
+            current = child;
+        }
+        for (int i = 0; i < depth; i++)
+        {
+            ops += current->getInt("answer") == 42;
+            ops += current->lookup("y") != nullptr;
+        }
+        holder->values.clear();
+    }
+    REMOVE_ROOT(holder);
+    REMOVE_ROOT(global);
+    return ops;
+}
+
+static Scope *buildGlobals(int count)
+{
+    Scope *global = NEW_SCOPE(nullptr);
+    ADD_ROOT(global);
+    for (int i = 0; i < count; i++)
+    {
+        std::string name = "g" + std::to_string(i);
+        switch (i % 4)
+        {
+        case 0:
+            global->define(name, i);
+            break;
+        case 1:
+            global->define(name, i * 0.5);
+            break;
+        case 2:
+            global->define(name, "value of " + name);
+            break;
+        default:
+        {
+            List *list = NEW_LIST();
+            global->define(name, list);
+            for (int j = 0; j < 4; j++)
+                list->add(NEW_INTEGER(j));
+            break;
+        }
+        }
+    }
+    return global;
+}
+
+static size_t heapImage(int scale)
+{
+    const int count = 20000 * scale;
+    char path[] = "/tmp/gcbench-image-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return 0;
+    close(fd);
+
+    auto start = std::chrono::steady_clock::now();
+    Scope *global = buildGlobals(count);
+    std::chrono::duration<double, std::milli> build = std::chrono::steady_clock::now() - start;
+
+    saveImage(global, path);
+    REMOVE_ROOT(global);
+    Factory::as().collect();
+
+    start = std::chrono::steady_clock::now();
+    Scope *loaded = static_cast<Scope *>(loadImage(path));
+    std::chrono::duration<double, std::milli> load = std::chrono::steady_clock::now() - start;
+    unlink(path);
+
+    size_t ops = 0;
+    if (loaded != nullptr)
+    {
+        ADD_ROOT(loaded);
+        for (int i = 0; i < count; i += 4)
+            ops += loaded->getInt("g" + std::to_string(i)) == i;
+        REMOVE_ROOT(loaded);
+    }
+
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), ",\"build_ms\":%.4f,\"image_load_ms\":%.4f", build.count(), load.count());
+    extra = buffer;
+    return ops;
+}
+
+static size_t packedArrays(int scale)
+{
+    const int count = 200000 * scale;
+    const int rounds = 20;
+
+    // the same numbers boxed in a List and packed in an IntArray
+    List *boxed = NEW_LIST();
+    ADD_ROOT(boxed);
+    for (int i = 0; i < count; i++)
+        boxed->add(NEW_INTEGER(i));
+    IntArray *packed = NEW_INT_ARRAY(0);
+    ADD_ROOT(packed);
+    for (int i = 0; i < count; i++)
+        packed->push(i);
+
+    auto start = std::chrono::steady_clock::now();
+    int64_t boxedSum = 0;
+    for (int r = 0; r < rounds; r++)
+        for (Object *value : boxed->values)
+            boxedSum += static_cast<Integer *>(value)->value;
+    std::chrono::duration<double, std::milli> boxedOps = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    int64_t packedSum = 0;
+    for (int r = 0; r < rounds; r++)
+        packedSum += packed->sum();
+    std::chrono::duration<double, std::milli> packedOps = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    Factory::as().collect();
+    std::chrono::duration<double, std::milli> bothGc = std::chrono::steady_clock::now() - start;
+    REMOVE_ROOT(boxed);
+    Factory::as().collect();
+    start = std::chrono::steady_clock::now();
+    Factory::as().collect();
+    std::chrono::duration<double, std::milli> packedGc = std::chrono::steady_clock::now() - start;
+
+    RealArray *reals = NEW_REAL_ARRAY(count);
+    ADD_ROOT(reals);
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++)
+    {
+        reals->fill(1.5);
+        reals->mul(2.0);
+        reals->add(0.25);
+    }
+    std::chrono::duration<double, std::milli> realOps = std::chrono::steady_clock::now() - start;
+    REMOVE_ROOT(reals);
+    REMOVE_ROOT(packed);
+
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             ",\"backend\":\"%s\",\"boxed_sum_ms\":%.4f,\"packed_sum_ms\":%.4f,\"boxed_gc_ms\":%.4f,"
+             "\"packed_gc_ms\":%.4f,\"real_ops_ms\":%.4f",
+             packedBackend(), boxedOps.count(), packedOps.count(), bothGc.count() - packedGc.count(),
+             packedGc.count(), realOps.count());
+    extra = buffer;
+    return (boxedSum == packedSum) ? (size_t)count * rounds * 2 : 0;
+}
+
+// sweep throughput against the number of sweep threads: a large, fully
+// dead heap of mixed objects is built once per thread count and collected
+static size_t parallelSweep(int scale)
+{
+    const int count = 100000 * scale;
+    const size_t threads[] = {1, 2, 4, 8};
+    size_t ops = 0;
+
+    std::string result = ",\"cores\":" + std::to_string(std::thread::hardware_concurrency()) + ",\"sweep_ms\":{";
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+    {
+        Factory::as().setSweepThreads(threads[t]);
+
+        List *keep = NEW_LIST();
+        ADD_ROOT(keep);
+        for (int i = 0; i < count; i++)
+        {
+            keep->add(NEW_INTEGER(i));
+            keep->add(NEW_STRING("a string long enough to live on the heap " + std::to_string(i)));
+            List *list = NEW_LIST();
+            keep->add(list);
+            list->add(keep->back());
+            keep->add(NEW_REAL(i * 0.5));
+        }
+        size_t objects = Factory::as().size();
+        REMOVE_ROOT(keep);
+
+        auto start = std::chrono::steady_clock::now();
+        Factory::as().collect();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        ops += objects - Factory::as().size();
+
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%s\"%zu\":%.4f", t ? "," : "", threads[t], elapsed.count());
+        result += buffer;
+    }
+    Factory::as().setSweepThreads(1);
+    extra = result + "}";
+    return ops;
+}
+
+// The three graphs are built interleaved, so heap order is not traversal
+// order. Each is marked alone with the other two unrooted; marks are reset
+// by hand between runs.
+static double markOnce(Object *graph, MarkOrder order)
+{
+    Factory::as().setMarkOrder(order);
+    ADD_ROOT(graph);
+    auto start = std::chrono::steady_clock::now();
+    Factory::as().mark();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    REMOVE_ROOT(graph);
+    for (Object *obj : Factory::as().heap())
+        obj->marked = false;
+    return elapsed.count();
+}
+
+static size_t markOrder(int scale)
+{
+    const int count = 100000 * scale;
+    const int rounds = 5;
+
+    List *hold = NEW_LIST();
+    ADD_ROOT(hold);
+    List *linked = NEW_LIST();
+    List *wide = NEW_LIST();
+    List *leaves = NEW_LIST();
+    hold->add(linked);
+    hold->add(wide);
+    hold->add(leaves);
+
+    List *tail = linked;
+    // a binary tree of scopes, reached only through the parent links once
+    // hold is dropped
+    std::vector<Scope *> scopes = {NEW_SCOPE(nullptr)};
+    hold->add(scopes[0]);
+    for (int i = 0; i < count; i++)
+    {
+        List *node = NEW_LIST();
+        node->add(NEW_INTEGER(i));
+        tail->add(node);
+        tail = node;
+
+        List *item = NEW_LIST();
+        item->add(NEW_INTEGER(i));
+        item->add(NEW_REAL(i * 0.5));
+        wide->add(item);
+
+        Scope *scope = NEW_SCOPE(scopes[i / 2]);
+        scopes.push_back(scope);
+        hold->add(scope);
+        scope->define("value", i);
+        if (2 * i + 1 >= count)
+            leaves->add(scope);
+    }
+    hold->values.clear();
+    REMOVE_ROOT(hold);
+
+    struct Graph
+    {
+        const char *name;
+        Object *root;
+    };
+    Graph graphs[] = {{"linked", linked}, {"wide", wide}, {"scopes", leaves}};
+    std::string json = ",\"mark_ms\":{";
+    size_t ops = 0;
+    for (MarkOrder order : {MARK_BREADTH_FIRST, MARK_DEPTH_FIRST})
+    {
+        json += order == MARK_BREADTH_FIRST ? "\"bfs\":{" : ",\"dfs\":{";
+        for (size_t g = 0; g < sizeof(graphs) / sizeof(graphs[0]); g++)
+        {
+            double best = 1e9;
+            for (int r = 0; r < rounds; r++, ops++)
+                best = std::min(best, markOnce(graphs[g].root, order));
+            char buffer[64];
+            snprintf(buffer, sizeof(buffer), "%s\"%s\":%.3f", g ? "," : "", graphs[g].name, best);
+            json += buffer;
+        }
+        json += "}";
+    }
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "},\"mark_overflows\":%zu", Factory::as().stats().markOverflows);
+    extra = json + buffer;
+    Factory::as().setMarkOrder(MARK_DEPTH_FIRST);
+    return ops;
+}
+
+// a cache that only the pressure callback empties, under a hard limit
+static List *pressureCache = nullptr;
+static size_t pressureCalls = 0;
+
+static void onPressure(size_t requested, size_t committed, size_t limit)
+{
+    pressureCalls++;
+    pressureCache->values.clear();
+}
+
+static size_t memoryLimit(int scale)
+{
+    const size_t limit = 32 * 1024 * 1024;
+    const size_t capacity = 1000000;
+    const int count = 2000000 * scale;
+    size_t ops = 0;
+    size_t peakCommitted = 0;
+
+    Arena::as().setLimit(limit);
+    Arena::as().setOnPressure(onPressure);
+    pressureCache = NEW_LIST();
+    ADD_ROOT(pressureCache);
+    pressureCache->values.reserve(capacity);
+    // container storage cannot collect, so both lists take theirs up front
+    List *keep = NEW_LIST();
+    ADD_ROOT(keep);
+    keep->values.reserve(capacity);
+
+    for (int i = 0; i < count; i++)
+    {
+        Integer *value = NEW_INTEGER(i);
+        if (value == nullptr)
+            break;
+        if (pressureCache->values.size() < capacity)
+            pressureCache->add(value);
+        peakCommitted = std::max(peakCommitted, Arena::as().committed());
+        ops++;
+    }
+
+    // fill a rooted list until the limit wins, then drop it and go on
+    size_t filled = 0;
+    while (keep->values.size() < capacity)
+    {
+        Integer *value = NEW_INTEGER(0);
+        if (value == nullptr)
+            break;
+        keep->add(value);
+        filled++;
+    }
+    size_t failures = Arena::as().failures();
+    REMOVE_ROOT(keep);
+    keep->values.clear();
+    bool recovered = NEW_INTEGER(0) != nullptr;
+
+    REMOVE_ROOT(pressureCache);
+    pressureCache->values.clear();
+    Arena::as().setOnPressure(nullptr);
+
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             ",\"limit_kb\":%zu,\"peak_committed_kb\":%zu,\"pressure_calls\":%zu,\"emergency_collections\":%zu,"
+             "\"filled_to_limit\":%zu,\"failures\":%zu,\"recovered\":%s",
+             limit / 1024, peakCommitted / 1024, pressureCalls, Factory::as().stats().emergencyCollections,
+             filled, failures, recovered ? "true" : "false");
+    extra = buffer;
+    return ops + filled;
+}
+
+// A state of count values changed a little between frames, with the last
+// few snapshots kept alive: whole List/Map copies against persistent versions.
+static size_t persistentSnapshots(int scale)
+{
+    const int count = 100000 * scale;
+    const int frames = 100;
+    const int updates = 100;
+    const size_t kept = 8;
+    size_t ops = 0;
+    uint32_t seed = 1;
+    auto pick = [&seed](int n)
+    {
+        seed = seed * 1664525 + 1013904223;
+        return (int)((seed >> 8) % n);
+    };
+    auto since = [](std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    List *pool = NEW_LIST();
+    ADD_ROOT(pool);
+    for (int i = 0; i < count; i++)
+        pool->add(NEW_INTEGER(i));
+    List *ring = NEW_LIST();
+    ADD_ROOT(ring);
+    ring->values.assign(kept, pool);
+    // slot 0 holds the current state between updates
+    List *state = NEW_LIST();
+    ADD_ROOT(state);
+    state->add(pool);
+
+    List *list = NEW_LIST();
+    state->values[0] = list;
+    list->values = pool->values;
+    auto start = std::chrono::steady_clock::now();
+    for (int f = 0; f < frames; f++)
+    {
+        for (int u = 0; u < updates; u++, ops++)
+            list->values[pick(count)] = pool->values[pick(count)];
+        List *snapshot = NEW_LIST();
+        snapshot->values = list->values;
+        ring->values[f % kept] = snapshot;
+    }
+    double listCopy = since(start);
+
+    start = std::chrono::steady_clock::now();
+    PersistentVector *vector = NEW_PERSISTENT_VECTOR();
+    state->values[0] = vector;
+    for (int i = 0; i < count; i++, ops++)
+    {
+        vector = vector->push(pool->values[i]);
+        state->values[0] = vector;
+    }
+    double vectorPush = since(start);
+
+    start = std::chrono::steady_clock::now();
+    TransientVector *transient = NEW_PERSISTENT_VECTOR()->transient();
+    state->values[0] = transient;
+    for (int i = 0; i < count; i++, ops++)
+        transient->push(pool->values[i]);
+    vector = transient->persistent();
+    state->values[0] = vector;
+    double vectorTransient = since(start);
+
+    start = std::chrono::steady_clock::now();
+    for (int f = 0; f < frames; f++)
+    {
+        for (int u = 0; u < updates; u++, ops++)
+        {
+            vector = vector->set(pick(count), pool->values[pick(count)]);
+            state->values[0] = vector;
+        }
+        ring->values[f % kept] = vector;
+    }
+    double vectorVersions = since(start);
+
+    Map *map = NEW_MAP();
+    state->values[0] = map;
+    for (Object *key : pool->values)
+        map->insert(key, key);
+    start = std::chrono::steady_clock::now();
+    for (int f = 0; f < frames; f++)
+    {
+        for (int u = 0; u < updates; u++, ops++)
+            map->set(pool->values[pick(count)], pool->values[pick(count)]);
+        Map *snapshot = NEW_MAP();
+        snapshot->values = map->values;
+        ring->values[f % kept] = snapshot;
+    }
+    double mapCopy = since(start);
+
+    TransientMap *building = NEW_PERSISTENT_MAP()->transient();
+    state->values[0] = building;
+    for (Object *key : pool->values)
+        building->insert(key, key);
+    PersistentMap *trie = building->persistent();
+    state->values[0] = trie;
+    start = std::chrono::steady_clock::now();
+    for (int f = 0; f < frames; f++)
+    {
+        for (int u = 0; u < updates; u++, ops++)
+        {
+            trie = trie->insert(pool->values[pick(count)], pool->values[pick(count)]);
+            state->values[0] = trie;
+        }
+        ring->values[f % kept] = trie;
+    }
+    double trieVersions = since(start);
+
+    REMOVE_ROOT(state);
+    REMOVE_ROOT(ring);
+    REMOVE_ROOT(pool);
+
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             ",\"list_copy_ms\":%.3f,\"vector_versions_ms\":%.3f,\"map_copy_ms\":%.3f,\"trie_versions_ms\":%.3f,"
+             "\"vector_push_ms\":%.3f,\"vector_transient_ms\":%.3f",
+             listCopy, vectorVersions, mapCopy, trieVersions, vectorPush, vectorTransient);
+    extra = buffer;
+    return ops;
+}
+
+// A 1M element list with 1% of its slots replaced between collections:
+// full collections against minor ones that rescan only the written cards.
+static double mutateAndCollect(List *list, int updates, uint32_t &seed)
+{
+    {
+        CollectionPause pause;
+        for (int u = 0; u < updates; u++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            list->set((int)((seed >> 8) % list->values.size()), NEW_INTEGER(u));
+        }
+    }
+    Factory::as().collect();
+    return Factory::as().stats().lastPause;
+}
+
+static size_t cardMarking(int scale)
+{
+    const int count = 1000000 * scale;
+    const int updates = count / 100;
+    const int cycles = 2 * (GC_MINOR_PER_MAJOR + 1);
+    uint32_t seed = 1;
+    size_t ops = 0;
+
+    List *list = NEW_LIST();
+    ADD_ROOT(list);
+    {
+        CollectionPause pause;
+        list->values.reserve(count);
+        for (int i = 0; i < count; i++)
+            list->add(NEW_INTEGER(i));
+    }
+    Factory::as().collect();
+
+    double full = 0.0;
+    for (int c = 0; c < cycles; c++, ops += updates)
+        full += mutateAndCollect(list, updates, seed);
+
+    Factory::as().setGenerational(true);
+    Factory::as().collect();
+    size_t minorsBefore = Factory::as().stats().minorCollections;
+    size_t cardsBefore = Factory::as().stats().cardsScanned;
+    double minor = 0.0;
+    double major = 0.0;
+    for (int c = 0; c < cycles; c++, ops += updates)
+    {
+        size_t minors = Factory::as().stats().minorCollections;
+        double pause = mutateAndCollect(list, updates, seed);
+        if (Factory::as().stats().minorCollections != minors)
+            minor += pause;
+        else
+            major += pause;
+    }
+    size_t minors = Factory::as().stats().minorCollections - minorsBefore;
+    size_t cards = Factory::as().stats().cardsScanned - cardsBefore;
+    Factory::as().setGenerational(false);
+    REMOVE_ROOT(list);
+
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             ",\"list_size\":%d,\"updates_per_cycle\":%d,\"full_ms\":%.3f,\"minor_ms\":%.3f,\"major_ms\":%.3f,"
+             "\"cards_per_minor\":%zu",
+             count, updates, full / cycles, minors ? minor / minors : 0.0,
+             cycles > (int)minors ? major / (cycles - minors) : 0.0, minors ? cards / minors : 0);
+    extra = buffer;
+    return ops;
+}
+
+// Two-element List keys, every one of the same length, in a Map.
+static List *compositeKey(int a, int b)
+{
+    CollectionPause pause;
+    List *key = NEW_LIST();
+    key->add(NEW_INTEGER(a));
+    key->add(NEW_INTEGER(b));
+    return key;
+}
+
+static size_t compositeKeys(int scale)
+{
+    const int count = 100000 * scale;
+    size_t ops = 0;
+
+    Map *map = NEW_MAP();
+    ADD_ROOT(map);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++, ops++)
+    {
+        CollectionPause pause;
+        map->insert(compositeKey(i, i * 7), NEW_INTEGER(i));
+    }
+    std::chrono::duration<double, std::milli> insert = std::chrono::steady_clock::now() - start;
+
+    size_t found = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++, ops++)
+    {
+        if (map->get(compositeKey(i, i * 7)) != nullptr)
+            found++;
+    }
+    std::chrono::duration<double, std::milli> lookup = std::chrono::steady_clock::now() - start;
+
+    size_t longest = 0;
+    for (size_t b = 0; b < map->values.bucket_count(); b++)
+        longest = std::max(longest, map->values.bucket_size(b));
+    size_t entries = map->values.size();
+    REMOVE_ROOT(map);
+
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), ",\"entries\":%zu,\"found\":%zu,\"longest_bucket\":%zu,\"insert_ms\":%.3f,\"lookup_ms\":%.3f",
+             entries, found, longest, insert.count(), lookup.count());
+    extra = buffer;
+    return ops;
+}
+
+// Per-frame temporaries in a child scope, one result per frame kept: the
+// same frames through the heap and with each in a Region.
+static size_t frameTemporaries(Scope *global, List *results, int frames, bool regions)
+{
+    size_t ops = 0;
+    for (int f = 0; f < frames; f++)
+    {
+        bool region = regions && Factory::as().beginRegion();
+        Scope *local = NEW_SCOPE(global);
+        ADD_ROOT(local);
+        List *points = NEW_LIST();
+        local->define("points", points);
+        for (int i = 0; i < 32; i++, ops++)
+        {
+            CollectionPause pause;
+            List *point = NEW_LIST();
+            point->add(NEW_INTEGER(f));
+            point->add(NEW_REAL(i * 0.5));
+            points->add(point);
+        }
+        local->define("label", NEW_STRING("frame"));
+        List *result = NEW_LIST();
+        result->add(points->values[f % 32]);
+        results->add(result);
+        if (results->values.size() == 1024)
+            results->values.clear();
+        REMOVE_ROOT(local);
+        if (region)
+            Factory::as().endRegion();
+    }
+    return ops;
+}
+
+static size_t regionTemporaries(int scale)
+{
+    const int frames = 100000 * scale;
+    size_t ops = 0;
+
+    Scope *global = NEW_SCOPE(nullptr);
+    ADD_ROOT(global);
+    List *results = NEW_LIST();
+    global->define("results", results);
+
+    double ms[2];
+    size_t collections[2];
+    for (int regions = 0; regions < 2; regions++)
+    {
+        Factory::as().collect();
+        size_t before = Factory::as().stats().collections;
+        auto start = std::chrono::steady_clock::now();
+        ops += frameTemporaries(global, results, frames, regions != 0);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        ms[regions] = elapsed.count();
+        collections[regions] = Factory::as().stats().collections - before;
+        results->values.clear();
+    }
+    REMOVE_ROOT(global);
+
+    const GCStats &stats = Factory::as().stats();
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             ",\"frames\":%d,\"heap_ms\":%.3f,\"region_ms\":%.3f,\"heap_collections\":%zu,"
+             "\"region_collections\":%zu,\"region_freed\":%zu,\"region_promoted\":%zu",
+             frames, ms[0], ms[1], collections[0], collections[1], stats.regionFreed, stats.regionPromoted);
+    extra = buffer;
+    return ops;
+}
+
+// A large live graph whose rows the mutator keeps rewriting, with garbage
+// on the side: the same run stopping for every collection, then marking and
+// sweeping on the collector thread.
+static double rewriteRows(List *graph, int updates, uint32_t &seed)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int u = 0; u < updates; u++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        List *row = static_cast<List *>(graph->values[(seed >> 8) % graph->values.size()]);
+        row->set((int)((seed >> 20) % row->values.size()), NEW_INTEGER(u));
+        NEW_STRING("garbage");
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+static size_t concurrentMark(int scale)
+{
+    const int rows = 20000 * scale;
+    const int width = 100;
+    const int updates = 2000000 * scale;
+    uint32_t seed = 1;
+
+    List *graph = NEW_LIST();
+    ADD_ROOT(graph);
+    {
+        CollectionPause pause;
+        for (int r = 0; r < rows; r++)
+        {
+            List *row = NEW_LIST();
+            graph->add(row);
+            for (int i = 0; i < width; i++)
+                row->add(NEW_INTEGER(i));
+        }
+    }
+    Factory::as().collect();
+    size_t live = Factory::as().size();
+    Arena::as().setCollectGrowth(Arena::as().size() / 4);
+
+    double ms[2];
+    double p99[2];
+    double longest[2];
+    size_t collections[2];
+    for (int concurrent = 0; concurrent < 2; concurrent++)
+    {
+        Factory::as().setConcurrentMarking(concurrent != 0);
+        size_t first = pauses.size();
+        size_t before = Factory::as().stats().collections;
+        ms[concurrent] = rewriteRows(graph, updates, seed);
+        collections[concurrent] = Factory::as().stats().collections - before;
+        std::vector<double> run(pauses.begin() + first, pauses.end());
+        Factory::as().finishCollection();
+        p99[concurrent] = percentile(run, 0.99);
+        longest[concurrent] = run.empty() ? 0.0 : run.back();
+    }
+    double thread = Factory::as().stats().concurrentTime;
+    Factory::as().setConcurrentMarking(false);
+    Arena::as().setCollectGrowth(0);
+    REMOVE_ROOT(graph);
+
+    char buffer[384];
+    snprintf(buffer, sizeof(buffer),
+             ",\"live_objects\":%zu,\"stw_ms\":%.3f,\"stw_collections\":%zu,\"stw_p99_ms\":%.3f,"
+             "\"stw_max_ms\":%.3f,\"concurrent_ms\":%.3f,\"concurrent_collections\":%zu,"
+             "\"concurrent_p99_ms\":%.3f,\"concurrent_max_ms\":%.3f,\"collector_thread_ms\":%.3f",
+             live, ms[0], collections[0], p99[0], longest[0], ms[1], collections[1], p99[1], longest[1], thread);
+    extra = buffer;
+    return 2 * (size_t)updates;
+}
+
+// Lists, maps and scopes that mostly hold references to each other: the
+// shape where SIMPLESGC_COMPRESSED_REFS halves the container slots. Build
+// the tree both ways and compare arena bytes and mark time.
+static size_t pointerGraph(int scale)
+{
+    const int nodes = 100000 * scale;
+    const int degree = 8;
+    const int rounds = 5;
+    uint32_t seed = 1;
+    auto pick = [&seed](int n)
+    {
+        seed = seed * 1664525 + 1013904223;
+        return (int)((seed >> 8) % n);
+    };
+
+    List *all = NEW_LIST();
+    ADD_ROOT(all);
+    {
+        CollectionPause pause;
+        std::vector<Scope *> scopes;
+        for (int i = 0; i < nodes; i++)
+        {
+            List *node = NEW_LIST();
+            Scope *scope = NEW_SCOPE(i ? scopes[pick(i)] : nullptr);
+            scopes.push_back(scope);
+            scope->define("node", node);
+            all->add(node);
+            all->add(scope);
+        }
+        for (int i = 0; i < nodes; i++)
+        {
+            List *node = static_cast<List *>(all->values[2 * i]);
+            for (int e = 0; e < degree; e++)
+                node->add(all->values[2 * pick(nodes)]);
+            Map *edges = NEW_MAP();
+            for (int e = 0; e < degree / 2; e++)
+                edges->insert(NEW_INTEGER(e), all->values[2 * pick(nodes) + 1]);
+            node->add(edges);
+        }
+    }
+    Factory::as().collect();
+    size_t live = Factory::as().size();
+    size_t bytes = Arena::as().size();
+    size_t committed = Arena::as().committed();
+
+    double mark = 1e9;
+    double collect = 1e9;
+    for (int r = 0; r < rounds; r++)
+    {
+        // markOnce roots the graph itself
+        REMOVE_ROOT(all);
+        mark = std::min(mark, markOnce(all, MARK_DEPTH_FIRST));
+        ADD_ROOT(all);
+        auto start = std::chrono::steady_clock::now();
+        Factory::as().collect();
+        collect = std::min(collect, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    REMOVE_ROOT(all);
+
+#ifdef GC_COMPRESSED_REFS
+    const char *compressed = "true";
+#else
+    const char *compressed = "false";
+#endif
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             ",\"compressed\":%s,\"live_objects\":%zu,\"arena_kb\":%zu,\"committed_kb\":%zu,"
+             "\"mark_ms\":%.3f,\"collect_ms\":%.3f",
+             compressed, live, bytes / 1024, committed / 1024, mark, collect);
+    extra = buffer;
+    return (size_t)nodes * (2 + degree + degree / 2);
+}
+
+struct Workload
+{
+    const char *name;
+    size_t (*run)(int scale);
+};
+
+static const Workload workloads[] = {
+    {"binary_trees", binaryTrees},
+    {"user_trees", userTrees},
+    {"integer_churn", integerChurn},
+    {"pointer_lists", pointerLists},
+    {"batch_pointers", batchPointers},
+    {"native_accounted", nativeAccounted},
+    {"native_unaccounted", nativeUnaccounted},
+    {"string_maps", stringMaps},
+    {"scope_chains", scopeChains},
+    {"heap_image", heapImage},
+    {"packed_arrays", packedArrays},
+    {"parallel_sweep", parallelSweep},
+    {"memory_limit", memoryLimit},
+    {"mark_order", markOrder},
+    {"persistent_snapshots", persistentSnapshots},
+    {"card_marking", cardMarking},
+    {"composite_keys", compositeKeys},
+    {"region_temporaries", regionTemporaries},
+    {"concurrent_mark", concurrentMark},
+    {"pointer_graph", pointerGraph},
+};
+
+//**************************************************************************** */
+// driver
+
+static ArenaOptions arenaOptions;
+
+static std::string runWorkload(const Workload &workload, int scale)
+{
+    Arena::as().configure(arenaOptions);
+    Factory::as().setOnCollect(onCollect);
+
+    auto start = std::chrono::steady_clock::now();
+    size_t ops = workload.run(scale);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    const GCStats &stats = Factory::as().stats();
+    std::vector<double> sorted = pauses;
+
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer),
+             "{\"name\":\"%s\",\"scale\":%d,\"ops\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+             "\"peak_rss_kb\":%ld,\"collections\":%zu,\"objects_freed\":%zu,\"bytes_freed\":%zu,"
+             "\"finalized\":%zu,\"pause_ms\":{\"total\":%.4f,\"mean\":%.4f,\"p50\":%.4f,"
+             "\"p90\":%.4f,\"p99\":%.4f,\"max\":%.4f},\"block_kb\":%zu,\"blocks\":%zu,"
+             "\"huge_blocks\":%zu%s}",
+             workload.name, scale, ops, elapsed.count(), ops / elapsed.count(),
+             peakRss(), stats.collections, stats.objectsFreed, stats.bytesFreed,
+             finalized, stats.totalPause,
+             stats.collections ? stats.totalPause / stats.collections : 0.0,
+             percentile(sorted, 0.50), percentile(sorted, 0.90),
+             percentile(sorted, 0.99), stats.maxPause, Arena::as().options().blockSize / 1024,
+             Arena::as().blockCount(), Arena::as().hugeBlocks(), extra.c_str());
+
+    Factory::as().clean();
+    return buffer;
+}
+
+static bool runIsolated(const Workload &workload, int scale, std::string &json)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+
+    if (pid == 0)
+    {
+        // the collector logs to stdout; keep it out of the report
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        close(fds[0]);
+        std::string result = runWorkload(workload, scale);
+        ssize_t written = write(fds[1], result.data(), result.size());
+        close(fds[1]);
+        _exit(written == (ssize_t)result.size() ? 0 : 1);
+    }
+
+    close(fds[1]);
+    char buffer[512];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+        json.append(buffer, n);
+    close(fds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 && !json.empty();
+}
+
+static void usage()
+{
+    std::cerr << "usage: gcbench [--scale N] [--block-size BYTES] [--huge-pages] [workload...]" << std::endl;
+    std::cerr << "workloads:";
+    for (const Workload &w : workloads)
+        std::cerr << " " << w.name;
+    std::cerr << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    int scale = 1;
+    std::vector<const Workload *> selected;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+        {
+            scale = std::max(1, atoi(argv[++i]));
+            continue;
+        }
+        if (strcmp(argv[i], "--block-size") == 0 && i + 1 < argc)
+        {
+            arenaOptions.blockSize = (size_t)atol(argv[++i]);
+            if (arenaOptions.blockSize < ARENA_MIN_BLOCK_SIZE || (arenaOptions.blockSize & (arenaOptions.blockSize - 1)) != 0)
+            {
+                std::cerr << "--block-size must be a power of two of at least " << ARENA_MIN_BLOCK_SIZE << std::endl;
+                return 1;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--huge-pages") == 0)
+        {
+            arenaOptions.hugePages = true;
+            continue;
+        }
+        const Workload *found = nullptr;
+        for (const Workload &w : workloads)
+            if (strcmp(argv[i], w.name) == 0)
+                found = &w;
+        if (found == nullptr)
+        {
+            usage();
+            return 1;
+        }
+        selected.push_back(found);
+    }
+    if (selected.empty())
+        for (const Workload &w : workloads)
+            selected.push_back(&w);
+
+    int failures = 0;
+    std::cout << "{\"benchmarks\":[";
+    for (size_t i = 0; i < selected.size(); i++)
+    {
+        std::string json;
+        if (!runIsolated(*selected[i], scale, json))
+        {
+            std::cerr << "workload " << selected[i]->name << " failed" << std::endl;
+            json = std::string("{\"name\":\"") + selected[i]->name + "\",\"error\":true}";
+            failures++;
+        }
+        std::cout << (i ? "," : "") << "\n  " << json;
+    }
+    std::cout << "\n]}" << std::endl;
+    return failures ? 1 : 0;
+}
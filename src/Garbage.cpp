@@ -1,13 +1,59 @@
 #include "pch.h"
 #include "Garbage.hpp"
 #include <time.h>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 size_t GC_DYNAMIC_THRESHOLD = 2024*2;
 clock_t lastCollectTime = 0;
 const size_t collectFrequency = 100;
 
+OnTraceFunction onTrace = nullptr;
+std::atomic<OnPhaseFunction> onPhase{nullptr};
+#ifdef GC_COMPRESSED_REFS
+char *compressedBase = nullptr;
+#endif
+// collections the arena starts are not traced, a replay starts its own
+bool collectTriggered = false;
+
+// concurrent marking; the flags are only touched by the program's thread
+bool markingConcurrently = false;
+bool cycleRunning = false; // allocation steps the cycle
+std::mutex markMutex;
+std::atomic<size_t> markWaiting{0};
+std::vector<Object *> satbQueue;
+
+void lockMarking()
+{
+    // the collector thread lets go as soon as it sees a waiter
+    markWaiting.fetch_add(1, std::memory_order_relaxed);
+    markMutex.lock();
+    markWaiting.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void unlockMarking()
+{
+    markMutex.unlock();
+}
+
+void logDeleted(Object *value)
+{
+    satbQueue.push_back(value);
+}
+
 size_t adjustThreshold()
 {
+    if (Arena::as().collectGrowth() != 0)
+        return Arena::as().size() + Arena::as().collectGrowth();
+
     clock_t currentTime = clock();
     double elapsedTime = (double)(currentTime - lastCollectTime) * 1000.0 / CLOCKS_PER_SEC;
 
@@ -25,41 +71,513 @@ size_t adjustThreshold()
     }
 }
 
-void *Arena::allocate(size_t size)
+void *Arena::take(size_t size)
+{
+    size_t index = size / ARENA_ALIGN;
+    void *p = freeLists[index];
+    if (p != nullptr)
+    {
+        freeLists[index] = *static_cast<void **>(p);
+        return p;
+    }
+
+    return reserve(size);
+}
+
+void *Arena::takeLarge(size_t size)
 {
+    if (_limit != 0 && committed() + size > _limit)
+        return nullptr;
+    void *p = std::malloc(size);
+    if (p != nullptr)
+        _committed += size;
+    return p;
+}
 
-     if (currentOffset + size > blockSize) 
-     {
-        allocateNewBlock();   
+void *Arena::allocate(size_t size)
+{
+    size = roundUp(size);
+    void *p = size > ARENA_SMALL_LIMIT ? takeLarge(size) : take(size);
+    for (int step = 0; p == nullptr && relieve(step, size); step++)
+        p = size > ARENA_SMALL_LIMIT ? takeLarge(size) : take(size);
+    if (p == nullptr)
+    {
+        outOfMemory(size);
+        return nullptr;
     }
+    this->_size += size;
+
+    if ((this->_size > GC_DYNAMIC_THRESHOLD || this->_external > externalLimit) && !Factory::as().collectionPaused())
+        triggerCollect();
+    else if (cycleRunning && !Factory::as().collectionPaused())
+        Factory::as().stepCollection();
+
+    return p;
+}
 
-    void* p = currentBlock + currentOffset;  
-    currentOffset += size;  
+// container storage is accounted like objects but never starts a collection,
+// the objects being stored may not be reachable yet
+void *Arena::allocateStorage(size_t size)
+{
+    size = roundUp(size);
+    void *p = size > ARENA_SMALL_LIMIT ? takeLarge(size) : take(size);
+    if (p == nullptr && trimOnPressure && trim() > 0)
+        p = size > ARENA_SMALL_LIMIT ? takeLarge(size) : take(size);
+    if (p == nullptr)
+    {
+        outOfMemory(size);
+        throw std::bad_alloc();
+    }
     this->_size += size;
+    return p;
+}
+
+// one accounting step and one trigger check for count objects of size bytes;
+// whatever the free list cannot supply comes from a single bump reservation
+bool Arena::allocateBatch(size_t size, size_t count, void **out)
+{
+    if (count == 0)
+        return true;
+    size = roundUp(size);
+    this->_size += size * count;
 
-    if (this->_size > GC_DYNAMIC_THRESHOLD)
+    if ((this->_size > GC_DYNAMIC_THRESHOLD || this->_external > externalLimit) && !Factory::as().collectionPaused())
+        triggerCollect();
+    else if (cycleRunning && !Factory::as().collectionPaused())
+        Factory::as().stepCollection();
+
+    size_t i = fillBatch(size, count, out, 0);
+    for (int step = 0; i < count && relieve(step, size * (count - i)); step++)
+        i = fillBatch(size, count, out, i);
+    if (i == count)
+        return true;
+
+    // all or nothing: hand back the slots already taken
+    for (size_t j = 0; j < i; j++)
+        free(out[j], size);
+    this->_size -= size * (count - i);
+    for (size_t j = 0; j < count; j++)
+        out[j] = nullptr;
+    outOfMemory(size * (count - i));
+    return false;
+}
+
+size_t Arena::fillBatch(size_t size, size_t count, void **out, size_t i)
+{
+    size_t index = size / ARENA_ALIGN;
+    while (i < count && freeLists[index] != nullptr)
     {
-        Factory::as().collect();
-        GC_DYNAMIC_THRESHOLD = adjustThreshold();
+        out[i++] = freeLists[index];
+        freeLists[index] = *static_cast<void **>(freeLists[index]);
     }
 
+    // bump the rest, moving to a new block whenever the current one is full
+    while (i < count)
+    {
+        size_t room = (_options.blockSize - currentOffset) / size;
+        if (room == 0)
+        {
+            if (!allocateNewBlock())
+                break;
+            continue;
+        }
+        size_t n = std::min(room, count - i);
+        char *p = currentBlock + currentOffset;
+        currentOffset += n * size;
+        for (size_t end = i + n; i < end; i++, p += size)
+            out[i] = p;
+    }
+    return i;
+}
+
+// Steps of the low-memory path, cheapest first. Each returns true when it
+// ran and the allocation is worth retrying. Allocations made from inside a
+// step (finalizers, the pressure callback) do not recurse into it.
+bool Arena::relieve(int step, size_t size)
+{
+    if (recovering || step > 1 || (step == 1 && onPressure == nullptr))
+        return false;
+
+    recovering = true;
+    if (step == 1)
+        onPressure(size, committed(), _limit);
+    if (!Factory::as().collectionPaused())
+    {
+        phaseInstant(PHASE_TRIGGER, TRIGGER_PRESSURE);
+        collectTriggered = true;
+        Factory::as().collectEmergency();
+        collectTriggered = false;
+    }
+    if (trimOnPressure)
+        trim();
+    recovering = false;
+    return true;
+}
+
+void Arena::outOfMemory(size_t size)
+{
+    _failures++;
+    std::cout << "Out of memory allocating " << size << " bytes, " << committed() << " committed";
+    if (_limit != 0)
+        std::cout << " of " << _limit;
+    std::cout << std::endl;
+}
+
+void *Arena::reserve(size_t size)
+{
+    if (currentOffset + size > _options.blockSize && !allocateNewBlock())
+        return nullptr;
+
+    void *p = currentBlock + currentOffset;
+    currentOffset += size;
     return p;
 }
 
+thread_local Arena::FreeBatch *Arena::localFree = nullptr;
+
 void Arena::free(void *p, size_t size)
 {
+    size = roundUp(size);
+    if (localFree != nullptr)
+    {
+        localFree->bytes += size;
+        if (size > ARENA_SMALL_LIMIT)
+        {
+            localFree->large += size;
+            std::free(p);
+            return;
+        }
+        size_t index = size / ARENA_ALIGN;
+        if (localFree->heads[index] == nullptr)
+            localFree->tails[index] = p;
+        *static_cast<void **>(p) = localFree->heads[index];
+        localFree->heads[index] = p;
+        return;
+    }
     this->_size -= size;
-   // std::free(p);
+    if (size > ARENA_SMALL_LIMIT)
+    {
+        _committed -= size;
+        std::free(p);
+        return;
+    }
+    size_t index = size / ARENA_ALIGN;
+    *static_cast<void **>(p) = freeLists[index];
+    freeLists[index] = p;
+}
+
+void Arena::redirectFree(FreeBatch *batch)
+{
+    localFree = batch;
+}
+
+void Arena::merge(FreeBatch &batch)
+{
+    for (size_t i = 0; i < ARENA_SIZE_CLASSES; i++)
+    {
+        if (batch.heads[i] == nullptr)
+            continue;
+        *static_cast<void **>(batch.tails[i]) = freeLists[i];
+        freeLists[i] = batch.heads[i];
+    }
+    this->_size -= batch.bytes;
+    _committed -= batch.large;
+}
+
+static const size_t blockHeader = Arena::roundUp(sizeof(ArenaBlock));
+
+bool Arena::allocateNewBlock()
+{
+    if (currentBlock != nullptr)
+        blockOf(currentBlock)->used = currentOffset;
+    if (!emptyBlocks.empty())
+        return reuseBlock();
+    if (_limit != 0 && committed() + _options.blockSize > _limit)
+        return false;
+
+    if (regions.empty() || regions.back().committed + _options.blockSize > regions.back().size)
+    {
+        if (!reserveRegion())
+            return false;
+    }
+    Region &region = regions.back();
+    char *block = region.base + region.committed;
+    bool huge = false;
+
+#ifdef _WIN32
+    if (VirtualAlloc(block, _options.blockSize, MEM_COMMIT, PAGE_READWRITE) == nullptr)
+    {
+        std::cout << "Arena cannot commit a block of " << _options.blockSize << " bytes" << std::endl;
+        return false;
+    }
+#else
+    bool committed = false;
+#ifdef MAP_HUGETLB
+    if (_options.hugePages)
+    {
+        // needs pages set aside in /proc/sys/vm/nr_hugepages; fall back to THP
+        void *p = mmap(block, _options.blockSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0);
+        committed = huge = p != MAP_FAILED;
+    }
+#endif
+    if (!committed && _options.hugePages)
+    {
+        // a failed MAP_FIXED may have dropped the reservation, so map it again
+        committed = mmap(block, _options.blockSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED;
+#ifdef MADV_HUGEPAGE
+        if (committed)
+            madvise(block, _options.blockSize, MADV_HUGEPAGE);
+#endif
+    }
+    else if (!committed)
+        committed = mprotect(block, _options.blockSize, PROT_READ | PROT_WRITE) == 0;
+    if (!committed)
+    {
+        std::cout << "Arena cannot commit a block of " << _options.blockSize << " bytes" << std::endl;
+        return false;
+    }
+#endif
+
+    region.committed += _options.blockSize;
+    _committed += _options.blockSize;
+    ArenaBlock *header = reinterpret_cast<ArenaBlock *>(block);
+    header->index = blocks.size();
+    header->used = blockHeader;
+    header->hugePages = huge;
+    header->decommitted = false;
+    blocks.push_back(header);
+
+    currentBlock = block;
+    currentOffset = blockHeader;
+    return true;
+}
+
+bool Arena::reserveRegion()
+{
+    size_t blockSize = _options.blockSize;
+    size_t size = std::max(blockSize, (_options.reserveSize + blockSize - 1) & ~(blockSize - 1));
+#ifdef GC_COMPRESSED_REFS
+    // every object must be within reach of a 32-bit offset from the first
+    if (!regions.empty())
+    {
+        std::cout << "Arena is out of its " << COMPRESSED_WINDOW << " byte compressed reference window" << std::endl;
+        return false;
+    }
+    size = std::min(size, COMPRESSED_WINDOW);
+#endif
+
+    // over-reserve by one block so the region can start on a block boundary
+#ifdef _WIN32
+    char *raw = static_cast<char *>(VirtualAlloc(nullptr, size + blockSize, MEM_RESERVE, PAGE_NOACCESS));
+    if (raw == nullptr)
+    {
+        std::cout << "Arena cannot reserve " << size << " bytes of address space" << std::endl;
+        return false;
+    }
+    char *base = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(raw) + blockSize - 1) & ~(uintptr_t)(blockSize - 1));
+    regions.push_back({base, size, 0, raw});
+#else
+    void *mapped = mmap(nullptr, size + blockSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapped == MAP_FAILED)
+    {
+        std::cout << "Arena cannot reserve " << size << " bytes of address space" << std::endl;
+        return false;
+    }
+    char *raw = static_cast<char *>(mapped);
+    char *base = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(raw) + blockSize - 1) & ~(uintptr_t)(blockSize - 1));
+    if (base > raw)
+        munmap(raw, base - raw);
+    munmap(base + size, raw + blockSize - base);
+    regions.push_back({base, size, 0, base});
+#endif
+#ifdef GC_COMPRESSED_REFS
+    compressedBase = base;
+#endif
+    return true;
+}
+
+void Arena::releaseRegions()
+{
+    for (Region &region : regions)
+    {
+#ifdef _WIN32
+        VirtualFree(region.mapping, 0, MEM_RELEASE);
+#else
+        munmap(region.base, region.size);
+#endif
+    }
+    regions.clear();
+    blocks.clear();
+    emptyBlocks.clear();
+    _committed = 0;
+    currentBlock = nullptr;
+    currentOffset = 0;
+}
+
+bool Arena::configure(const ArenaOptions &options)
+{
+    if (blocks.size() > 1 || currentOffset != blockHeader || _size != 0)
+    {
+        std::cout << "Arena already in use, cannot configure it" << std::endl;
+        return false;
+    }
+    size_t blockSize = options.blockSize;
+    if (blockSize < ARENA_MIN_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0)
+    {
+        std::cout << "Arena block size must be a power of two of at least " << ARENA_MIN_BLOCK_SIZE << " bytes" << std::endl;
+        return false;
+    }
+
+    releaseRegions();
+    _options = options;
+    if (_options.hugePages)
+        _options.blockSize = std::max(blockSize, ARENA_HUGE_PAGE_SIZE);
+    return allocateNewBlock();
+}
+
+static size_t pageSize()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+bool Arena::reuseBlock()
+{
+    ArenaBlock *header = emptyBlocks.back();
+    char *block = reinterpret_cast<char *>(header);
+    if (header->decommitted)
+    {
+        if (_limit != 0 && committed() + _options.blockSize > _limit)
+            return false;
+#ifdef _WIN32
+        // the header page was kept, only the rest has to come back
+        size_t page = pageSize();
+        if (VirtualAlloc(block + page, _options.blockSize - page, MEM_COMMIT, PAGE_READWRITE) == nullptr)
+            return false;
+#endif
+        header->decommitted = false;
+        _committed += _options.blockSize;
+    }
+    emptyBlocks.pop_back();
+    header->used = blockHeader;
+    currentBlock = block;
+    currentOffset = blockHeader;
+    return true;
 }
 
-void Arena::allocateNewBlock()
+size_t Arena::trim()
 {
-    currentBlock = static_cast<char *>(std::malloc(blockSize)); 
-    if (currentBlock)
+    if (currentBlock == nullptr)
+        return 0;
+    PhaseSpan span(PHASE_RELEASE);
+    blockOf(currentBlock)->used = currentOffset;
+
+    // a block is empty when its free slots add up to everything it handed out
+    std::vector<size_t> freeBytes(blocks.size(), 0);
+    for (size_t i = 0; i < ARENA_SIZE_CLASSES; i++)
+        for (void *p = freeLists[i]; p != nullptr; p = *static_cast<void **>(p))
+            if (contains(p))
+                freeBytes[blockOf(p)->index] += i * ARENA_ALIGN;
+
+    std::vector<bool> empty(blocks.size(), false);
+    size_t count = 0;
+    for (ArenaBlock *block : blocks)
+    {
+        if (reinterpret_cast<char *>(block) == currentBlock || block->used == blockHeader)
+            continue;
+        if (freeBytes[block->index] == block->used - blockHeader)
+        {
+            empty[block->index] = true;
+            count++;
+        }
+    }
+    if (count == 0)
+        return 0;
+
+    for (size_t i = 0; i < ARENA_SIZE_CLASSES; i++)
     {
-        blocks.push_back(currentBlock); 
-        currentOffset = 0;             
+        void **link = &freeLists[i];
+        while (*link != nullptr)
+        {
+            void *p = *link;
+            if (contains(p) && empty[blockOf(p)->index])
+                *link = *static_cast<void **>(p);
+            else
+                link = static_cast<void **>(p);
+        }
+    }
+
+    size_t page = pageSize();
+    for (ArenaBlock *block : blocks)
+    {
+        if (!empty[block->index])
+            continue;
+        block->used = blockHeader;
+        emptyBlocks.push_back(block);
+
+        // huge pages cannot be given back in part; keep them for reuse
+        char *rest = reinterpret_cast<char *>(block) + page;
+#ifdef _WIN32
+        bool released = VirtualFree(rest, _options.blockSize - page, MEM_DECOMMIT) != 0;
+#else
+        bool released = !block->hugePages && madvise(rest, _options.blockSize - page, MADV_DONTNEED) == 0;
+#endif
+        if (released)
+        {
+            block->decommitted = true;
+            _committed -= _options.blockSize;
+        }
     }
+    span.arg = count;
+    return count;
+}
+
+bool Arena::contains(const void *p) const
+{
+    const char *c = static_cast<const char *>(p);
+    for (const Region &region : regions)
+        if (c >= region.base && c < region.base + region.committed)
+            return true;
+    return false;
+}
+
+size_t Arena::hugeBlocks() const
+{
+    size_t count = 0;
+    for (const ArenaBlock *block : blocks)
+        count += block->hugePages;
+    return count;
+}
+
+void Arena::triggerCollect()
+{
+    phaseInstant(PHASE_TRIGGER, _size > GC_DYNAMIC_THRESHOLD ? TRIGGER_THRESHOLD : TRIGGER_EXTERNAL);
+    collectTriggered = true;
+    Factory::as().collect();
+    collectTriggered = false;
+    // a concurrent cycle left running has set its own pacing threshold
+    if (!cycleRunning)
+        GC_DYNAMIC_THRESHOLD = adjustThreshold();
+}
+
+void Arena::setCollectGrowth(size_t bytes)
+{
+    _collectGrowth = bytes;
+    if (bytes != 0)
+        GC_DYNAMIC_THRESHOLD = _size + bytes;
+}
+
+void Arena::adopt(void *block, size_t size, OnReleaseFunction release)
+{
+    adopted.push_back({block, size, release});
+    this->_size += size;
 }
 
 //**************************************************************************** */
@@ -67,30 +585,46 @@ void Arena::allocateNewBlock()
 
 bool Scope::remove(const std::string &name)
 {
-    return values.erase(name);
+    if (onTrace != nullptr)
+        onTrace({TRACE_SCOPE_REMOVE, this, nullptr, nullptr, 0, &name});
+    auto it = values.find(name);
+    if (it == values.end())
+        return false;
+    MutationLock lock;
+    deletionBarrier(it->second);
+    values.erase(it);
+    return true;
 }
 
 bool Scope::define(const std::string &name, const std::string &value)
 {
     Object *obj = Factory::as().newString(value);
+    if (obj == nullptr)
+        return false;
     return define(name, obj);
 }
 
 bool Scope::define(const std::string &name, int value)
 {
     Object *obj = Factory::as().newInteger(value);
+    if (obj == nullptr)
+        return false;
     return define(name, obj);
 }
 
 bool Scope::define(const std::string &name, double value)
 {
     Object *obj = Factory::as().newReal(value);
+    if (obj == nullptr)
+        return false;
     return define(name, obj);
 }
 
 bool Scope::define(const std::string &name)
 {
     Object *obj = Factory::as().newNil();
+    if (obj == nullptr)
+        return false;
     return define(name, obj);
 }
 
@@ -118,160 +652,1366 @@ double Scope::getReal(const std::string &name)
             return static_cast<Real *>(obj)->value;
         }
     }
-    return 0;
+    return 0;
+}
+
+std::string Scope::getString(const std::string &name)
+{
+    Object *obj;
+    if (tryLookup(name, &obj))
+    {
+        if (obj->type == ObjectType::STRING)
+        {
+            return static_cast<String *>(obj)->value;
+        }
+    }
+    return "";
+}
+
+//**************************************************************************** */
+// Factory
+
+// void Factory::mark()
+// {
+//     if (roots.empty())
+//     {
+//         std::cout << "Nothing to mark" << std::endl;
+//         return;
+//     }
+
+//     std::cout << "Total objects: " << roots.size() << " to mark" << std::endl;
+//     std::vector<Object *> worklist(roots.begin(), roots.end());
+//     while (!worklist.empty())
+//     {
+//         auto obj = worklist.back();
+//         worklist.pop_back();
+
+//         if (!obj->marked)
+//         {
+//             obj->marked = true;
+//             if (obj->type == ObjectType::SCOPE)
+//             {
+//                 Scope *scope = static_cast<Scope *>(obj);
+//                 for (auto it = scope->values.begin(); it != scope->values.end(); ++it)
+//                 {
+//                     worklist.insert(worklist.end(), it->second);
+//                 }
+//                 if (scope->parent != nullptr)
+//                     worklist.insert(worklist.end(), scope->parent);
+//             }
+//         }
+//     }
+// }
+
+/// fifo
+
+// region objects may be held by C++ locals, so all of them are roots until
+// the region ends, as are the outer objects remembered in it
+template <typename Visitor>
+void Factory::forEachRegionRoot(Visitor &&visit)
+{
+    for (RegionFrame &frame : regionFrames)
+    {
+        for (Object *obj : frame.objects)
+            visit(obj);
+        for (Object *owner : frame.owners)
+            visit(owner);
+    }
+}
+
+void Factory::mark()
+{
+    if (cycleRunning)
+    {
+        std::cout << "Cannot mark during a concurrent cycle" << std::endl;
+        return;
+    }
+    PhaseSpan span(PHASE_MARK);
+    weakRefs.clear();
+    weakMaps.clear();
+
+    if (roots.empty() && regionFrames.empty())
+    {
+        std::cout << "Nothing to mark" << std::endl;
+        return;
+    }
+
+    if (markOrder == MARK_BREADTH_FIRST)
+        markBreadthFirst();
+    else
+        markDepthFirst();
+}
+
+void Factory::markBreadthFirst()
+{
+    //  std::cout << "Total objects: " << roots.size() << " to mark" << std::endl;
+    std::deque<Object *> worklist;
+    {
+        PhaseSpan span(PHASE_ROOTS);
+        worklist.assign(roots.begin(), roots.end());
+        forEachRegionRoot([&](Object *obj)
+                          { worklist.push_back(obj); });
+    }
+
+    do
+    {
+        while (!worklist.empty())
+        {
+            Object *obj = worklist.front();
+            worklist.pop_front();
+
+            if (!obj->marked)
+            {
+                obj->marked = true;
+
+                if (obj->type == ObjectType::WEAK_REF)
+                    weakRefs.push_back(static_cast<WeakRef *>(obj));
+                else if (obj->type == ObjectType::WEAK_MAP)
+                    weakMaps.push_back(static_cast<WeakMap *>(obj));
+
+                forEachChild(obj, [&](Object *child)
+                             {
+                                 if (!child->marked)
+                                     worklist.push_back(child);
+                             });
+            }
+        }
+        markEphemerons(worklist);
+    } while (!worklist.empty());
+}
+
+/// lifo
+
+void Factory::markDepthFirst()
+{
+    markStack.clear();
+    markOverflow = false;
+    {
+        PhaseSpan span(PHASE_ROOTS);
+        for (Object *root : roots)
+            pushMark(root, 0);
+        forEachRegionRoot([&](Object *obj)
+                          { pushMark(obj, 0); });
+    }
+
+    do
+    {
+        drainMarkStack();
+        markEphemerons();
+    } while (!markStack.empty());
+}
+
+#if defined(__GNUC__)
+#define MARK_PREFETCH(p) __builtin_prefetch(p, 1)
+#else
+#define MARK_PREFETCH(p)
+#endif
+
+// Entries pass through a small FIFO between the stack and the scan, so every
+// object is prefetched MARK_PREFETCH_DISTANCE scans before it is first read.
+void Factory::drainMarkStack()
+{
+    MarkEntry ahead[MARK_PREFETCH_DISTANCE];
+    size_t head = 0;
+    size_t count = 0;
+
+    for (;;)
+    {
+        while (count < MARK_PREFETCH_DISTANCE && !markStack.empty())
+        {
+            MarkEntry entry = markStack.back();
+            markStack.pop_back();
+            MARK_PREFETCH(entry.obj);
+            ahead[(head + count++) % MARK_PREFETCH_DISTANCE] = entry;
+        }
+        if (count == 0)
+        {
+            if (!markOverflow)
+                return;
+            markOverflow = false;
+            gcStats.markOverflows++;
+            rescanMarked();
+            continue;
+        }
+        MarkEntry entry = ahead[head];
+        head = (head + 1) % MARK_PREFETCH_DISTANCE;
+        count--;
+        scanMark(entry);
+    }
+}
+
+// children are pushed without being looked at; the marked check waits
+// until they come off the stack and their line has been prefetched
+void Factory::scanMark(const MarkEntry &entry)
+{
+    Object *obj = entry.obj;
+    if (entry.next == 0)
+    {
+        if (obj->marked)
+            return;
+        obj->marked = true;
+
+        if (obj->type == ObjectType::WEAK_REF)
+            weakRefs.push_back(static_cast<WeakRef *>(obj));
+        else if (obj->type == ObjectType::WEAK_MAP)
+            weakMaps.push_back(static_cast<WeakMap *>(obj));
+    }
+
+    if (obj->type == ObjectType::LIST)
+    {
+        // the rest of a long list waits below its first slice, which is
+        // pushed back to front so a trailing link is followed last and the
+        // stack stays flat on linked structures
+        List *list = static_cast<List *>(obj);
+        size_t end = std::min(list->values.size(), entry.next + MARK_SLICE);
+        if (end < list->values.size())
+            pushMark(obj, end);
+        for (size_t i = end; i-- > entry.next;)
+            pushMark(list->values[i], 0);
+        return;
+    }
+    if (obj->type == ObjectType::MAP)
+    {
+        // maps are sliced by bucket
+        Map *map = static_cast<Map *>(obj);
+        size_t buckets = map->values.bucket_count();
+        size_t end = std::min(buckets, entry.next + MARK_SLICE);
+        if (end < buckets)
+            pushMark(obj, end);
+        for (size_t i = entry.next; i < end; i++)
+        {
+            for (auto it = map->values.begin(i); it != map->values.end(i); ++it)
+            {
+                pushMark(it->first, 0);
+                if (it->second != nullptr)
+                    pushMark(it->second, 0);
+            }
+        }
+        return;
+    }
+    forEachChild(obj, [&](Object *child)
+                 { pushMark(child, 0); });
+}
+
+// Pushes were dropped while the stack was full. Every reachable object still
+// unmarked is a root or hangs off a marked one, so scanning those finds it.
+void Factory::rescanMarked()
+{
+    auto rescan = [&](Object *obj)
+    {
+        if (!obj->marked)
+            return;
+        forEachChild(obj, [&](Object *child)
+                     {
+                         if (!child->marked)
+                             pushMark(child, 0);
+                     });
+    };
+    for (Object *root : roots)
+    {
+        if (!root->marked)
+            pushMark(root, 0);
+    }
+    forEachRegionRoot([&](Object *obj)
+                      {
+                          if (!obj->marked)
+                              pushMark(obj, 0);
+                          else
+                              rescan(obj);
+                      });
+    for (Object *obj : objects)
+        rescan(obj);
+}
+
+// a weak map value is reachable only once its key is
+void Factory::markEphemerons(std::deque<Object *> &worklist)
+{
+    for (WeakMap *map : weakMaps)
+    {
+        for (auto &it : map->values)
+        {
+            if ((it.first == nullptr || it.first->marked) && it.second != nullptr && !it.second->marked)
+                worklist.push_back(it.second);
+        }
+    }
+}
+
+void Factory::markEphemerons()
+{
+    for (WeakMap *map : weakMaps)
+    {
+        for (auto &it : map->values)
+        {
+            if ((it.first == nullptr || it.first->marked) && it.second != nullptr && !it.second->marked)
+                pushMark(it.second, 0);
+        }
+    }
+}
+
+void Factory::clearWeak()
+{
+    for (WeakRef *ref : weakRefs)
+    {
+        if (ref->target != nullptr && !ref->target->marked)
+            ref->target = nullptr;
+    }
+    for (WeakMap *map : weakMaps)
+    {
+        auto it = map->values.begin();
+        while (it != map->values.end())
+        {
+            if (it->first != nullptr && !it->first->marked)
+            {
+                it = map->values.erase(it);
+                map->cachedHash = 0;
+            }
+            else
+                ++it;
+        }
+    }
+    weakRefs.clear();
+    weakMaps.clear();
+}
+
+void Factory::sweep()
+{
+    if (cycleRunning)
+    {
+        std::cout << "Cannot sweep during a concurrent cycle" << std::endl;
+        return;
+    }
+    sweepFrom(0);
+}
+
+// objects before begin are old and not looked at; survivors keep their mark
+// in generational mode
+void Factory::sweepFrom(size_t begin)
+{
+    if (objects.empty())
+    {
+        std::cout << "Nothing to collect" << std::endl;
+        return;
+    }
+    //    std::cout << "Total objects: " << objects.size() << " to collect" << std::endl;
+    //   std::cout << "Total memory used: " << Arena::as().size() << " bytes." << std::endl;
+
+    clearWeak();
+
+    PhaseSpan span(PHASE_SWEEP);
+    size_t before = Arena::as().size();
+    size_t freed = gcStats.objectsFreed;
+    if (begin == 0 && !sweepWorkers.empty() && objects.size() >= SWEEP_PARALLEL_MIN)
+    {
+        sweepParallel();
+        gcStats.bytesFreed += before - Arena::as().size();
+        span.arg = gcStats.objectsFreed - freed;
+        return;
+    }
+
+    // dead Pointers are queued for finalization instead of being released here
+    size_t live = begin;
+    for (size_t i = begin; i < objects.size(); i++)
+    {
+        Object *object = objects[i];
+        if (object->marked)
+        {
+            object->marked = generationalMode;
+            objects[live++] = object;
+        }
+        else if (object->type == ObjectType::POINTER)
+        {
+            if (object->sampled && onSampleFree != nullptr)
+                onSampleFree(object);
+            finalizeQueue.push_back(static_cast<Pointer *>(object));
+            gcStats.objectsFreed++;
+        }
+        else
+        {
+            // std::cout << "GC " << object->toString() << std::endl;
+            this->free(object);
+            gcStats.objectsFreed++;
+        }
+    }
+    objects.resize(live);
+    gcStats.bytesFreed += before - Arena::as().size();
+    span.arg = gcStats.objectsFreed - freed;
+}
+
+void Factory::collect()
+{
+    if (onTrace != nullptr && !collectTriggered)
+        onTrace({TRACE_COLLECT, nullptr, nullptr, nullptr, fullRequested, nullptr});
+    if (!collectTriggered)
+        phaseInstant(PHASE_TRIGGER, TRIGGER_EXPLICIT);
+    if (concurrentMode)
+    {
+        collectConcurrent();
+        return;
+    }
+    PhaseSpan span(PHASE_COLLECT);
+    auto start = std::chrono::steady_clock::now();
+
+    reclaimFinalized();
+    if (!generationalMode)
+    {
+        mark();
+        sweep();
+    }
+    else if (!fullRequested && minorsSinceFull < GC_MINOR_PER_MAJOR)
+    {
+        markYoung();
+        sweepFrom(youngBegin);
+        minorsSinceFull++;
+        gcStats.minorCollections++;
+    }
+    else
+    {
+        forgetRemembered();
+        for (Object *obj : objects)
+            obj->marked = false;
+        mark();
+        sweep();
+        minorsSinceFull = 0;
+    }
+    fullRequested = false;
+    youngBegin = objects.size();
+    // region objects stay young until their region ends
+    for (RegionFrame &frame : regionFrames)
+        for (Object *obj : frame.objects)
+            obj->marked = false;
+
+    dispatchFinalizers();
+    Arena::as().paceExternal();
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    gcStats.collections++;
+    gcStats.lastPause = elapsed.count();
+    gcStats.totalPause += gcStats.lastPause;
+    if (gcStats.lastPause > gcStats.maxPause)
+        gcStats.maxPause = gcStats.lastPause;
+
+    if (onCollect != nullptr)
+        onCollect(gcStats);
+}
+
+void Factory::dispatchFinalizers()
+{
+    if (finalizerThread.joinable())
+    {
+        if (!finalizeQueue.empty())
+        {
+            std::lock_guard<std::mutex> lock(finalizerMutex);
+            finalizerPending.insert(finalizerPending.end(), finalizeQueue.begin(), finalizeQueue.end());
+            finalizeQueue.clear();
+            finalizerReady.notify_all();
+        }
+    }
+    else if (!deferFinalizers)
+    {
+        runFinalizers();
+    }
+}
+
+void Factory::collectEmergency()
+{
+    gcStats.emergencyCollections++;
+    fullRequested = true;
+    collect();
+
+    // finalizers are not deferred here, their native memory is needed now
+    if (finalizerThread.joinable())
+    {
+        std::unique_lock<std::mutex> lock(finalizerMutex);
+        finalizerReady.wait(lock, [&]
+                            { return finalizerPending.empty() && !finalizerBusy; });
+    }
+    reclaimFinalized();
+    runFinalizers();
+}
+
+void Factory::clean()
+{
+    finishCollection();
+    if (finalizerThread.joinable())
+    {
+        std::unique_lock<std::mutex> lock(finalizerMutex);
+        finalizerReady.wait(lock, [&]
+                            { return finalizerPending.empty() && !finalizerBusy; });
+    }
+    reclaimFinalized();
+    runFinalizers();
+
+    if (objects.empty())
+    {
+        std::cout << "Nothing to clean" << std::endl;
+        return;
+    }
+
+    std::cout << "Total objects: " << objects.size() << " to clean" << std::endl;
+    if (!objects.empty())
+    {
+        for (auto &obj : objects)
+        {
+            free(obj);
+        }
+    }
+    objects.clear();
+}
+
+//**************************************************************************** */
+// generational mode
+
+void rememberWrite(Object *owner, Object *value)
+{
+    Factory::as().rememberValue(owner, value);
+}
+
+void escapeWrite(Object *owner, Object *value)
+{
+    Factory::as().rememberEscape(owner, value);
+}
+
+void Factory::setGenerational(bool enabled)
+{
+    if (enabled == generationalMode)
+        return;
+    if (enabled && concurrentMode)
+    {
+        std::cout << "Generational mode does not work with concurrent marking" << std::endl;
+        return;
+    }
+    forgetRemembered();
+    // the first collection after switching treats everything as young
+    for (Object *obj : objects)
+        obj->marked = false;
+    generationalMode = enabled;
+    minorsSinceFull = 0;
+    youngBegin = 0;
+}
+
+void Factory::collectFull()
+{
+    fullRequested = true;
+    collect();
+}
+
+// a weak map is remembered whole, its entries must stay weak
+void Factory::rememberValue(Object *owner, Object *value)
+{
+    // survivors of a concurrent cycle stay marked until swept
+    if (!generationalMode)
+        return;
+    if (owner->type == ObjectType::WEAK_MAP)
+    {
+        remember(owner);
+        return;
+    }
+    if (!value->remembered)
+    {
+        value->remembered = true;
+        rememberedValues.push_back(value);
+    }
+}
+
+void Factory::rememberCards(List *list, size_t begin, size_t end)
+{
+    if (!generationalMode || begin >= end)
+        return;
+    if (list != cardList)
+    {
+        cardList = list;
+        cards = &cardTables[list];
+    }
+    size_t last = (end - 1) / CARD_SLOTS;
+    if (cards->size() <= last)
+        cards->resize(last + 1);
+    for (size_t card = begin / CARD_SLOTS; card <= last; card++)
+        (*cards)[card] = 1;
+}
+
+void Factory::forgetRemembered()
+{
+    for (Object *obj : rememberedObjects)
+        obj->remembered = false;
+    for (Object *obj : rememberedValues)
+        obj->remembered = false;
+    rememberedObjects.clear();
+    rememberedValues.clear();
+    cardTables.clear();
+    cardList = nullptr;
+    cards = nullptr;
+}
+
+// Old objects are marked already, so the traversal stops at them. What the
+// barriers remembered stands in for the old objects pointing at young ones.
+void Factory::markYoung()
+{
+    PhaseSpan span(PHASE_MARK);
+    weakRefs.clear();
+    weakMaps.clear();
+    markStack.clear();
+    markOverflow = false;
+
+    auto push = [&](Object *obj)
+    {
+        if (obj == nullptr || obj->marked)
+            return;
+        pushMark(obj, 0);
+        if (markStack.size() >= MARK_STACK_SIZE / 2)
+            drainMarkStack();
+    };
+
+    {
+        PhaseSpan rootSpan(PHASE_ROOTS);
+        for (Object *root : roots)
+            push(root);
+        forEachRegionRoot(push);
+        for (Object *value : rememberedValues)
+            push(value);
+        for (Object *owner : rememberedObjects)
+        {
+            if (owner->type == ObjectType::WEAK_MAP)
+                weakMaps.push_back(static_cast<WeakMap *>(owner));
+            else
+                forEachChild(owner, push);
+        }
+        for (auto &it : cardTables)
+        {
+            List *list = it.first;
+            std::vector<uint8_t> &dirty = it.second;
+            for (size_t card = 0; card < dirty.size(); card++)
+            {
+                if (!dirty[card])
+                    continue;
+                gcStats.cardsScanned++;
+                size_t end = std::min(list->values.size(), (card + 1) * CARD_SLOTS);
+                for (size_t i = card * CARD_SLOTS; i < end; i++)
+                    push(list->values[i]);
+            }
+        }
+        forgetRemembered();
+    }
+
+    do
+    {
+        drainMarkStack();
+        markEphemerons();
+    } while (!markStack.empty());
+}
+
+//**************************************************************************** */
+// regions
+
+bool Factory::beginRegion()
+{
+    if (regionFrames.size() >= REGION_MAX_DEPTH)
+    {
+        std::cout << "Regions nested too deep" << std::endl;
+        return false;
+    }
+    // frames are reused so a region per frame does not reallocate them
+    if (spareFrames.empty())
+        regionFrames.emplace_back();
+    else
+    {
+        regionFrames.push_back(std::move(spareFrames.back()));
+        spareFrames.pop_back();
+    }
+    return true;
+}
+
+// a weak map keeps its entries while a region ends, the next collection
+// clears them
+template <typename Visitor>
+static void forEachRegionChild(Object *obj, Visitor &&visit)
+{
+    if (obj->type == ObjectType::WEAK_MAP)
+    {
+        for (auto &it : static_cast<WeakMap *>(obj)->values)
+        {
+            visit(it.first);
+            visit(it.second);
+        }
+    }
+    else
+        forEachChild(obj, visit);
+}
+
+void Factory::endRegion()
+{
+    if (regionFrames.empty())
+    {
+        std::cout << "No region to end" << std::endl;
+        return;
+    }
+    RegionFrame &frame = regionFrames.back();
+    uint8_t depth = (uint8_t)regionFrames.size();
+    RegionFrame *parent = depth > 1 ? &regionFrames[depth - 2] : nullptr;
+
+    // what is still rooted or reached from an outer object moves one level out
+    std::vector<Object *> pending;
+    auto keep = [&](Object *obj)
+    {
+        if (obj != nullptr && obj->region == depth)
+        {
+            obj->region = depth - 1;
+            pending.push_back(obj);
+        }
+    };
+    for (Object *obj : frame.rooted)
+        if (roots.count(obj) != 0)
+            keep(obj);
+    for (auto &escape : frame.escapes)
+        keep(escape.first);
+    for (Object *owner : frame.owners)
+        forEachRegionChild(owner, keep);
+    while (!pending.empty())
+    {
+        Object *obj = pending.back();
+        pending.pop_back();
+        forEachRegionChild(obj, keep);
+    }
+
+    if (parent != nullptr)
+    {
+        for (Object *obj : frame.rooted)
+            if (obj->region != 0 && roots.count(obj) != 0)
+                parent->rooted.push_back(obj);
+        for (auto &escape : frame.escapes)
+            if (escape.second < depth - 1)
+                parent->escapes.push_back(escape);
+    }
+    else if (generationalMode)
+    {
+        // an old owner's barrier remembered the value, but a minor collection
+        // inside the region may have used that up
+        for (auto &escape : frame.escapes)
+        {
+            Object *value = escape.first;
+            if (!value->remembered)
+            {
+                value->remembered = true;
+                rememberedValues.push_back(value);
+            }
+        }
+    }
+    for (Object *obj : frame.objects)
+    {
+        if (obj->region != depth && obj->type == ObjectType::WEAK_REF)
+        {
+            WeakRef *ref = static_cast<WeakRef *>(obj);
+            if (ref->target != nullptr && ref->target->region == depth)
+                ref->target = nullptr;
+        }
+    }
+    if (!rememberedValues.empty())
+    {
+        auto dying = [&](Object *obj)
+        { return obj->region == depth; };
+        rememberedValues.erase(std::remove_if(rememberedValues.begin(), rememberedValues.end(), dying),
+                               rememberedValues.end());
+    }
+
+    std::vector<Object *> &kept = parent != nullptr ? parent->objects : objects;
+    Arena::FreeBatch dead;
+    memset(&dead, 0, sizeof(dead));
+    Arena::redirectFree(&dead);
+    for (Object *obj : frame.objects)
+    {
+        if (obj->region != depth)
+        {
+            kept.push_back(obj);
+            gcStats.regionPromoted++;
+            continue;
+        }
+        gcStats.regionFreed++;
+        if (markingConcurrently)
+        {
+            // the collector thread may still reach it; swept with the cycle
+            regionDead.push_back(obj);
+            continue;
+        }
+        if (obj->sampled && onSampleFree != nullptr)
+            onSampleFree(obj);
+        destroy(obj);
+    }
+    Arena::redirectFree(nullptr);
+    Arena::as().merge(dead);
+    gcStats.bytesFreed += dead.bytes;
+    RegionFrame ended = std::move(frame);
+    regionFrames.pop_back();
+
+    // outer levels look at what reaches further out when they end, and old
+    // owners are rescanned whole by the next minor collection, as above
+    for (Object *owner : ended.owners)
+        remember(owner);
+    ended.objects.clear();
+    ended.rooted.clear();
+    ended.escapes.clear();
+    ended.owners.clear();
+    spareFrames.push_back(std::move(ended));
+}
+
+//**************************************************************************** */
+// concurrent marking
+
+bool Factory::setConcurrentMarking(bool enabled)
+{
+    if (enabled == concurrentMode)
+        return true;
+    if (enabled && generationalMode)
+    {
+        std::cout << "Concurrent marking does not work with the generational mode" << std::endl;
+        return false;
+    }
+    if (enabled)
+        markerThread = std::thread(&Factory::markerLoop, this);
+    else
+    {
+        finishCollection();
+        {
+            std::lock_guard<std::mutex> lock(markMutex);
+            markerStop = true;
+            markerWake.notify_all();
+        }
+        markerThread.join();
+        markerStop = false;
+    }
+    concurrentMode = enabled;
+    return true;
+}
+
+// Triggered: start a cycle, or, once the arena has outgrown the running one,
+// wait for it. Asked for by the program or the arena in need: a whole cycle.
+void Factory::collectConcurrent()
+{
+    bool whole = !collectTriggered || fullRequested;
+    fullRequested = false;
+    if (cycleRunning)
+    {
+        if (whole || Arena::as().size() >= cycleStartSize * CONCURRENT_PACING)
+            finishCollection();
+        if (!whole)
+            return;
+    }
+    startCycle();
+    if (whole)
+        finishCollection();
+}
+
+void Factory::stopped(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    cycleLongest = std::max(cycleLongest, elapsed.count());
+    cycleStopped += elapsed.count();
+}
+
+// first stop: the roots and region objects are copied for the thread
+void Factory::startCycle()
+{
+    PhaseSpan span(PHASE_ROOTS);
+    auto start = std::chrono::steady_clock::now();
+    reclaimFinalized();
+    cycleLongest = 0.0;
+    cycleStopped = 0.0;
+    {
+        std::lock_guard<std::mutex> lock(markMutex);
+        weakRefs.clear();
+        weakMaps.clear();
+        satbQueue.clear();
+        grayStack.assign(roots.begin(), roots.end());
+        forEachRegionRoot([&](Object *obj)
+                          { grayStack.push_back(obj); });
+        markingConcurrently = true;
+        cyclePhase = CYCLE_MARKING;
+    }
+    cycleRunning = true;
+    cycleStartSize = Arena::as().size();
+    GC_DYNAMIC_THRESHOLD = cycleStartSize * CONCURRENT_PACING;
+    stopped(start);
+    markerWake.notify_all();
+}
+
+// Scans whole objects, so a container is never seen half changed; returns
+// early when the program waits for the lock.
+void Factory::traceGray()
+{
+    while (!grayStack.empty())
+    {
+        if (markWaiting.load(std::memory_order_relaxed) != 0)
+            return;
+        Object *obj = grayStack.back();
+        grayStack.pop_back();
+        if (obj->marked)
+            continue;
+        obj->marked = true;
+
+        if (obj->type == ObjectType::WEAK_REF)
+            weakRefs.push_back(static_cast<WeakRef *>(obj));
+        else if (obj->type == ObjectType::WEAK_MAP)
+            weakMaps.push_back(static_cast<WeakMap *>(obj));
+
+        forEachChild(obj, [&](Object *child)
+                     {
+                         if (!child->marked)
+                             grayStack.push_back(child);
+                     });
+    }
+}
+
+// A user type about to be changed in place is marked now, its children
+// logged, and never scanned by the thread.
+void Factory::blacken(Object *owner)
+{
+    MutationLock lock;
+    if (owner->marked)
+        return;
+    owner->marked = true;
+    forEachChild(owner, [&](Object *child)
+                 { deletionBarrier(child); });
+}
+
+void Factory::markerLoop()
+{
+    std::unique_lock<std::mutex> lock(markMutex);
+    while (true)
+    {
+        markerWake.wait(lock, [&]
+                        {
+                            int phase = cyclePhase.load();
+                            return markerStop || phase == CYCLE_MARKING || phase == CYCLE_SWEEPING;
+                        });
+        if (markerStop)
+            break;
+
+        auto start = std::chrono::steady_clock::now();
+        int done;
+        if (cyclePhase.load() == CYCLE_MARKING)
+        {
+            PhaseSpan span(PHASE_MARK);
+            for (;;)
+            {
+                grayStack.insert(grayStack.end(), satbQueue.begin(), satbQueue.end());
+                satbQueue.clear();
+                if (grayStack.empty())
+                    break;
+                traceGray();
+                if (markWaiting.load(std::memory_order_relaxed) != 0)
+                {
+                    lock.unlock();
+                    while (markWaiting.load(std::memory_order_relaxed) != 0)
+                        std::this_thread::yield();
+                    lock.lock();
+                }
+            }
+            done = CYCLE_MARKED;
+        }
+        else
+        {
+            lock.unlock();
+            sweepRange(sweepSet, 0, sweepSet.size(), cycleSweep);
+            lock.lock();
+            done = CYCLE_SWEPT;
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        cycleWork += elapsed.count();
+        cyclePhase = done;
+        markerDone.notify_all();
+    }
+}
+
+// Second stop: what the barriers logged since the thread finished, the
+// roots and the ephemerons, then weak references are cleared and the
+// registry is handed to the thread for sweeping.
+void Factory::remark()
+{
+    PhaseSpan span(PHASE_REMARK);
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(markMutex);
+        grayStack.insert(grayStack.end(), satbQueue.begin(), satbQueue.end());
+        satbQueue.clear();
+        for (Object *root : roots)
+            if (!root->marked)
+                grayStack.push_back(root);
+        do
+        {
+            traceGray();
+            for (WeakMap *map : weakMaps)
+                for (auto &it : map->values)
+                    if ((it.first == nullptr || it.first->marked) && it.second != nullptr && !it.second->marked)
+                        grayStack.push_back(it.second);
+        } while (!grayStack.empty());
+        clearWeak();
+        markingConcurrently = false;
+
+        // region objects are not swept, the dead ones left by regions that
+        // ended meanwhile are
+        for (RegionFrame &frame : regionFrames)
+            for (Object *obj : frame.objects)
+                obj->marked = false;
+        for (Object *obj : regionDead)
+            obj->marked = false;
+        sweepSet.swap(objects);
+        sweepSet.insert(sweepSet.end(), regionDead.begin(), regionDead.end());
+        regionDead.clear();
+        cyclePhase = CYCLE_SWEEPING;
+    }
+    stopped(start);
+    markerWake.notify_all();
+}
+
+// Third stop: frees and finalizations of the swept part are taken over and
+// what was made meanwhile is appended to the survivors.
+void Factory::completeCycle()
+{
+    PhaseSpan span(PHASE_CYCLE_END);
+    auto start = std::chrono::steady_clock::now();
+    Arena::as().merge(cycleSweep.frees);
+    gcStats.bytesFreed += cycleSweep.frees.bytes;
+    gcStats.objectsFreed += cycleSweep.freed;
+    finalizeQueue.insert(finalizeQueue.end(), cycleSweep.finalize.begin(), cycleSweep.finalize.end());
+    if (onSampleFree != nullptr)
+        for (Object *obj : cycleSweep.sampled)
+            onSampleFree(obj);
+
+    sweepSet.resize(cycleSweep.live);
+    sweepSet.insert(sweepSet.end(), objects.begin(), objects.end());
+    objects.swap(sweepSet);
+    sweepSet.clear();
+    youngBegin = objects.size();
+    cyclePhase = CYCLE_IDLE;
+    cycleRunning = false;
+
+    dispatchFinalizers();
+    Arena::as().paceExternal();
+    if (!collectTriggered)
+        GC_DYNAMIC_THRESHOLD = adjustThreshold();
+    stopped(start);
+
+    gcStats.collections++;
+    gcStats.lastPause = cycleLongest;
+    gcStats.totalPause += cycleStopped;
+    if (gcStats.lastPause > gcStats.maxPause)
+        gcStats.maxPause = gcStats.lastPause;
+    gcStats.concurrentTime += cycleWork;
+    cycleWork = 0.0;
+
+    if (onCollect != nullptr)
+        onCollect(gcStats);
+}
+
+// at an allocation: the stops that are due, none while the thread works
+void Factory::stepCollection()
+{
+    int phase = cyclePhase.load(std::memory_order_acquire);
+    if (phase == CYCLE_MARKED)
+        remark();
+    else if (phase == CYCLE_SWEPT)
+        completeCycle();
+}
+
+// waiting for the thread counts as stopped
+void Factory::finishCollection()
+{
+    if (!cycleRunning)
+        return;
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::unique_lock<std::mutex> lock(markMutex);
+        markerDone.wait(lock, [&]
+                        { return cyclePhase.load() != CYCLE_MARKING; });
+    }
+    stopped(start);
+    if (cyclePhase.load() == CYCLE_MARKED)
+        remark();
+    start = std::chrono::steady_clock::now();
+    {
+        std::unique_lock<std::mutex> lock(markMutex);
+        markerDone.wait(lock, [&]
+                        { return cyclePhase.load() == CYCLE_SWEPT; });
+    }
+    stopped(start);
+    completeCycle();
+}
+
+//**************************************************************************** */
+// parallel sweep
+
+// Each thread sweeps one slice of the registry in place. Frees are caught in
+// a per-thread FreeBatch and dead Pointers and sampled objects are set aside,
+// so the arena, the finalizers and the profiler are only touched here.
+void Factory::sweepParallel()
+{
+    size_t threads = sweepThreads();
+    sweepChunks.resize(threads);
+    {
+        std::lock_guard<std::mutex> lock(sweepMutex);
+        sweepNext = 1;
+        sweepPending = threads - 1;
+        sweepGeneration++;
+        sweepReady.notify_all();
+    }
+    sweepChunk(0);
+    {
+        std::unique_lock<std::mutex> lock(sweepMutex);
+        sweepDone.wait(lock, [&]
+                       { return sweepPending == 0; });
+    }
+
+    size_t live = 0;
+    for (size_t i = 0; i < threads; i++)
+    {
+        SweepChunk &chunk = sweepChunks[i];
+        size_t begin = objects.size() * i / threads;
+        // packed leftwards; a chunk with nothing freed before it is in place
+        if (live != begin)
+            std::copy(objects.begin() + begin, objects.begin() + begin + chunk.live, objects.begin() + live);
+        live += chunk.live;
+
+        Arena::as().merge(chunk.frees);
+        finalizeQueue.insert(finalizeQueue.end(), chunk.finalize.begin(), chunk.finalize.end());
+        gcStats.objectsFreed += chunk.freed;
+        if (onSampleFree != nullptr)
+            for (Object *obj : chunk.sampled)
+                onSampleFree(obj);
+    }
+    objects.resize(live);
+}
+
+void Factory::sweepChunk(size_t index)
+{
+    size_t threads = sweepChunks.size();
+    size_t begin = objects.size() * index / threads;
+    size_t end = objects.size() * (index + 1) / threads;
+    sweepRange(objects, begin, end, sweepChunks[index]);
+}
+
+// survivors are packed from begin on, chunk.live of them
+void Factory::sweepRange(std::vector<Object *> &from, size_t begin, size_t end, SweepChunk &chunk)
+{
+    PhaseSpan span(PHASE_SWEEP);
+    chunk.live = 0;
+    chunk.freed = 0;
+    chunk.finalize.clear();
+    chunk.sampled.clear();
+    memset(&chunk.frees, 0, sizeof(chunk.frees));
+
+    Arena::redirectFree(&chunk.frees);
+    for (size_t i = begin; i < end; i++)
+    {
+        Object *object = from[i];
+        if (object->marked)
+        {
+            object->marked = generationalMode;
+            from[begin + chunk.live++] = object;
+            continue;
+        }
+        if (object->sampled)
+            chunk.sampled.push_back(object);
+        if (object->type == ObjectType::POINTER)
+            chunk.finalize.push_back(static_cast<Pointer *>(object));
+        else
+            destroy(object);
+        chunk.freed++;
+    }
+    Arena::redirectFree(nullptr);
+    span.arg = chunk.freed;
+}
+
+void Factory::sweepLoop(size_t seen)
+{
+    std::unique_lock<std::mutex> lock(sweepMutex);
+    while (true)
+    {
+        sweepReady.wait(lock, [&]
+                        { return sweepStop || sweepGeneration != seen; });
+        if (sweepStop)
+            break;
+        seen = sweepGeneration;
+        size_t index = sweepNext++;
+        lock.unlock();
+
+        sweepChunk(index);
+
+        lock.lock();
+        if (--sweepPending == 0)
+            sweepDone.notify_all();
+    }
+}
+
+void Factory::setSweepThreads(size_t threads)
+{
+    {
+        std::lock_guard<std::mutex> lock(sweepMutex);
+        sweepStop = true;
+        sweepReady.notify_all();
+    }
+    for (std::thread &worker : sweepWorkers)
+        worker.join();
+    sweepWorkers.clear();
+    sweepStop = false;
+
+    for (size_t i = 1; i < threads; i++)
+        sweepWorkers.emplace_back(&Factory::sweepLoop, this, sweepGeneration);
 }
 
-std::string Scope::getString(const std::string &name)
+//**************************************************************************** */
+// finalization
+
+void Factory::finalize(Pointer **batch, size_t count)
 {
-    Object *obj;
-    if (tryLookup(name, &obj))
+    if (finalizers.empty())
     {
-        if (obj->type == ObjectType::STRING)
+        for (size_t i = 0; i < count; i++)
+            onDelete(batch[i]);
+        return;
+    }
+
+    std::sort(batch, batch + count, [](Pointer *a, Pointer *b)
+              { return a->tag < b->tag; });
+
+    size_t first = 0;
+    while (first < count)
+    {
+        size_t tag = batch[first]->tag;
+        size_t last = first + 1;
+        while (last < count && batch[last]->tag == tag)
+            last++;
+
+        auto it = finalizers.find(tag);
+        if (it != finalizers.end() && it->second.batch != nullptr)
+            it->second.batch(batch + first, last - first);
+        else
         {
-            return static_cast<String *>(obj)->value;
+            OnDeleteFunction function = it != finalizers.end() ? it->second.single : onDelete;
+            for (size_t i = first; i < last; i++)
+                function(batch[i]);
         }
+        first = last;
     }
-    return "";
 }
 
-//**************************************************************************** */
-// Factory
+void Factory::release(Pointer *p)
+{
+    Arena::as().removeExternal(p->external);
+    p->value = nullptr;
+    p->~Pointer();
+    Arena::as().free(p, sizeof(Pointer));
+}
 
-// void Factory::mark()
-// {
-//     if (roots.empty())
-//     {
-//         std::cout << "Nothing to mark" << std::endl;
-//         return;
-//     }
+size_t Factory::runFinalizers(size_t budget)
+{
+    reclaimFinalized();
 
-//     std::cout << "Total objects: " << roots.size() << " to mark" << std::endl;
-//     std::vector<Object *> worklist(roots.begin(), roots.end());
-//     while (!worklist.empty())
-//     {
-//         auto obj = worklist.back();
-//         worklist.pop_back();
+    size_t count = std::min(budget, finalizeQueue.size());
+    if (count == 0)
+        return 0;
+    PhaseSpan span(PHASE_FINALIZE);
+    span.arg = count;
 
-//         if (!obj->marked)
-//         {
-//             obj->marked = true;
-//             if (obj->type == ObjectType::SCOPE)
-//             {
-//                 Scope *scope = static_cast<Scope *>(obj);
-//                 for (auto it = scope->values.begin(); it != scope->values.end(); ++it)
-//                 {
-//                     worklist.insert(worklist.end(), it->second);
-//                 }
-//                 if (scope->parent != nullptr)
-//                     worklist.insert(worklist.end(), scope->parent);
-//             }
-//         }
-//     }
-// }
+    Pointer **batch = finalizeQueue.data() + finalizeQueue.size() - count;
+    finalize(batch, count);
+    for (size_t i = 0; i < count; i++)
+        release(batch[i]);
+    finalizeQueue.resize(finalizeQueue.size() - count);
 
-/// fifo
+    gcStats.finalized += count;
+    gcStats.bytesFreed += count * sizeof(Pointer);
+    return count;
+}
 
-void Factory::mark()
+void Factory::reclaimFinalized()
 {
-    if (roots.empty())
-    {
-        std::cout << "Nothing to mark" << std::endl;
+    if (!finalizerThread.joinable())
         return;
+
+    std::vector<Pointer *> done;
+    {
+        std::lock_guard<std::mutex> lock(finalizerMutex);
+        done.swap(finalizerDone);
     }
+    for (Pointer *p : done)
+        release(p);
 
-    //  std::cout << "Total objects: " << roots.size() << " to mark" << std::endl;
-    std::deque<Object *> worklist(roots.begin(), roots.end()); //
+    gcStats.finalized += done.size();
+    gcStats.bytesFreed += done.size() * sizeof(Pointer);
+}
 
-    while (!worklist.empty())
+void Factory::finalizerLoop()
+{
+    std::unique_lock<std::mutex> lock(finalizerMutex);
+    while (true)
     {
-        Object *obj = worklist.front();
-        worklist.pop_front();
+        finalizerReady.wait(lock, [&]
+                            { return finalizerStop || !finalizerPending.empty(); });
+        if (finalizerPending.empty())
+            break;
+
+        std::vector<Pointer *> batch;
+        batch.swap(finalizerPending);
+        finalizerBusy = true;
+        lock.unlock();
 
-        if (!obj->marked)
         {
-            obj->marked = true;
+            PhaseSpan span(PHASE_FINALIZE);
+            span.arg = batch.size();
+            finalize(batch.data(), batch.size());
+        }
 
-            if (obj->type == ObjectType::SCOPE)
-            {
-                Scope *scope = static_cast<Scope *>(obj);
+        lock.lock();
+        finalizerDone.insert(finalizerDone.end(), batch.begin(), batch.end());
+        finalizerBusy = false;
+        finalizerReady.notify_all();
+    }
+}
 
-                for (auto &it : scope->values)
-                {
-                    if (!it.second->marked)
-                    {
-                        worklist.push_back(it.second);
-                    }
-                }
+void Factory::startFinalizerThread()
+{
+    if (finalizerThread.joinable())
+        return;
 
-                if (scope->parent != nullptr && !scope->parent->marked)
-                {
-                    worklist.push_back(scope->parent);
-                }
-            }
-            else if (obj->type == ObjectType::LIST)
-            {
-                List *list = static_cast<List *>(obj);
-                //  std::cout << "List " << list->size() << std::endl;
-                for (int i = 0; i < list->size(); i++)
-                {
-                    Object *value = list->get(i);
-                    worklist.push_back(value);
-                }
-            }
-        }
-    }
+    finalizerStop = false;
+    finalizerPending.swap(finalizeQueue);
+    finalizerThread = std::thread(&Factory::finalizerLoop, this);
 }
 
-void Factory::sweep()
+void Factory::stopFinalizerThread()
 {
-    if (objects.empty())
-    {
-        std::cout << "Nothing to collect" << std::endl;
+    if (!finalizerThread.joinable())
         return;
-    }
-    //    std::cout << "Total objects: " << objects.size() << " to collect" << std::endl;
-    //   std::cout << "Total memory used: " << Arena::as().size() << " bytes." << std::endl;
 
-    auto it = objects.begin();
-    while (it != objects.end())
     {
-        auto object = *it;
-        if (object->marked)
-        {
-            object->marked = false;
-            ++it;
-        }
-        else
-        {
-            it = objects.erase(it);
-            // std::cout << "GC " << object->toString() << std::endl;
-            this->free(object);
-        }
+        std::lock_guard<std::mutex> lock(finalizerMutex);
+        finalizerStop = true;
+        finalizerReady.notify_all();
     }
+    finalizerThread.join();
+    reclaimFinalized();
+    finalizerStop = false;
 }
 
-void Factory::clean()
+void Factory::free(Object *obj)
 {
-    if (objects.empty())
-    {
-        std::cout << "Nothing to clean" << std::endl;
-        return;
-    }
+    if (obj->sampled && onSampleFree != nullptr)
+        onSampleFree(obj);
 
-    std::cout << "Total objects: " << objects.size() << " to clean" << std::endl;
-    if (!objects.empty())
+    if (obj->type == ObjectType::POINTER)
     {
-        for (auto &obj : objects)
-        {
-            free(obj);
-        }
+        Pointer *p = static_cast<Pointer *>(obj);
+        finalize(&p, 1);
+        release(p);
     }
-    objects.clear();
+    else
+        destroy(obj);
 }
 
-void Factory::free(Object *obj)
+// runs the destructor and gives the memory back; safe on sweep threads
+void Factory::destroy(Object *obj)
 {
-    if (obj->type == ObjectType::NIL)
+    if (obj->type >= ObjectType::USER)
+        TypeRegistry::as().get(obj->type).destroy(obj);
+    else if (obj->type == ObjectType::NIL)
     {
         Object *o = static_cast<Object *>(obj);
         o->~Object();
@@ -295,14 +2035,6 @@ void Factory::free(Object *obj)
         s->~String();
         Arena::as().free(s, sizeof(String));
     }
-    else if (obj->type == ObjectType::POINTER)
-    {
-        Pointer *p = static_cast<Pointer *>(obj);
-        onDelete(p);
-        p->value = nullptr;
-        p->~Pointer();
-        Arena::as().free(p, sizeof(Pointer));
-    }
     else if (obj->type == ObjectType::LIST)
     {
         List *l = static_cast<List *>(obj);
@@ -321,6 +2053,42 @@ void Factory::free(Object *obj)
         s->~Scope();
         Arena::as().free(s, sizeof(Scope));
     }
+    else if (obj->type == ObjectType::WEAK_REF)
+    {
+        WeakRef *w = static_cast<WeakRef *>(obj);
+        w->~WeakRef();
+        Arena::as().free(w, sizeof(WeakRef));
+    }
+    else if (obj->type == ObjectType::WEAK_MAP)
+    {
+        WeakMap *m = static_cast<WeakMap *>(obj);
+        m->~WeakMap();
+        Arena::as().free(m, sizeof(WeakMap));
+    }
+    else if (obj->type == ObjectType::INT_ARRAY)
+    {
+        IntArray *a = static_cast<IntArray *>(obj);
+        a->~IntArray();
+        Arena::as().free(a, sizeof(IntArray));
+    }
+    else if (obj->type == ObjectType::LONG_ARRAY)
+    {
+        LongArray *a = static_cast<LongArray *>(obj);
+        a->~LongArray();
+        Arena::as().free(a, sizeof(LongArray));
+    }
+    else if (obj->type == ObjectType::REAL_ARRAY)
+    {
+        RealArray *a = static_cast<RealArray *>(obj);
+        a->~RealArray();
+        Arena::as().free(a, sizeof(RealArray));
+    }
+    else if (obj->type == ObjectType::RECORD_STORE)
+    {
+        RecordStore *r = static_cast<RecordStore *>(obj);
+        r->~RecordStore();
+        Arena::as().free(r, sizeof(RecordStore));
+    }
     else
         std::cout << "Unknown object type" << std::endl;
 }
@@ -338,20 +2106,207 @@ void Factory::setOnDelete(OnDeleteFunction function)
         onDelete = defaultOnDelete;
 }
 
+void Factory::setExternalSize(Pointer *p, size_t bytes)
+{
+    if (onTrace != nullptr)
+        onTrace({TRACE_EXTERNAL, p, nullptr, nullptr, bytes, nullptr});
+    Arena::as().removeExternal(p->external);
+    Arena::as().addExternal(bytes);
+    p->external = bytes;
+}
+
+void Factory::setAllocationSampler(OnSampleFunction sample, OnSampleFreeFunction freed, size_t countdown)
+{
+    onSample = sample;
+    onSampleFree = freed;
+    sampleCountdown = countdown;
+}
+
+void Factory::sampleAllocation(Object *obj, size_t size)
+{
+    if (size < sampleCountdown)
+    {
+        sampleCountdown -= size;
+        return;
+    }
+    obj->sampled = true;
+    sampleCountdown = onSample(obj, size);
+}
+
+void Factory::setFinalizer(size_t tag, OnDeleteFunction function)
+{
+    if (function != nullptr)
+        finalizers[tag] = {function, nullptr};
+    else
+        finalizers.erase(tag);
+}
+
+void Factory::setBatchFinalizer(size_t tag, OnDeleteBatchFunction function)
+{
+    if (function != nullptr)
+        finalizers[tag] = {nullptr, function};
+    else
+        finalizers.erase(tag);
+}
+
+void Factory::adopt(Object **batch, size_t count)
+{
+    if (markingConcurrently)
+        for (size_t i = 0; i < count; i++)
+            batch[i]->marked = true;
+    objects.insert(objects.end(), batch, batch + count);
+}
+
 Factory::Factory()
 {
+    // the arena must outlive the factory, whose destructor still frees objects
+    Arena::as();
     onDelete = defaultOnDelete;
     objects.reserve(GC_THRESHOLD);
+    markStack.reserve(MARK_STACK_SIZE);
 }
 
 Factory::~Factory()
 {
+    setConcurrentMarking(false);
+    setSweepThreads(1);
+    stopFinalizerThread();
     clean();
 }
 
+//**************************************************************************** */
+// containers
+
+// Lists and maps hash and compare by contents, so they work as map keys.
+// Containers nested deeper than STRUCTURAL_DEPTH compare by identity, which
+// keeps cyclic ones finite; since that depends on where the walk started,
+// only a hash taken from the top is cached, and only over scalars: a nested
+// container or array can change without its parent seeing it. A key must
+// not change while a map holds it.
+static thread_local int structuralDepth = 0;
+
+struct StructuralLevel
+{
+    StructuralLevel() { structuralDepth++; }
+    ~StructuralLevel() { structuralDepth--; }
+    bool tooDeep() const { return structuralDepth > STRUCTURAL_DEPTH; }
+};
+
+static size_t mixHash(size_t seed, size_t h)
+{
+    return seed ^ (h + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
+
+static size_t hashOf(const Object *obj)
+{
+    return obj == nullptr ? 0 : obj->hash();
+}
+
+static bool sameValue(const Object *a, const Object *b)
+{
+    return a == b || (a != nullptr && b != nullptr && *a == *b);
+}
+
+// Nil, Integer, Real, String and Pointer change only through their owner
+static bool scalar(const Object *obj)
+{
+    return obj == nullptr || obj->type <= ObjectType::POINTER;
+}
+
+static size_t cacheHash(size_t &cache, size_t h, bool flat)
+{
+    if (structuralDepth == 1 && flat)
+        cache = h == 0 ? 1 : h;
+    return h;
+}
+
+size_t List::hash() const
+{
+    if (structuralDepth == 0 && cachedHash != 0)
+        return cachedHash;
+    StructuralLevel level;
+    size_t h = mixHash(std::hash<size_t>{}(type), values.size());
+    if (level.tooDeep())
+        return h;
+    bool flat = true;
+    for (Object *value : values)
+    {
+        h = mixHash(h, hashOf(value));
+        flat = flat && scalar(value);
+    }
+    return cacheHash(cachedHash, h, flat);
+}
+
+bool List::operator==(const Object &other) const
+{
+    if (this == &other)
+        return true;
+    if (type != other.type)
+        return false;
+    const List *o = static_cast<const List *>(&other);
+    if (values.size() != o->values.size())
+        return false;
+    StructuralLevel level;
+    if (level.tooDeep())
+        return false;
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        if (!sameValue(values[i], o->values[i]))
+            return false;
+    }
+    return true;
+}
+
+// entries are summed so the bucket order does not matter
+size_t Map::hash() const
+{
+    if (structuralDepth == 0 && cachedHash != 0)
+        return cachedHash;
+    StructuralLevel level;
+    size_t h = mixHash(std::hash<size_t>{}(type), values.size());
+    if (level.tooDeep())
+        return h;
+    size_t entries = 0;
+    bool flat = true;
+    for (auto &it : values)
+    {
+        entries += mixHash(hashOf(it.first), hashOf(it.second));
+        flat = flat && scalar(it.first) && scalar(it.second);
+    }
+    return cacheHash(cachedHash, mixHash(h, entries), flat);
+}
+
+bool Map::operator==(const Object &other) const
+{
+    if (this == &other)
+        return true;
+    if (type != other.type)
+        return false;
+    const Map *o = static_cast<const Map *>(&other);
+    if (values.size() != o->values.size())
+        return false;
+    StructuralLevel level;
+    if (level.tooDeep())
+        return false;
+    for (auto &it : values)
+    {
+        auto found = o->values.find(it.first);
+        if (found == o->values.end() || !sameValue(it.second, found->second))
+            return false;
+    }
+    return true;
+}
+
 void List::add(Object *obj)
 {
+    if (onTrace != nullptr)
+        onTrace({TRACE_LIST_ADD, this, nullptr, obj, 0, nullptr});
+    MutationLock lock;
     values.push_back(obj);
+    cachedHash = 0;
+    escapeBarrier(this, obj);
+    if (marked && obj != nullptr && !obj->marked)
+        dirty(values.size() - 1, values.size());
 }
 
 Object *List::get(int index)
@@ -366,6 +2321,32 @@ Object *List::get(int index)
     return values[index];
 }
 
+bool List::set(int index, Object *obj)
+{
+    if (index < 0 || index >= (int)values.size())
+    {
+        std::cout << "Index out [" << index << "] of bounds" << std::endl;
+        return false;
+    }
+    if (onTrace != nullptr)
+        onTrace({TRACE_LIST_SET, this, nullptr, obj, (size_t)index, nullptr});
+    MutationLock lock;
+    deletionBarrier(values[index]);
+    values[index] = obj;
+    cachedHash = 0;
+    escapeBarrier(this, obj);
+    if (marked && obj != nullptr && !obj->marked)
+        dirty(index, index + 1);
+    return true;
+}
+
+void List::dirty(size_t begin, size_t end)
+{
+    cachedHash = 0;
+    if (marked)
+        Factory::as().rememberCards(this, begin, end);
+}
+
 bool List::find(Object *obj)
 {
     auto it = values.begin();
@@ -380,12 +2361,17 @@ bool List::find(Object *obj)
 
 bool List::remove(Object *obj)
 {
+    MutationLock lock;
     auto it = values.begin();
     while (it != values.end())
     {
         if (*it == obj)
         {
-            values.erase(it);
+            if (onTrace != nullptr)
+                onTrace({TRACE_LIST_ERASE, this, nullptr, nullptr, (size_t)(it - values.begin()), nullptr});
+            deletionBarrier(obj);
+            it = values.erase(it);
+            dirty(it - values.begin(), values.size());
             return true;
         }
         it++;
@@ -393,6 +2379,28 @@ bool List::remove(Object *obj)
     return false;
 }
 
+bool List::swapRemove(int index)
+{
+    if (index < 0 || index >= (int)values.size())
+    {
+        std::cout << "Index out [" << index << "] of bounds" << std::endl;
+        return false;
+    }
+    if (onTrace != nullptr)
+    {
+        onTrace({TRACE_LIST_SET, this, nullptr, values.back(), (size_t)index, nullptr});
+        onTrace({TRACE_LIST_POP, this, nullptr, nullptr, 0, nullptr});
+    }
+    MutationLock lock;
+    deletionBarrier(values[index]);
+    values[index] = values.back();
+    values.pop_back();
+    cachedHash = 0;
+    if (index < (int)values.size())
+        dirty(index, index + 1);
+    return true;
+}
+
 bool List::erase(int index)
 {
     if (index < 0 || index >= (int)values.size())
@@ -400,14 +2408,24 @@ bool List::erase(int index)
         std::cout << "Index out [" << index << "] of bounds" << std::endl;
         return false;
     }
+    if (onTrace != nullptr)
+        onTrace({TRACE_LIST_ERASE, this, nullptr, nullptr, (size_t)index, nullptr});
+    MutationLock lock;
+    deletionBarrier(values[index]);
     values.erase(values.begin() + index);
+    dirty(index, values.size());
     return true;
 }
 
 Object *List::pop()
 {
+    if (onTrace != nullptr)
+        onTrace({TRACE_LIST_POP, this, nullptr, nullptr, 0, nullptr});
+    MutationLock lock;
     Object *value = values.back();
+    deletionBarrier(value);
     values.pop_back();
+    cachedHash = 0;
     return value;
 }
 
@@ -418,7 +2436,15 @@ Object *List::back()
 
 void Map::insert(Object *key, Object *obj)
 {
-    values[key] = obj;
+    if (onTrace != nullptr)
+        onTrace({TRACE_MAP_INSERT, this, key, obj, 0, nullptr});
+    writeBarrier(this, key);
+    writeBarrier(this, obj);
+    MutationLock lock;
+    Ref<Object> &slot = values[key];
+    deletionBarrier(slot);
+    slot = obj;
+    cachedHash = 0;
 }
 
 bool Map::contains(Object *key)
@@ -428,7 +2454,16 @@ bool Map::contains(Object *key)
 
 void Map::remove(Object *key)
 {
-    values.erase(key);
+    if (onTrace != nullptr)
+        onTrace({TRACE_MAP_REMOVE, this, key, nullptr, 0, nullptr});
+    auto it = values.find(key);
+    if (it == values.end())
+        return;
+    MutationLock lock;
+    deletionBarrier(it->first);
+    deletionBarrier(it->second);
+    values.erase(it);
+    cachedHash = 0;
 }
 
 bool Map::set(Object *key, Object *obj)
@@ -436,7 +2471,13 @@ bool Map::set(Object *key, Object *obj)
     auto it = values.find(key);
     if (it != values.end())
     {
+        if (onTrace != nullptr)
+            onTrace({TRACE_MAP_INSERT, this, it->first, obj, 0, nullptr});
+        writeBarrier(this, obj);
+        MutationLock lock;
+        deletionBarrier(it->second);
         it->second = obj;
+        cachedHash = 0;
         return true;
     }
     return false;
@@ -449,3 +2490,72 @@ Object *Map::get(Object *key)
         return it->second;
     return nullptr;
 }
+
+uint32_t RecordStore::add()
+{
+    uint32_t id;
+    if (!freeIds.empty())
+    {
+        id = freeIds.back();
+        freeIds.pop_back();
+    }
+    else
+    {
+        id = (uint32_t)slots.size();
+        slots.push_back(RECORD_NONE);
+    }
+    slots[id] = (uint32_t)ids.size();
+    ids.push_back(id);
+    for (size_t f = 0; f < columns.size(); f++)
+        columns[f].resize(columns[f].size() + layout.fields[f].size);
+    return id;
+}
+
+bool RecordStore::remove(uint32_t id)
+{
+    uint32_t index = indexOf(id);
+    if (index == RECORD_NONE)
+    {
+        std::cout << "Record " << id << " not found" << std::endl;
+        return false;
+    }
+    // the last record moves into the hole
+    size_t last = ids.size() - 1;
+    if (index != last)
+        moveRecord(last, index);
+    for (size_t f = 0; f < columns.size(); f++)
+        columns[f].resize(last * layout.fields[f].size);
+    ids[index] = ids[last];
+    slots[ids[index]] = index;
+    ids.pop_back();
+    slots[id] = RECORD_NONE;
+    freeIds.push_back(id);
+    return true;
+}
+
+void RecordStore::clear()
+{
+    for (uint32_t id : ids)
+    {
+        slots[id] = RECORD_NONE;
+        freeIds.push_back(id);
+    }
+    ids.clear();
+    for (auto &column : columns)
+        column.clear();
+}
+
+//**************************************************************************** */
+// user types
+
+int TypeRegistry::add(const GCType &type)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (count == GC_MAX_USER_TYPES)
+    {
+        std::cout << "Too many user types, cannot add " << type.name << std::endl;
+        return ObjectType::NIL;
+    }
+    types[count] = type;
+    return ObjectType::USER + count++;
+}
@@ -5,8 +5,41 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <type_traits>
+#include <cstdint>
+#include <new>
+#include <typeinfo>
+#include <utility>
+#include <cstddef>
+
+#include "Simd.hpp"
 
 const int GC_THRESHOLD = 1024 * 24;
+const size_t GC_EXTERNAL_THRESHOLD = 1024 * 1024 * 4;
+
+const size_t ARENA_ALIGN = 8;
+const size_t ARENA_SMALL_LIMIT = 4096;
+const size_t ARENA_SIZE_CLASSES = ARENA_SMALL_LIMIT / ARENA_ALIGN + 1;
+const size_t ARENA_BLOCK_SIZE = 1024 * 1024;
+const size_t ARENA_MIN_BLOCK_SIZE = 64 * 1024;
+const size_t ARENA_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+const size_t ARENA_RESERVE_SIZE = (size_t)64 * 1024 * 1024 * 1024;
+const size_t SWEEP_PARALLEL_MIN = 1 << 15;
+const size_t MARK_STACK_SIZE = 1 << 16;
+const size_t MARK_SLICE = 128;
+const size_t MARK_PREFETCH_DISTANCE = 16;
+const size_t CARD_SLOTS = 128;
+const size_t GC_MINOR_PER_MAJOR = 8;
+const size_t REGION_MAX_DEPTH = 64;
+const size_t CONCURRENT_PACING = 2;
+const int STRUCTURAL_DEPTH = 32;
 
 enum ObjectType
 {
@@ -18,15 +51,187 @@ enum ObjectType
     LIST,
     MAP,
     SCOPE,
+    WEAK_REF,
+    WEAK_MAP,
+    INT_ARRAY,
+    LONG_ARRAY,
+    REAL_ARRAY,
+    RECORD_STORE,
+    USER = 64, // first id handed to Factory::make types, up to 255
 };
 
+struct Object;
 struct Pointer;
 
+struct GCStats
+{
+    size_t collections{0};
+    size_t objectsFreed{0};
+    size_t bytesFreed{0};
+    size_t finalized{0};
+    size_t emergencyCollections{0};
+    size_t markOverflows{0};
+    size_t minorCollections{0};
+    size_t cardsScanned{0};
+    size_t regionFreed{0};    // objects freed at a region's end
+    size_t regionPromoted{0}; // objects that escaped a region
+    double concurrentTime{0.0}; // ms the collector thread spent marking and sweeping
+    double lastPause{0.0};      // longest stop of the last collection
+    double maxPause{0.0};
+    double totalPause{0.0};
+};
+
+enum MarkOrder
+{
+    MARK_DEPTH_FIRST,
+    MARK_BREADTH_FIRST,
+};
+
 typedef void (*OnDeleteFunction)(Pointer *);
+typedef void (*OnDeleteBatchFunction)(Pointer **, size_t);
+typedef void (*OnCollectFunction)(const GCStats &);
+typedef void (*OnReleaseFunction)(void *, size_t);
+typedef size_t (*OnSampleFunction)(Object *, size_t);
+typedef void (*OnSampleFreeFunction)(Object *);
+typedef void (*OnMemoryPressureFunction)(size_t requested, size_t committed, size_t limit);
+
+// What a recorded trace (Trace.hpp) is made of. While one is recorded every
+// allocation, root change, container store made through the methods and
+// explicit collection is passed to onTrace; otherwise each costs a null check.
+enum TraceOp
+{
+    TRACE_ALLOC,        // owner, index = size
+    TRACE_BATCH,        // index = count, the allocations of one batch follow
+    TRACE_ROOT,         // owner
+    TRACE_UNROOT,       // owner
+    TRACE_LIST_ADD,     // owner, value
+    TRACE_LIST_SET,     // owner, index, value
+    TRACE_LIST_ERASE,   // owner, index
+    TRACE_LIST_POP,     // owner
+    TRACE_MAP_INSERT,   // owner, key, value
+    TRACE_MAP_REMOVE,   // owner, key
+    TRACE_SCOPE_DEFINE, // owner, name, value
+    TRACE_SCOPE_REMOVE, // owner, name
+    TRACE_EXTERNAL,     // owner, index = bytes
+    TRACE_COLLECT,      // index = full
+    TRACE_PAUSE,
+    TRACE_RESUME,
+};
+
+struct TraceEvent
+{
+    TraceOp op;
+    Object *owner;
+    Object *key;
+    Object *value;
+    size_t index;
+    const std::string *name;
+};
+
+typedef void (*OnTraceFunction)(const TraceEvent &event);
+extern OnTraceFunction onTrace;
+
+// Collector phases, for timelines (Timeline.hpp). Each is passed to onPhase
+// when it ends, with its start; PHASE_TRIGGER is an instant. Phases of one
+// collection nest on a thread. With onPhase unset a phase costs a load and
+// a branch, the clock is not read.
+enum GCPhase
+{
+    PHASE_TRIGGER,   // arg = TriggerReason
+    PHASE_COLLECT,   // a whole stop-the-world collection
+    PHASE_ROOTS,     // roots, region objects and remembered sets pushed
+    PHASE_MARK,      // the traversal, PHASE_ROOTS included
+    PHASE_REMARK,    // concurrent: second stop
+    PHASE_SWEEP,     // arg = objects freed
+    PHASE_FINALIZE,  // arg = Pointers finalized
+    PHASE_RELEASE,   // arena blocks given back, arg = blocks
+    PHASE_CYCLE_END, // concurrent: third stop
+};
+
+enum TriggerReason
+{
+    TRIGGER_THRESHOLD, // the arena passed GC_DYNAMIC_THRESHOLD
+    TRIGGER_EXTERNAL,  // external bytes doubled
+    TRIGGER_PRESSURE,  // an allocation failed
+    TRIGGER_EXPLICIT,  // the program called collect()
+};
+
+struct PhaseEvent
+{
+    GCPhase phase;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+    size_t arg;
+};
+
+typedef void (*OnPhaseFunction)(const PhaseEvent &event);
+// read by the collector threads too
+extern std::atomic<OnPhaseFunction> onPhase;
+
+class PhaseSpan
+{
+public:
+    explicit PhaseSpan(GCPhase phase) : phase(phase), on(onPhase.load(std::memory_order_relaxed) != nullptr)
+    {
+        if (on)
+            start = std::chrono::steady_clock::now();
+    }
+    ~PhaseSpan()
+    {
+        OnPhaseFunction function = on ? onPhase.load(std::memory_order_relaxed) : nullptr;
+        if (function != nullptr)
+            function({phase, start, std::chrono::steady_clock::now(), arg});
+    }
+    PhaseSpan(const PhaseSpan &) = delete;
+    PhaseSpan &operator=(const PhaseSpan &) = delete;
+
+    size_t arg{0};
+
+private:
+    GCPhase phase;
+    bool on;
+    std::chrono::steady_clock::time_point start;
+};
+
+inline void phaseInstant(GCPhase phase, size_t arg)
+{
+    OnPhaseFunction function = onPhase.load(std::memory_order_relaxed);
+    if (function != nullptr)
+    {
+        auto now = std::chrono::steady_clock::now();
+        function({phase, now, now, arg});
+    }
+}
+
+// Blocks are aligned to their size, so the header of the block holding any
+// small arena allocation is found by masking the address (Arena::blockOf).
+struct ArenaBlock
+{
+    size_t index;
+    size_t used; // bump extent, header included; kept up to date by trim()
+    bool hugePages;
+    bool decommitted;
+};
+
+struct ArenaOptions
+{
+    size_t blockSize{ARENA_BLOCK_SIZE};    // power of two
+    size_t reserveSize{ARENA_RESERVE_SIZE}; // address space reserved at a time
+    bool hugePages{false};                 // MAP_HUGETLB, else MADV_HUGEPAGE
+};
 
 class Arena
 {
 public:
+    // free lists filled by one sweep thread, spliced into the arena afterwards
+    struct FreeBatch
+    {
+        void *heads[ARENA_SIZE_CLASSES];
+        void *tails[ARENA_SIZE_CLASSES];
+        size_t bytes;
+        size_t large;
+    };
+
     static Arena &as()
     {
         static Arena arena;
@@ -34,17 +239,69 @@ public:
     }
 
     size_t size() { return _size; }
+    size_t external() { return _external; }
+
+    static size_t roundUp(size_t size) { return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1); }
 
     void *allocate(size_t size);
+    void *allocateStorage(size_t size);
+    bool allocateBatch(size_t size, size_t count, void **out);
     void free(void *p, size_t size);
 
+    void adopt(void *block, size_t size, OnReleaseFunction release);
+
+    // only before the first allocation; returns false once the arena is in use
+    bool configure(const ArenaOptions &options);
+    const ArenaOptions &options() const { return _options; }
+
+    ArenaBlock *blockOf(const void *p) const
+    {
+        return reinterpret_cast<ArenaBlock *>(reinterpret_cast<uintptr_t>(p) & ~(uintptr_t)(_options.blockSize - 1));
+    }
+    bool contains(const void *p) const;
+    size_t blockCount() const { return blocks.size(); }
+    size_t hugeBlocks() const;
+
+    // Low-memory path. When a block or large object cannot be had, because
+    // the system refuses or because committed() would pass the limit, the
+    // arena runs an emergency collection, then the pressure callback, and
+    // retries after each. Objects then come back as nullptr; container
+    // storage, which cannot collect, throws std::bad_alloc.
+    void setLimit(size_t bytes) { _limit = bytes; }
+    size_t limit() const { return _limit; }
+    size_t committed() const { return _committed + _external; }
+    void setOnPressure(OnMemoryPressureFunction function) { onPressure = function; }
+    void setTrimOnPressure(bool enabled) { trimOnPressure = enabled; }
+    size_t failures() const { return _failures; }
+
+    // drops the free slots of blocks that hold no object and gives their
+    // pages back; the blocks are reused before new ones are committed
+    size_t trim();
+
+    // external bytes are paced on their own: a collection is due once they
+    // double since the last one, so native-heavy heaps are not starved
+    void addExternal(size_t size) { _external += size; }
+    void removeExternal(size_t size) { _external -= size; }
+    void paceExternal() { externalLimit = std::max(2 * _external, GC_EXTERNAL_THRESHOLD); }
+
+    // 0 keeps the adaptive, time-based threshold; otherwise a collection is
+    // due once the arena has grown by bytes since the last one, the same on
+    // every run
+    void setCollectGrowth(size_t bytes);
+    size_t collectGrowth() const { return _collectGrowth; }
+
+    // while a batch is set, frees on the calling thread go to it
+    static void redirectFree(FreeBatch *batch);
+    void merge(FreeBatch &batch);
+
 private:
     Arena()
     {
 
-        blockSize = 1024 * 1024;
         currentBlock = nullptr;
         currentOffset = 0;
+        for (size_t i = 0; i < ARENA_SIZE_CLASSES; i++)
+            freeLists[i] = nullptr;
 
         allocateNewBlock();
 
@@ -52,24 +309,137 @@ private:
     }
     ~Arena()
     {
-        for (void *block : blocks)
-            std::free(block);
+        releaseRegions();
+        for (auto &block : adopted)
+            block.release(block.base, block.size);
 
         _size = 0;
     }
-    void allocateNewBlock();
+    bool allocateNewBlock();
+    bool reuseBlock();
+    bool reserveRegion();
+    void releaseRegions();
+    void *take(size_t size);
+    void *takeLarge(size_t size);
+    void *reserve(size_t size);
+    size_t fillBatch(size_t size, size_t count, void **out, size_t i);
+    bool relieve(int step, size_t size);
+    void triggerCollect();
+    void outOfMemory(size_t size);
+
+    // address space reserved up front; blocks are committed from it in order
+    struct Region
+    {
+        char *base;
+        size_t size;
+        size_t committed;
+        char *mapping; // what to release, base unless the platform cannot trim
+    };
+
+    struct AdoptedBlock
+    {
+        void *base;
+        size_t size;
+        OnReleaseFunction release;
+    };
 
     size_t _size;
-    size_t blockSize;
-    std::vector<void *> blocks;
+    size_t _external{0};
+    size_t externalLimit{GC_EXTERNAL_THRESHOLD};
+    size_t _collectGrowth{0};
+    ArenaOptions _options;
+    std::vector<Region> regions;
+    std::vector<ArenaBlock *> blocks;
+    std::vector<ArenaBlock *> emptyBlocks;
+    std::vector<AdoptedBlock> adopted;
+    size_t _committed{0};
+    size_t _limit{0};
+    size_t _failures{0};
+    OnMemoryPressureFunction onPressure{nullptr};
+    bool trimOnPressure{true};
+    bool recovering{false};
+    static thread_local FreeBatch *localFree;
     char *currentBlock;
     size_t currentOffset;
+    void *freeLists[ARENA_SIZE_CLASSES];
+};
+
+template <typename T>
+struct ArenaAllocator
+{
+    typedef T value_type;
+
+    ArenaAllocator() {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &) {}
+
+    T *allocate(size_t n) { return static_cast<T *>(Arena::as().allocateStorage(n * sizeof(T))); }
+    void deallocate(T *p, size_t n) { Arena::as().free(p, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &) const { return true; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> &) const { return false; }
+};
+
+// Compressed references (SIMPLESGC_COMPRESSED_REFS): container slots and
+// the object fields that use Ref hold a 32-bit offset into the arena's one
+// reservation, in ARENA_ALIGN units, instead of a pointer. Ref<T> converts
+// to and from T*, so code reads the same in both builds.
+#ifdef GC_COMPRESSED_REFS
+const size_t COMPRESSED_WINDOW = (size_t)ARENA_ALIGN << 32;
+extern char *compressedBase;
+
+template <typename T>
+class Ref
+{
+public:
+    Ref() : bits(0) {}
+    Ref(std::nullptr_t) : bits(0) {}
+    Ref(T *p) : bits(p == nullptr ? 0 : (uint32_t)((reinterpret_cast<const char *>(p) - compressedBase) / ARENA_ALIGN)) {}
+
+    T *get() const { return bits == 0 ? nullptr : reinterpret_cast<T *>(compressedBase + (size_t)bits * ARENA_ALIGN); }
+    operator T *() const { return get(); }
+    template <typename U>
+    explicit operator U *() const { return static_cast<U *>(get()); }
+    T *operator->() const { return get(); }
+    T &operator*() const { return *get(); }
+
+private:
+    uint32_t bits; // 0 is null, the window starts with a block header
+};
+#else
+template <typename T>
+using Ref = T *;
+#endif
+
+// The mark bit. The collector thread sets and clears it while the barriers
+// read it on the program's threads, so every access is a relaxed atomic
+// one; the marking lock and the cycle's stops order the rest.
+class MarkFlag
+{
+public:
+    MarkFlag(bool value = false) : value(value) {}
+    MarkFlag(const MarkFlag &other) : value(other) {}
+    MarkFlag &operator=(bool set)
+    {
+        value.store(set, std::memory_order_relaxed);
+        return *this;
+    }
+    MarkFlag &operator=(const MarkFlag &other) { return *this = (bool)other; }
+    operator bool() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<bool> value;
 };
 
 struct Object
 {
     int type;
-    bool marked;
+    MarkFlag marked;
+    bool sampled;
+    bool remembered;
+    uint8_t region; // depth of the Region it was made in, 0 for the heap
 
     virtual ~Object() {}
 
@@ -77,12 +447,69 @@ struct Object
     {
         type = ObjectType::NIL;
         marked = false;
+        sampled = false;
+        remembered = false;
+        region = 0;
     }
     virtual bool operator==(const Object &other) const { return type == other.type; };
     virtual size_t hash() const { return std::hash<int>{}(type); }
     virtual std::string toString() { return "NIL"; }
 };
 
+void rememberWrite(Object *owner, Object *value);
+void escapeWrite(Object *owner, Object *value);
+
+// Concurrent marking (Factory::setConcurrentMarking). While the collector
+// thread marks, it holds the marking lock for each object it scans; container
+// methods take it around their writes and log the values they overwrite or
+// remove, so everything reachable when marking started gets marked. Outside
+// a cycle both cost a branch.
+extern bool markingConcurrently;
+void lockMarking();
+void unlockMarking();
+void logDeleted(Object *value);
+
+struct MutationLock
+{
+    MutationLock() : locked(markingConcurrently)
+    {
+        if (locked)
+            lockMarking();
+    }
+    ~MutationLock()
+    {
+        if (locked)
+            unlockMarking();
+    }
+    bool locked;
+};
+
+// deletion barrier; the lock must be held
+inline void deletionBarrier(Object *old)
+{
+    if (markingConcurrently && old != nullptr && !old->marked)
+        logDeleted(old);
+}
+
+// A value made in a Region stored into an object from outside it is kept,
+// with what it reaches, when the region ends.
+inline void escapeBarrier(Object *owner, Object *value)
+{
+    if (value != nullptr && value->region > owner->region)
+        escapeWrite(owner, value);
+}
+
+// Store barrier of the generational mode (Factory::setGenerational) and of
+// regions. Only objects that survived a collection are marked between
+// collections, so outside that mode a store pays for a few loads and
+// branches.
+inline void writeBarrier(Object *owner, Object *value)
+{
+    if (owner->marked && value != nullptr && !value->marked)
+        rememberWrite(owner, value);
+    escapeBarrier(owner, value);
+}
+
 struct Integer : Object
 {
     Integer()
@@ -210,6 +637,7 @@ struct Pointer : Object
 
     size_t tag{0};
     void *value{nullptr};
+    size_t external{0};
 };
 
 struct List : Object
@@ -221,46 +649,73 @@ struct List : Object
     }
     ~List()
     {
-        std::cout << "Free List" << std::endl;
+        //   std::cout << "Free List" << std::endl;
     }
 
-    bool operator==(const Object &other) const override
-    {
-        if (type != other.type)
-            return false;
-        if (auto o = dynamic_cast<const List *>(&other))
-        {
-            return this->values.size() == o->values.size();
-        }
-        return false;
-    }
-
-    size_t hash() const override
-    {
-        size_t h = std::hash<size_t>{}(values.size());
-        h += std::hash<size_t>{}(type);
-        return h;
-    }
+    // structural, element by element; see containerHash in Garbage.cpp
+    bool operator==(const Object &other) const override;
+    size_t hash() const override;
 
     std::string toString() override { return "List"; }
 
     void add(Object *obj);
     Object *get(int index);
+    bool set(int index, Object *obj);
     bool find(Object *obj);
     bool remove(Object *obj);
     bool erase(int index);
+    bool swapRemove(int index);
     Object *pop();
     Object *back();
     int size() { return values.size(); }
 
-    std::vector<Object *> values;
+    template <typename Predicate>
+    int removeIf(Predicate predicate)
+    {
+        MutationLock lock;
+        auto first = std::find_if(values.begin(), values.end(), predicate);
+        auto last = first;
+        if (first != values.end())
+        {
+            // traced as erasing each removed element where it sits by then
+            if (onTrace != nullptr)
+                onTrace({TRACE_LIST_ERASE, this, nullptr, nullptr, (size_t)(first - values.begin()), nullptr});
+            deletionBarrier(*first);
+            for (auto it = first + 1; it != values.end(); ++it)
+            {
+                if (!predicate(*it))
+                    *last++ = *it;
+                else
+                {
+                    deletionBarrier(*it);
+                    if (onTrace != nullptr)
+                        onTrace({TRACE_LIST_ERASE, this, nullptr, nullptr, (size_t)(last - values.begin()), nullptr});
+                }
+            }
+        }
+        int removed = (int)(values.end() - last);
+        if (removed > 0)
+            dirty(first - values.begin(), last - values.begin());
+        values.erase(last, values.end());
+        return removed;
+    }
+
+    // slots begin..end changed: drops the cached hash and is the card
+    // barrier in generational mode. The methods call it themselves. Code
+    // writing to values directly must call it, pass each value it stores
+    // to escapeBarrier, and while marking concurrently hold a MutationLock
+    // and pass what it overwrites to deletionBarrier.
+    void dirty(size_t begin, size_t end);
+
+    std::vector<Ref<Object>, ArenaAllocator<Ref<Object>>> values;
+    mutable size_t cachedHash{0}; // 0 until hashed or when it holds containers
 };
 
 struct ObjectHash
 {
     size_t operator()(const Object *obj) const
     {
-        return obj->hash();
+        return obj == nullptr ? 0 : obj->hash();
     }
 };
 
@@ -268,10 +723,12 @@ struct ObjectEqual
 {
     bool operator()(const Object *a, const Object *b) const
     {
-        return *a == *b;
+        return a == b || (a != nullptr && b != nullptr && *a == *b);
     }
 };
 
+// Keys hash and compare by contents, List and Map keys included; a key must
+// not change while the map holds it, or it is not found again.
 struct Map : Object
 {
     Map()
@@ -284,33 +741,291 @@ struct Map : Object
         //   std::cout << "Free Map" << std::endl;
     }
 
+    // structural and independent of bucket order
+    bool operator==(const Object &other) const override;
+    size_t hash() const override;
+
+    std::string toString() override { return "Map"; }
+
+    void insert(Object *key, Object *obj);
+    bool contains(Object *key);
+    void remove(Object *key);
+    bool set(Object *key, Object *obj);
+    Object *get(Object *key);
+
+    std::unordered_map<Ref<Object>, Ref<Object>, ObjectHash, ObjectEqual> values;
+    mutable size_t cachedHash{0}; // 0 until hashed, reset by the methods above
+};
+
+struct WeakMap : Map
+{
+    WeakMap()
+    {
+        type = ObjectType::WEAK_MAP;
+        marked = false;
+    }
+
+    std::string toString() override { return "WeakMap"; }
+};
+
+struct WeakRef : Object
+{
+    WeakRef()
+    {
+        type = ObjectType::WEAK_REF;
+        marked = false;
+    }
+
     bool operator==(const Object &other) const override
     {
         if (type != other.type)
             return false;
-        if (auto o = dynamic_cast<const Map *>(&other))
+        if (auto o = dynamic_cast<const WeakRef *>(&other))
         {
-            return this->values.size() == o->values.size();
+            return this->target == o->target;
         }
         return false;
     }
 
     size_t hash() const override
     {
-        size_t h = std::hash<size_t>{}(values.size());
-        h += std::hash<size_t>{}(type);
+        return std::hash<Object *>{}(target);
+    }
+
+    std::string toString() override { return target ? "WeakRef" : "WeakRef(cleared)"; }
+
+    // while marking concurrently the target is logged as if deleted, it may
+    // be reachable from nowhere else
+    Object *get()
+    {
+        if (markingConcurrently)
+        {
+            MutationLock lock;
+            deletionBarrier(target);
+        }
+        return target;
+    }
+    bool alive() { return target != nullptr; }
+
+    Object *target{nullptr};
+};
+
+// Unboxed numeric storage: one object and one contiguous buffer instead of a
+// List of boxed Integer/Real. The collector never looks inside the buffer.
+template <typename T, int TYPE>
+struct PackedArray : Object
+{
+    PackedArray()
+    {
+        type = TYPE;
+        marked = false;
+    }
+
+    bool operator==(const Object &other) const override
+    {
+        if (type != other.type)
+            return false;
+        const PackedArray *o = static_cast<const PackedArray *>(&other);
+        return values.size() == o->values.size() && std::equal(values.begin(), values.end(), o->values.begin());
+    }
+
+    // by contents, like List; mixed the same way
+    size_t hash() const override
+    {
+        size_t h = std::hash<size_t>{}(type) ^ (values.size() + 0x9e3779b97f4a7c15ull);
+        for (const T &value : values)
+            h ^= std::hash<T>{}(value) + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
         return h;
     }
 
-    std::string toString() override { return "Map"; }
+    std::string toString() override { return "Array(" + std::to_string(values.size()) + ")"; }
 
-    void insert(Object *key, Object *obj);
-    bool contains(Object *key);
-    void remove(Object *key);
-    bool set(Object *key, Object *obj);
-    Object *get(Object *key);
+    int size() { return values.size(); }
+    T get(int index)
+    {
+        if (index < 0 || index >= (int)values.size())
+        {
+            std::cout << "Index out [" << index << "] of bounds" << std::endl;
+            return T();
+        }
+        return values[index];
+    }
+    bool set(int index, T value)
+    {
+        if (index < 0 || index >= (int)values.size())
+        {
+            std::cout << "Index out [" << index << "] of bounds" << std::endl;
+            return false;
+        }
+        values[index] = value;
+        return true;
+    }
+    void push(T value) { values.push_back(value); }
+    void resize(size_t count) { values.resize(count); }
+
+    T *data() { return values.data(); }
+
+    void fill(T value) { packedFill(values.data(), values.size(), value); }
+    void add(T value) { packedAdd(values.data(), values.size(), value); }
+    void mul(T value) { packedMul(values.data(), values.size(), value); }
+    auto sum() -> decltype(packedSum((const T *)nullptr, 0)) { return packedSum(values.data(), values.size()); }
+    T min() { return packedMin(values.data(), values.size()); }
+    T max() { return packedMax(values.data(), values.size()); }
+    int find(T value) { return (int)packedFind(values.data(), values.size(), value); }
+
+    std::vector<T, ArenaAllocator<T>> values;
+};
+
+typedef PackedArray<int32_t, ObjectType::INT_ARRAY> IntArray;
+typedef PackedArray<int64_t, ObjectType::LONG_ARRAY> LongArray;
+typedef PackedArray<double, ObjectType::REAL_ARRAY> RealArray;
+
+const uint32_t RECORD_NONE = UINT32_MAX;
+
+struct RecordField
+{
+    size_t offset;
+    size_t size;
+};
+
+// Layout of a plain struct stored column by column in a RecordStore:
+//   RecordType::of<Bunny>().field(&Bunny::x).field(&Bunny::y)
+// Records are copied byte-wise and never traced, so fields must not hold
+// Object pointers.
+struct RecordType
+{
+    size_t size{0};
+    std::vector<RecordField> fields;
+
+    template <typename S>
+    static RecordType of()
+    {
+        static_assert(std::is_trivially_copyable<S>::value, "records must be trivially copyable");
+        RecordType type;
+        type.size = sizeof(S);
+        return type;
+    }
+
+    template <typename S, typename F>
+    RecordType &field(F S::*member)
+    {
+        S probe{};
+        size_t offset = (size_t)((char *)&(probe.*member) - (char *)&probe);
+        fields.push_back({offset, sizeof(F)});
+        return *this;
+    }
+};
 
-    std::unordered_map<Object *, Object *, ObjectHash, ObjectEqual> values;
+// Struct-of-arrays storage for many small records: one arena column per
+// field, records addressed by compact ids that survive compaction. The
+// store is a single leaf object to the collector; its records go away in
+// bulk, with removeIf() or when the store itself dies.
+struct RecordStore : Object
+{
+    RecordStore(const RecordType &layout)
+    {
+        type = ObjectType::RECORD_STORE;
+        marked = false;
+        this->layout = layout;
+        columns.resize(layout.fields.size());
+    }
+
+    // a mutable bulk store is its own identity
+    bool operator==(const Object &other) const override { return this == &other; }
+
+    size_t hash() const override { return std::hash<const void *>{}(this); }
+
+    std::string toString() override { return "RecordStore(" + std::to_string(ids.size()) + ")"; }
+
+    uint32_t add();
+    bool remove(uint32_t id);
+    void clear();
+
+    template <typename S>
+    uint32_t add(const S &record)
+    {
+        uint32_t id = add();
+        set(id, record);
+        return id;
+    }
+
+    template <typename S>
+    S get(uint32_t id)
+    {
+        S record{};
+        uint32_t index = indexOf(id);
+        for (size_t f = 0; f < layout.fields.size(); f++)
+        {
+            const RecordField &field = layout.fields[f];
+            memcpy((char *)&record + field.offset, columns[f].data() + index * field.size, field.size);
+        }
+        return record;
+    }
+
+    template <typename S>
+    void set(uint32_t id, const S &record)
+    {
+        uint32_t index = indexOf(id);
+        for (size_t f = 0; f < layout.fields.size(); f++)
+        {
+            const RecordField &field = layout.fields[f];
+            memcpy(columns[f].data() + index * field.size, (const char *)&record + field.offset, field.size);
+        }
+    }
+
+    // Removes records in one pass; predicate gets the dense index. Each hole
+    // is filled from the end, so only removed records cost copies and the
+    // order of the remaining ones is not kept.
+    template <typename Predicate>
+    int removeIf(Predicate predicate)
+    {
+        size_t count = ids.size();
+        size_t i = 0;
+        while (i < count)
+        {
+            if (!predicate(i))
+            {
+                i++;
+                continue;
+            }
+            slots[ids[i]] = RECORD_NONE;
+            freeIds.push_back(ids[i]);
+            if (i != --count)
+            {
+                moveRecord(count, i);
+                ids[i] = ids[count];
+                slots[ids[i]] = (uint32_t)i;
+            }
+        }
+        int removed = (int)(ids.size() - count);
+        ids.resize(count);
+        for (size_t f = 0; f < columns.size(); f++)
+            columns[f].resize(count * layout.fields[f].size);
+        return removed;
+    }
+
+    void moveRecord(size_t from, size_t to)
+    {
+        for (size_t f = 0; f < columns.size(); f++)
+        {
+            size_t size = layout.fields[f].size;
+            memcpy(columns[f].data() + to * size, columns[f].data() + from * size, size);
+        }
+    }
+
+    template <typename T>
+    T *column(size_t field) { return reinterpret_cast<T *>(columns[field].data()); }
+
+    int size() { return ids.size(); }
+    bool contains(uint32_t id) { return indexOf(id) != RECORD_NONE; }
+    uint32_t indexOf(uint32_t id) { return id < slots.size() ? slots[id] : RECORD_NONE; }
+    uint32_t idAt(size_t index) { return ids[index]; }
+
+    RecordType layout;
+    std::vector<std::vector<char, ArenaAllocator<char>>, ArenaAllocator<std::vector<char, ArenaAllocator<char>>>> columns;
+    std::vector<uint32_t, ArenaAllocator<uint32_t>> ids;
+    std::vector<uint32_t, ArenaAllocator<uint32_t>> slots;
+    std::vector<uint32_t, ArenaAllocator<uint32_t>> freeIds;
 };
 
 struct Scope : Object
@@ -336,7 +1051,13 @@ struct Scope : Object
     }
     bool define(const std::string &name, Object *obj)
     {
-        values[name] = obj;
+        if (onTrace != nullptr)
+            onTrace({TRACE_SCOPE_DEFINE, this, nullptr, obj, 0, &name});
+        writeBarrier(this, obj);
+        MutationLock lock;
+        Ref<Object> &slot = values[name];
+        deletionBarrier(slot);
+        slot = obj;
         return true;
     }
 
@@ -377,6 +1098,11 @@ struct Scope : Object
         auto it = values.find(name);
         if (it != values.end())
         {
+            if (onTrace != nullptr)
+                onTrace({TRACE_SCOPE_DEFINE, this, nullptr, obj, 0, &name});
+            writeBarrier(this, obj);
+            MutationLock lock;
+            deletionBarrier(it->second);
             it->second = obj;
             return true;
         }
@@ -385,11 +1111,143 @@ struct Scope : Object
         return false;
     }
 
-    Scope *parent = nullptr;
+    Ref<Scope> parent = nullptr;
     std::string toString() override { return "Scope"; }
-    std::unordered_map<std::string, Object *> values;
+    std::unordered_map<std::string, Ref<Object>> values;
+};
+
+//**************************************************************************** */
+// user types
+
+// Child visitor handed to a user type's trace function; null children are
+// skipped.
+class Tracer
+{
+public:
+    template <typename Visitor>
+    explicit Tracer(Visitor &visit)
+        : context(&visit), call([](void *context, Object *child)
+                                { (*static_cast<Visitor *>(context))(child); })
+    {
+    }
+    void operator()(Object *child) const
+    {
+        if (child != nullptr)
+            call(context, child);
+    }
+
+private:
+    void *context;
+    void (*call)(void *, Object *);
+};
+
+// A type made with Factory::make derives from Object and may declare
+//     void trace(const Tracer &visit) const;
+// calling visit on every Object it holds. Types without one are leaves.
+// Specialize GCTraits for a type whose definition cannot be changed.
+template <typename T, typename = void>
+struct GCTraits
+{
+    static const bool traced = false;
+    static void trace(const T *, const Tracer &) {}
 };
 
+template <typename T>
+struct GCTraits<T, decltype(std::declval<const T &>().trace(std::declval<const Tracer &>()), void())>
+{
+    static const bool traced = true;
+    static void trace(const T *obj, const Tracer &visit) { obj->trace(visit); }
+};
+
+struct GCType
+{
+    const char *name; // typeid name, mangled
+    size_t size;
+    void (*trace)(Object *, const Tracer &); // nullptr for leaves
+    void (*destroy)(Object *);
+};
+
+const int GC_MAX_USER_TYPES = 256 - ObjectType::USER;
+
+// One entry per type made with Factory::make, filled the first time the
+// type is made. Entries never move, so sweep threads may read them.
+class TypeRegistry
+{
+public:
+    static TypeRegistry &as()
+    {
+        static TypeRegistry registry;
+        return registry;
+    }
+
+    template <typename T>
+    int id()
+    {
+        static const int type = add({typeid(T).name(), sizeof(T),
+                                     GCTraits<T>::traced ? trace<T> : nullptr, destroy<T>});
+        return type;
+    }
+
+    bool contains(int type) const { return type >= ObjectType::USER && type < ObjectType::USER + count; }
+    const GCType &get(int type) const { return types[type - ObjectType::USER]; }
+
+private:
+    TypeRegistry() {}
+
+    template <typename T>
+    static void trace(Object *obj, const Tracer &visit) { GCTraits<T>::trace(static_cast<T *>(obj), visit); }
+    template <typename T>
+    static void destroy(Object *obj)
+    {
+        static_cast<T *>(obj)->~T();
+        Arena::as().free(obj, sizeof(T));
+    }
+
+    int add(const GCType &type);
+
+    GCType types[GC_MAX_USER_TYPES];
+    int count{0};
+    std::mutex mutex;
+};
+
+template <typename Visitor>
+inline void forEachChild(Object *obj, Visitor &&visit)
+{
+    if (obj->type == ObjectType::SCOPE)
+    {
+        Scope *scope = static_cast<Scope *>(obj);
+        for (auto &it : scope->values)
+            if (it.second != nullptr)
+                visit(it.second);
+        if (scope->parent != nullptr)
+            visit(scope->parent);
+    }
+    else if (obj->type == ObjectType::LIST)
+    {
+        List *list = static_cast<List *>(obj);
+        for (Object *value : list->values)
+            if (value != nullptr)
+                visit(value);
+    }
+    else if (obj->type == ObjectType::MAP)
+    {
+        Map *map = static_cast<Map *>(obj);
+        for (auto &it : map->values)
+        {
+            if (it.first != nullptr)
+                visit(it.first);
+            if (it.second != nullptr)
+                visit(it.second);
+        }
+    }
+    else if (obj->type >= ObjectType::USER)
+    {
+        const GCType &type = TypeRegistry::as().get(obj->type);
+        if (type.trace != nullptr)
+            type.trace(obj, Tracer(visit));
+    }
+}
+
 class Factory
 {
 public:
@@ -400,110 +1258,602 @@ public:
     }
     void addRoot(Object *obj)
     {
+        if (onTrace != nullptr)
+            onTrace({TRACE_ROOT, obj, nullptr, nullptr, 0, nullptr});
+        if (obj->region != 0)
+            regionFrames.back().rooted.push_back(obj);
         roots.insert(obj);
     }
     void removeRoot(Object *obj)
     {
+        if (onTrace != nullptr)
+            onTrace({TRACE_UNROOT, obj, nullptr, nullptr, 0, nullptr});
         roots.erase(obj);
     }
 
+    // refused while a concurrent cycle runs
     void mark();
     void sweep();
 
+    // Depth-first marking uses a preallocated stack of MARK_STACK_SIZE
+    // entries; breadth-first is the old deque-based traversal, kept for
+    // comparison.
+    void setMarkOrder(MarkOrder order) { markOrder = order; }
+    MarkOrder getMarkOrder() const { return markOrder; }
+
     void markValue(Object *obj)
     {
         obj->marked = true;
     }
 
-    void collect()
+    void collect();
+
+    // No collection starts while paused; allocation goes on and the trigger
+    // is checked again at the first allocation after the last resume. For
+    // building structures out of several objects none of which is rooted.
+    void pauseCollection()
+    {
+        if (onTrace != nullptr)
+            onTrace({TRACE_PAUSE, nullptr, nullptr, nullptr, 0, nullptr});
+        collectPauses++;
+    }
+    void resumeCollection()
     {
-        mark();
-        sweep();
+        if (onTrace != nullptr)
+            onTrace({TRACE_RESUME, nullptr, nullptr, nullptr, 0, nullptr});
+        collectPauses--;
     }
+    bool collectionPaused() const { return collectPauses != 0; }
+
+    // a full collection that also runs the pending finalizers, so the native
+    // memory they hold is back before it returns; used by the arena when low
+    void collectEmergency();
+
+    // Generational mode with sticky mark bits: the survivors of a collection
+    // stay marked and are old from then on. A minor collection marks from the
+    // roots and from what the write barriers remembered, stops at old
+    // objects and sweeps only what was allocated since the last collection.
+    // Lists remember written CARD_SLOTS-slot cards, so a minor collection
+    // rescans only those. Every GC_MINOR_PER_MAJOR + 1-th collection is full.
+    void setGenerational(bool enabled);
+    bool generational() const { return generationalMode; }
+    void collectFull();
+
+    // barriers: owner is rescanned whole at the next minor collection, a
+    // young value stored into an old object is marked by it, and list cards.
+    // While marking concurrently, remember(owner) before changing a user
+    // type in place also keeps the collector thread from scanning it.
+    void remember(Object *owner)
+    {
+        if (generationalMode && owner->marked && !owner->remembered)
+        {
+            owner->remembered = true;
+            rememberedObjects.push_back(owner);
+        }
+        else if (markingConcurrently && owner->type >= ObjectType::USER && !owner->marked)
+            blacken(owner);
+        if (owner->region < regionFrames.size())
+            regionFrames.back().owners.insert(owner);
+    }
+    void rememberValue(Object *owner, Object *value);
+    void rememberCards(List *list, size_t begin, size_t end);
+
+    // Regions: until endRegion every object made, Pointers and batches
+    // excepted, is kept in the region instead of the registry, and
+    // collections in between keep all of them. At the end, what is still
+    // rooted or was stored into an outer object through the methods or
+    // barriers moves to the enclosing region or the heap; the rest is freed
+    // there and then, without marking or sweeping. Objects held only by C++
+    // locals past the end must be rooted or stored first. Regions nest up to
+    // REGION_MAX_DEPTH.
+    bool beginRegion();
+    void endRegion();
+    size_t regionDepth() const { return regionFrames.size(); }
+    void rememberEscape(Object *owner, Object *value) { regionFrames.back().escapes.push_back({value, owner->region}); }
+
+    // Concurrent snapshot-at-the-beginning collection. A triggered collection
+    // copies the roots and returns; a collector thread marks from them while
+    // the program runs, then sweeps. The program stops three times per
+    // cycle, for the root copy, for the remark of what the barriers logged
+    // and for handing the swept registry back; allocation steps the cycle
+    // through those. Objects made meanwhile are born marked. A program that
+    // outruns the thread waits once the arena has grown CONCURRENT_PACING
+    // times since the cycle started. collect(), collectFull() and the
+    // emergency collection still run a whole cycle before returning. Not
+    // with the generational mode.
+    bool setConcurrentMarking(bool enabled);
+    bool concurrentMarking() const { return concurrentMode; }
+    bool collecting() const { return cyclePhase.load(std::memory_order_relaxed) != CYCLE_IDLE; }
+    void stepCollection();
+    void finishCollection();
 
     void clean();
 
     Object *newNil()
     {
         void *p = Arena::as().allocate(sizeof(Object));
+        if (p == nullptr)
+            return nullptr;
         Object *obj = new (p) Object();
-        objects.push_back(obj);
+        registerObject(obj, sizeof(Object));
         return obj;
     }
 
     Integer *newInteger(int value)
     {
         void *p = Arena::as().allocate(sizeof(Integer));
+        if (p == nullptr)
+            return nullptr;
         Integer *obj = new (p) Integer();
         obj->value = value;
-        objects.push_back(obj);
+        registerObject(obj, sizeof(Integer));
         return obj;
     }
 
     Real *newReal(double value)
     {
         void *p = Arena::as().allocate(sizeof(Real));
+        if (p == nullptr)
+            return nullptr;
         Real *obj = new (p) Real();
         obj->value = value;
-        objects.push_back(obj);
+        registerObject(obj, sizeof(Real));
         return obj;
     }
 
     String *newString(const std::string &value)
     {
         void *p = Arena::as().allocate(sizeof(String));
+        if (p == nullptr)
+            return nullptr;
         String *obj = new (p) String();
         obj->value = value;
-        objects.push_back(obj);
+        registerObject(obj, sizeof(String));
         return obj;
     }
 
     Pointer *newPointer(size_t tag)
     {
         void *p = Arena::as().allocate(sizeof(Pointer));
+        if (p == nullptr)
+            return nullptr;
         Pointer *obj = new (p) Pointer();
         obj->tag = tag;
         obj->value = nullptr;
-        objects.push_back(obj);
+        registerObject(obj, sizeof(Pointer));
         return obj;
     }
 
     List *newList()
     {
         void *p = Arena::as().allocate(sizeof(List));
+        if (p == nullptr)
+            return nullptr;
         List *obj = new (p) List();
-        objects.push_back(obj);
+        registerObject(obj, sizeof(List));
         return obj;
     }
 
     Map *newMap()
     {
         void *p = Arena::as().allocate(sizeof(Map));
+        if (p == nullptr)
+            return nullptr;
         Map *obj = new (p) Map();
-        objects.push_back(obj);
+        registerObject(obj, sizeof(Map));
         return obj;
     }
 
     Scope *newScope(Scope *parent = nullptr)
     {
         void *p = Arena::as().allocate(sizeof(Scope));
+        if (p == nullptr)
+            return nullptr;
         Scope *obj = new (p) Scope(parent);
-        objects.push_back(obj);
+        registerObject(obj, sizeof(Scope));
         return obj;
     }
+
+    WeakRef *newWeakRef(Object *target)
+    {
+        void *p = Arena::as().allocate(sizeof(WeakRef));
+        if (p == nullptr)
+            return nullptr;
+        WeakRef *obj = new (p) WeakRef();
+        obj->target = target;
+        registerObject(obj, sizeof(WeakRef));
+        return obj;
+    }
+
+    WeakMap *newWeakMap()
+    {
+        void *p = Arena::as().allocate(sizeof(WeakMap));
+        if (p == nullptr)
+            return nullptr;
+        WeakMap *obj = new (p) WeakMap();
+        registerObject(obj, sizeof(WeakMap));
+        return obj;
+    }
+
+    IntArray *newIntArray(size_t count = 0)
+    {
+        void *p = Arena::as().allocate(sizeof(IntArray));
+        if (p == nullptr)
+            return nullptr;
+        IntArray *obj = new (p) IntArray();
+        obj->values.resize(count);
+        registerObject(obj, sizeof(IntArray) + count * sizeof(int32_t));
+        return obj;
+    }
+
+    LongArray *newLongArray(size_t count = 0)
+    {
+        void *p = Arena::as().allocate(sizeof(LongArray));
+        if (p == nullptr)
+            return nullptr;
+        LongArray *obj = new (p) LongArray();
+        obj->values.resize(count);
+        registerObject(obj, sizeof(LongArray) + count * sizeof(int64_t));
+        return obj;
+    }
+
+    RealArray *newRealArray(size_t count = 0)
+    {
+        void *p = Arena::as().allocate(sizeof(RealArray));
+        if (p == nullptr)
+            return nullptr;
+        RealArray *obj = new (p) RealArray();
+        obj->values.resize(count);
+        registerObject(obj, sizeof(RealArray) + count * sizeof(double));
+        return obj;
+    }
+
+    RecordStore *newRecordStore(const RecordType &layout)
+    {
+        void *p = Arena::as().allocate(sizeof(RecordStore));
+        if (p == nullptr)
+            return nullptr;
+        RecordStore *obj = new (p) RecordStore(layout);
+        registerObject(obj, sizeof(RecordStore));
+        return obj;
+    }
+
+    // Objects of a user type (see GCTraits). Size class, destructor and
+    // trace function are fixed at compile time; the collector reaches them
+    // through one table lookup on the type id. The constructor must not
+    // allocate collected objects, as the new object is not registered yet.
+    template <typename T, typename... Args>
+    T *make(Args &&...args)
+    {
+        static_assert(std::is_base_of<Object, T>::value, "Factory::make needs a type derived from Object");
+#ifdef GC_COMPRESSED_REFS
+        static_assert(sizeof(T) <= ARENA_SMALL_LIMIT, "with compressed references objects must come from arena blocks");
+#endif
+        int type = TypeRegistry::as().id<T>();
+        if (type == ObjectType::NIL)
+            return nullptr;
+        void *p = Arena::as().allocate(sizeof(T));
+        if (p == nullptr)
+            return nullptr;
+        T *obj = new (p) T(std::forward<Args>(args)...);
+        obj->type = type;
+        registerObject(obj, sizeof(T));
+        return obj;
+    }
+
+    // Batches reuse free slots first and take the rest from one contiguous
+    // reservation. The registry grows with one append and the collection
+    // trigger is checked once, before any object of the batch exists. When
+    // memory runs out the whole batch fails and out is filled with nullptr.
+    bool newIntegers(size_t count, int value, Integer **out)
+    {
+        if (!Arena::as().allocateBatch(sizeof(Integer), count, reinterpret_cast<void **>(out)))
+            return false;
+        for (size_t i = 0; i < count; i++)
+        {
+            out[i] = new (out[i]) Integer();
+            out[i]->value = value;
+        }
+        registerBatch(out, count, sizeof(Integer));
+        return true;
+    }
+
+    bool newReals(size_t count, double value, Real **out)
+    {
+        if (!Arena::as().allocateBatch(sizeof(Real), count, reinterpret_cast<void **>(out)))
+            return false;
+        for (size_t i = 0; i < count; i++)
+        {
+            out[i] = new (out[i]) Real();
+            out[i]->value = value;
+        }
+        registerBatch(out, count, sizeof(Real));
+        return true;
+    }
+
+    bool newStrings(size_t count, String **out)
+    {
+        if (!Arena::as().allocateBatch(sizeof(String), count, reinterpret_cast<void **>(out)))
+            return false;
+        for (size_t i = 0; i < count; i++)
+            out[i] = new (out[i]) String();
+        registerBatch(out, count, sizeof(String));
+        return true;
+    }
+
+    bool newPointers(size_t count, size_t tag, Pointer **out)
+    {
+        if (!Arena::as().allocateBatch(sizeof(Pointer), count, reinterpret_cast<void **>(out)))
+            return false;
+        for (size_t i = 0; i < count; i++)
+        {
+            out[i] = new (out[i]) Pointer();
+            out[i]->tag = tag;
+        }
+        registerBatch(out, count, sizeof(Pointer));
+        return true;
+    }
+
     void free(Object *obj);
 
+    // Sweep the registry with this many threads, the collecting one included.
+    // Only destruction is parallel: finalizers still run from the queue.
+    void setSweepThreads(size_t threads);
+    size_t sweepThreads() const { return sweepWorkers.size() + 1; }
+
+    // Native memory owned by a Pointer's payload. It counts toward the next
+    // collection and is given back when the Pointer is released.
+    void setExternalSize(Pointer *p, size_t bytes);
+
+    void adopt(Object **batch, size_t count);
+
+    // Dead Pointers are queued by sweep. By default collect() runs the queue right
+    // after sweeping; with deferred finalization it waits for runFinalizers(), or
+    // is handed to the finalizer thread. Register finalizers before starting it.
     void setOnDelete(OnDeleteFunction function);
+    void setFinalizer(size_t tag, OnDeleteFunction function);
+    void setBatchFinalizer(size_t tag, OnDeleteBatchFunction function);
+
+    void setDeferredFinalization(bool deferred) { deferFinalizers = deferred; }
+    size_t runFinalizers(size_t budget = SIZE_MAX);
+    size_t pendingFinalizers() const { return finalizeQueue.size(); }
+
+    void startFinalizerThread();
+    void stopFinalizerThread();
+    void setOnCollect(OnCollectFunction function) { onCollect = function; }
+
+    // Allocation sampling: sample is called for an allocation once countdown
+    // bytes have been allocated and returns the distance to the next one;
+    // freed is called when a sampled object dies. Used by Profile.hpp.
+    void setAllocationSampler(OnSampleFunction sample, OnSampleFreeFunction freed, size_t countdown);
+
+    size_t size() { return objects.size() + sweepSet.size(); }
+    const GCStats &stats() const { return gcStats; }
 
-    size_t size() { return objects.size(); }
+    // finishes a concurrent cycle first
+    const std::vector<Object *> &heap()
+    {
+        finishCollection();
+        return objects;
+    }
+    bool isRoot(Object *obj) const { return roots.count(obj) != 0; }
+    // objects made in the regions still open, which heap() does not hold
+    template <typename Visitor>
+    void forEachRegionObject(Visitor &&visit) const
+    {
+        for (const RegionFrame &frame : regionFrames)
+            for (Object *obj : frame.objects)
+                visit(obj);
+    }
 
 private:
     Factory();
     ~Factory();
 
+    struct Finalizer
+    {
+        OnDeleteFunction single;
+        OnDeleteBatchFunction batch;
+    };
+
+    enum CyclePhase
+    {
+        CYCLE_IDLE,
+        CYCLE_MARKING,  // collector thread
+        CYCLE_MARKED,   // remark due
+        CYCLE_SWEEPING, // collector thread
+        CYCLE_SWEPT,    // completion due
+    };
+
+    struct RegionFrame
+    {
+        std::vector<Object *> objects;
+        std::vector<Object *> rooted;
+        std::vector<std::pair<Object *, uint8_t>> escapes; // value, depth stored at
+        std::unordered_set<Object *> owners;               // outer objects remembered
+    };
+
+    void registerObject(Object *obj, size_t size)
+    {
+        if (markingConcurrently)
+            obj->marked = true;
+        if (regionFrames.empty() || obj->type == ObjectType::POINTER)
+            objects.push_back(obj);
+        else
+        {
+            obj->region = (uint8_t)regionFrames.size();
+            regionFrames.back().objects.push_back(obj);
+        }
+        if (onSample != nullptr)
+            sampleAllocation(obj, size);
+        if (onTrace != nullptr)
+            onTrace({TRACE_ALLOC, obj, nullptr, nullptr, size, nullptr});
+    }
+    void sampleAllocation(Object *obj, size_t size);
+
+    template <typename T>
+    void registerBatch(T **batch, size_t count, size_t size)
+    {
+        if (markingConcurrently)
+            for (size_t i = 0; i < count; i++)
+                batch[i]->marked = true;
+        objects.insert(objects.end(), batch, batch + count);
+        if (onSample != nullptr)
+            for (size_t i = 0; i < count; i++)
+                sampleAllocation(batch[i], size);
+        if (onTrace != nullptr)
+        {
+            onTrace({TRACE_BATCH, nullptr, nullptr, nullptr, count, nullptr});
+            for (size_t i = 0; i < count; i++)
+                onTrace({TRACE_ALLOC, batch[i], nullptr, nullptr, size, nullptr});
+        }
+    }
+
+    // lists and maps are scanned MARK_SLICE elements or buckets at a time;
+    // next is where the scan resumes, 0 for an object not visited yet
+    struct MarkEntry
+    {
+        Object *obj;
+        size_t next;
+    };
+
+    // slots may hold nullptr, e.g. a NEW_* that failed under a memory limit
+    void pushMark(Object *obj, size_t next)
+    {
+        if (obj == nullptr)
+            return;
+        if (markStack.size() == MARK_STACK_SIZE)
+        {
+            markOverflow = true;
+            return;
+        }
+        markStack.push_back({obj, next});
+    }
+    void markDepthFirst();
+    void markBreadthFirst();
+    void scanMark(const MarkEntry &entry);
+    void drainMarkStack();
+    void rescanMarked();
+    void markEphemerons(std::deque<Object *> &worklist);
+    void markEphemerons();
+    void clearWeak();
+    void sweepFrom(size_t begin);
+    void markYoung();
+    void forgetRemembered();
+    template <typename Visitor>
+    void forEachRegionRoot(Visitor &&visit);
+
+    void finalize(Pointer **batch, size_t count);
+    void release(Pointer *p);
+    void reclaimFinalized();
+    void finalizerLoop();
+
+    struct SweepChunk
+    {
+        size_t live;
+        size_t freed;
+        std::vector<Pointer *> finalize;
+        std::vector<Object *> sampled;
+        Arena::FreeBatch frees;
+    };
+
+    void destroy(Object *obj);
+    void sweepParallel();
+    void sweepChunk(size_t index);
+    void sweepRange(std::vector<Object *> &from, size_t begin, size_t end, SweepChunk &chunk);
+    void sweepLoop(size_t seen);
+    void dispatchFinalizers();
+
+    void collectConcurrent();
+    void startCycle();
+    void remark();
+    void completeCycle();
+    void traceGray();
+    void blacken(Object *owner);
+    void markerLoop();
+    void stopped(std::chrono::steady_clock::time_point start);
+
     OnDeleteFunction onDelete;
+    OnCollectFunction onCollect{nullptr};
+    OnSampleFunction onSample{nullptr};
+    OnSampleFreeFunction onSampleFree{nullptr};
+    size_t sampleCountdown{0};
+    GCStats gcStats;
     std::vector<Object *> objects;
     std::unordered_set<Object *> roots;
+    std::vector<WeakRef *> weakRefs;
+    std::vector<WeakMap *> weakMaps;
+    std::vector<MarkEntry> markStack;
+    bool markOverflow{false};
+    MarkOrder markOrder{MARK_DEPTH_FIRST};
+    size_t collectPauses{0};
+
+    bool generationalMode{false};
+    bool fullRequested{false};
+    size_t minorsSinceFull{0};
+    size_t youngBegin{0};
+    std::vector<Object *> rememberedObjects;
+    std::vector<Object *> rememberedValues;
+    std::unordered_map<List *, std::vector<uint8_t>> cardTables;
+    List *cardList{nullptr};
+    std::vector<uint8_t> *cards{nullptr};
+
+    std::vector<RegionFrame> regionFrames;
+    std::vector<RegionFrame> spareFrames;
+
+    std::unordered_map<size_t, Finalizer> finalizers;
+    std::vector<Pointer *> finalizeQueue;
+    bool deferFinalizers{false};
+
+    std::thread finalizerThread;
+    std::mutex finalizerMutex;
+    std::condition_variable finalizerReady;
+    std::vector<Pointer *> finalizerPending;
+    std::vector<Pointer *> finalizerDone;
+    bool finalizerBusy{false};
+    bool finalizerStop{false};
+
+    std::vector<std::thread> sweepWorkers;
+    std::vector<SweepChunk> sweepChunks;
+    std::mutex sweepMutex;
+    std::condition_variable sweepReady;
+    std::condition_variable sweepDone;
+    size_t sweepGeneration{0};
+    size_t sweepPending{0};
+    size_t sweepNext{0};
+    bool sweepStop{false};
+
+    bool concurrentMode{false};
+    std::atomic<int> cyclePhase{CYCLE_IDLE};
+    std::thread markerThread;
+    std::condition_variable markerWake;
+    std::condition_variable markerDone;
+    bool markerStop{false};
+    std::vector<Object *> grayStack;  // collector thread, under the marking lock
+    std::vector<Object *> sweepSet;   // the registry as of the remark
+    std::vector<Object *> regionDead; // freed at a region's end while marking
+    SweepChunk cycleSweep;
+    size_t cycleStartSize{0};
+    double cycleLongest{0.0};
+    double cycleStopped{0.0};
+    double cycleWork{0.0}; // collector thread
+};
+
+struct CollectionPause
+{
+    CollectionPause() { Factory::as().pauseCollection(); }
+    ~CollectionPause() { Factory::as().resumeCollection(); }
+};
+
+struct Region
+{
+    Region() { active = Factory::as().beginRegion(); }
+    ~Region()
+    {
+        if (active)
+            Factory::as().endRegion();
+    }
+    bool active;
 };
 
 #define NEW_INTEGER(x) Factory::as().newInteger(x)
@@ -514,5 +1864,11 @@ private:
 #define NEW_LIST() Factory::as().newList()
 #define NEW_MAP() Factory::as().newMap()
 #define NEW_SCOPE(x) Factory::as().newScope(x)
+#define NEW_WEAK_REF(x) Factory::as().newWeakRef(x)
+#define NEW_WEAK_MAP() Factory::as().newWeakMap()
+#define NEW_INT_ARRAY(x) Factory::as().newIntArray(x)
+#define NEW_LONG_ARRAY(x) Factory::as().newLongArray(x)
+#define NEW_REAL_ARRAY(x) Factory::as().newRealArray(x)
+#define NEW_RECORD_STORE(x) Factory::as().newRecordStore(x)
 #define ADD_ROOT(x) Factory::as().addRoot(x)
 #define REMOVE_ROOT(x) Factory::as().removeRoot(x)
\ No newline at end of file
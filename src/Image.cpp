@@ -0,0 +1,357 @@
+#include "pch.h"
+#include "Image.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const uint32_t typeSizes[8] = {
+    sizeof(Object), sizeof(Integer), sizeof(Real), sizeof(String),
+    sizeof(Pointer), sizeof(List), sizeof(Map), sizeof(Scope)};
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static void releaseMapping(void *base, size_t size)
+{
+    munmap(base, size);
+}
+
+//**************************************************************************** */
+// save
+
+struct ImageBuilder
+{
+    std::unordered_map<Object *, uint32_t> index;
+    std::vector<Object *> order;
+    std::vector<ImageRecord> records;
+    std::vector<ImageEdge> edges;
+    std::string data;
+
+    uint32_t indexOf(Object *obj)
+    {
+        if (obj == nullptr)
+            return IMAGE_NONE;
+        return index[obj];
+    }
+
+    uint64_t addData(const std::string &value)
+    {
+        uint64_t offset = data.size();
+        data += value;
+        return offset;
+    }
+
+    void addEdge(Object *target, const std::string *name = nullptr)
+    {
+        ImageEdge edge = {0, 0, indexOf(target)};
+        if (name != nullptr)
+        {
+            edge.name = addData(*name);
+            edge.nameLength = (uint32_t)name->size();
+        }
+        edges.push_back(edge);
+    }
+};
+
+bool saveImage(Object *root, const std::string &path)
+{
+    if (root == nullptr)
+        return false;
+
+    ImageBuilder builder;
+    std::vector<Object *> stack(1, root);
+    while (!stack.empty())
+    {
+        Object *obj = stack.back();
+        stack.pop_back();
+        if (builder.index.count(obj))
+            continue;
+        if (obj->type == ObjectType::POINTER || obj->type > ObjectType::SCOPE)
+        {
+            std::cout << "Cannot store " << obj->toString() << " in an image" << std::endl;
+            return false;
+        }
+        builder.index[obj] = (uint32_t)builder.order.size();
+        builder.order.push_back(obj);
+        forEachChild(obj, [&](Object *child)
+                     {
+                         if (!builder.index.count(child))
+                             stack.push_back(child);
+                     });
+    }
+
+    uint64_t slot = 0;
+    for (Object *obj : builder.order)
+    {
+        ImageRecord record = {(uint32_t)obj->type, (uint32_t)slot, 0, builder.edges.size(), 0, IMAGE_NONE};
+        slot += typeSizes[obj->type];
+
+        switch (obj->type)
+        {
+        case ObjectType::INT:
+            record.value = (uint64_t)(int64_t) static_cast<Integer *>(obj)->value;
+            break;
+        case ObjectType::REAL:
+            memcpy(&record.value, &static_cast<Real *>(obj)->value, sizeof(double));
+            break;
+        case ObjectType::STRING:
+        {
+            const std::string &value = static_cast<String *>(obj)->value;
+            record.value = builder.addData(value);
+            record.first = value.size();
+            break;
+        }
+        case ObjectType::LIST:
+            for (Object *value : static_cast<List *>(obj)->values)
+                builder.addEdge(value);
+            record.count = (uint32_t)static_cast<List *>(obj)->values.size();
+            break;
+        case ObjectType::MAP:
+            for (auto &it : static_cast<Map *>(obj)->values)
+            {
+                builder.addEdge(it.first);
+                builder.addEdge(it.second);
+            }
+            record.count = (uint32_t)static_cast<Map *>(obj)->values.size();
+            break;
+        case ObjectType::SCOPE:
+        {
+            Scope *scope = static_cast<Scope *>(obj);
+            for (auto &it : scope->values)
+                builder.addEdge(it.second, &it.first);
+            record.count = (uint32_t)scope->values.size();
+            record.parent = builder.indexOf(scope->parent);
+            break;
+        }
+        }
+        builder.records.push_back(record);
+    }
+    if (slot > UINT32_MAX)
+    {
+        std::cout << "Image too large" << std::endl;
+        return false;
+    }
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.pointerSize = sizeof(void *);
+    memcpy(header.typeSizes, typeSizes, sizeof(typeSizes));
+    header.objectCount = builder.order.size();
+    header.root = 0;
+    header.slotOffset = IMAGE_ALIGN;
+    header.slotSize = slot;
+    header.recordOffset = alignUp(header.slotOffset + slot, IMAGE_ALIGN);
+    header.edgeOffset = header.recordOffset + builder.records.size() * sizeof(ImageRecord);
+    header.edgeCount = builder.edges.size();
+    header.dataOffset = header.edgeOffset + builder.edges.size() * sizeof(ImageEdge);
+    header.dataSize = builder.data.size();
+
+    FILE *out = fopen(path.c_str(), "wb");
+    if (out == nullptr)
+    {
+        std::cout << "Cannot open image file " << path << std::endl;
+        return false;
+    }
+    // the slot area is left as a hole: it is only ever written after mapping
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+              fseek(out, (long)header.recordOffset, SEEK_SET) == 0 &&
+              fwrite(builder.records.data(), sizeof(ImageRecord), builder.records.size(), out) == builder.records.size() &&
+              fwrite(builder.edges.data(), sizeof(ImageEdge), builder.edges.size(), out) == builder.edges.size() &&
+              fwrite(builder.data.data(), 1, builder.data.size(), out) == builder.data.size();
+    if (fclose(out) != 0)
+        ok = false;
+    return ok;
+}
+
+//**************************************************************************** */
+// load
+
+static bool validate(const ImageHeader &header, const char *base, uint64_t fileSize)
+{
+    if (memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 || header.version != IMAGE_VERSION)
+        return false;
+    if (header.pointerSize != sizeof(void *) || memcmp(header.typeSizes, typeSizes, sizeof(typeSizes)) != 0)
+        return false;
+    if (header.objectCount == 0 || header.root >= header.objectCount || header.slotOffset % IMAGE_ALIGN != 0)
+        return false;
+    // every size is checked against what is left of the file before it is
+    // added or multiplied, so no sum can wrap
+    if (header.slotOffset > fileSize || header.slotSize > fileSize - header.slotOffset ||
+        header.recordOffset < header.slotOffset + header.slotSize || header.recordOffset > fileSize ||
+        header.objectCount > (fileSize - header.recordOffset) / sizeof(ImageRecord) ||
+        header.edgeOffset != header.recordOffset + header.objectCount * sizeof(ImageRecord) ||
+        header.edgeCount > (fileSize - header.edgeOffset) / sizeof(ImageEdge) ||
+        header.dataOffset != header.edgeOffset + header.edgeCount * sizeof(ImageEdge) ||
+        header.dataSize > fileSize - header.dataOffset)
+        return false;
+
+    const ImageRecord *records = reinterpret_cast<const ImageRecord *>(base + header.recordOffset);
+    const ImageEdge *edges = reinterpret_cast<const ImageEdge *>(base + header.edgeOffset);
+    for (uint64_t i = 0; i < header.objectCount; i++)
+    {
+        const ImageRecord &record = records[i];
+        if (record.type > ObjectType::SCOPE || record.type == ObjectType::POINTER)
+            return false;
+        if ((uint64_t)record.slot + typeSizes[record.type] > header.slotSize)
+            return false;
+        if (record.type == ObjectType::STRING &&
+            (record.first > header.dataSize || record.value > header.dataSize - record.first))
+            return false;
+        if (record.type == ObjectType::SCOPE && record.parent != IMAGE_NONE && record.parent >= header.objectCount)
+            return false;
+
+        uint64_t count = record.type == ObjectType::MAP ? 2ull * record.count : record.count;
+        if (record.type >= ObjectType::LIST && (count > header.edgeCount || record.first > header.edgeCount - count))
+            return false;
+        for (uint64_t e = 0; e < count && record.type >= ObjectType::LIST; e++)
+        {
+            const ImageEdge &edge = edges[record.first + e];
+            // any slot may be empty, e.g. after an allocation failed under a limit
+            if (edge.target != IMAGE_NONE && edge.target >= header.objectCount)
+                return false;
+            if (edge.nameLength > header.dataSize || edge.name > header.dataSize - edge.nameLength)
+                return false;
+        }
+    }
+    return true;
+}
+
+Object *loadImage(const std::string &path)
+{
+#ifdef GC_COMPRESSED_REFS
+    // the mapped slots lie outside the arena's compressed reference window
+    std::cout << "Heap images cannot be loaded with compressed references (" << path << ")" << std::endl;
+    return nullptr;
+#endif
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cout << "Cannot open image file " << path << std::endl;
+        return nullptr;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (uint64_t)info.st_size < sizeof(ImageHeader))
+    {
+        close(fd);
+        return nullptr;
+    }
+    size_t fileSize = (size_t)info.st_size;
+    char *base = static_cast<char *>(mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0));
+    close(fd);
+    if (base == MAP_FAILED)
+        return nullptr;
+
+    ImageHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (!validate(header, base, fileSize))
+    {
+        std::cout << "Invalid or incompatible image " << path << std::endl;
+        munmap(base, fileSize);
+        return nullptr;
+    }
+
+    char *slots = base + header.slotOffset;
+    const ImageRecord *records = reinterpret_cast<const ImageRecord *>(base + header.recordOffset);
+    const ImageEdge *edges = reinterpret_cast<const ImageEdge *>(base + header.edgeOffset);
+    const char *data = base + header.dataOffset;
+
+    std::vector<Object *> objects(header.objectCount);
+    for (uint64_t i = 0; i < header.objectCount; i++)
+    {
+        const ImageRecord &record = records[i];
+        void *p = slots + record.slot;
+        switch (record.type)
+        {
+        case ObjectType::NIL:
+            objects[i] = new (p) Object();
+            break;
+        case ObjectType::INT:
+        {
+            Integer *obj = new (p) Integer();
+            obj->value = (int)(int64_t)record.value;
+            objects[i] = obj;
+            break;
+        }
+        case ObjectType::REAL:
+        {
+            Real *obj = new (p) Real();
+            memcpy(&obj->value, &record.value, sizeof(double));
+            objects[i] = obj;
+            break;
+        }
+        case ObjectType::STRING:
+        {
+            String *obj = new (p) String();
+            obj->value.assign(data + record.value, record.first);
+            objects[i] = obj;
+            break;
+        }
+        case ObjectType::LIST:
+            objects[i] = new (p) List();
+            break;
+        case ObjectType::MAP:
+            objects[i] = new (p) Map();
+            break;
+        case ObjectType::SCOPE:
+            objects[i] = new (p) Scope(nullptr);
+            break;
+        }
+    }
+
+    // reference fix-ups; maps go last so List keys already have their final size when hashed
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (uint64_t i = 0; i < header.objectCount; i++)
+        {
+            const ImageRecord &record = records[i];
+            const ImageEdge *edge = edges + record.first;
+            if (pass == 0 && record.type == ObjectType::LIST)
+            {
+                List *list = static_cast<List *>(objects[i]);
+                list->values.reserve(record.count);
+                for (uint32_t e = 0; e < record.count; e++)
+                    list->values.push_back(edge[e].target == IMAGE_NONE ? nullptr : objects[edge[e].target]);
+            }
+            else if (pass == 0 && record.type == ObjectType::SCOPE)
+            {
+                Scope *scope = static_cast<Scope *>(objects[i]);
+                if (record.parent != IMAGE_NONE)
+                    scope->parent = static_cast<Scope *>(objects[record.parent]);
+                scope->values.reserve(record.count);
+                for (uint32_t e = 0; e < record.count; e++)
+                    scope->values.emplace(std::string(data + edge[e].name, edge[e].nameLength),
+                                          edge[e].target == IMAGE_NONE ? nullptr : objects[edge[e].target]);
+            }
+            else if (pass == 1 && record.type == ObjectType::MAP)
+            {
+                Map *map = static_cast<Map *>(objects[i]);
+                map->values.reserve(record.count);
+                for (uint32_t e = 0; e < record.count; e++)
+                {
+                    const ImageEdge &key = edge[2 * e];
+                    const ImageEdge &value = edge[2 * e + 1];
+                    map->values.emplace(key.target == IMAGE_NONE ? nullptr : objects[key.target],
+                                        value.target == IMAGE_NONE ? nullptr : objects[value.target]);
+                }
+            }
+        }
+    }
+
+    // only the slot area stays mapped; it now belongs to the arena
+    uint64_t slotEnd = alignUp(header.slotOffset + header.slotSize, (uint64_t)sysconf(_SC_PAGESIZE));
+    munmap(base, header.slotOffset);
+    if (fileSize > slotEnd)
+        munmap(base + slotEnd, fileSize - slotEnd);
+    Arena::as().adopt(slots, header.slotSize, releaseMapping);
+    Factory::as().adopt(objects.data(), objects.size());
+
+    return objects[header.root];
+}
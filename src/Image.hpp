@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+#include "Garbage.hpp"
+
+// Heap images: a rooted graph of Nil, Integer, Real, String, List, Map and
+// Scope objects saved with object references stored as indices. Loading maps
+// the file once, turns the (sparse) slot area of the mapping into an Arena
+// block, constructs every object in its slot and patches the references.
+//
+//   [ header | pad ] [ slots, IMAGE_ALIGN aligned ] [ records | edges | data ]
+
+const char IMAGE_MAGIC[8] = {'S', 'G', 'C', 'I', 'M', 'G', '0', '1'};
+const uint32_t IMAGE_VERSION = 1;
+const uint64_t IMAGE_ALIGN = 64 * 1024;
+const uint32_t IMAGE_NONE = UINT32_MAX;
+
+struct ImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t pointerSize;
+    uint32_t typeSizes[8];
+    uint64_t objectCount;
+    uint64_t root;
+    uint64_t slotOffset;
+    uint64_t slotSize;
+    uint64_t recordOffset;
+    uint64_t edgeOffset;
+    uint64_t edgeCount;
+    uint64_t dataOffset;
+    uint64_t dataSize;
+};
+
+struct ImageRecord
+{
+    uint32_t type;
+    uint32_t slot;
+    uint64_t value;
+    uint64_t first;
+    uint32_t count;
+    uint32_t parent;
+};
+
+struct ImageEdge
+{
+    uint64_t name;
+    uint32_t nameLength;
+    uint32_t target;
+};
+
+bool saveImage(Object *root, const std::string &path);
+Object *loadImage(const std::string &path);
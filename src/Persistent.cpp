@@ -0,0 +1,720 @@
+#include "pch.h"
+#include "Persistent.hpp"
+
+#include <atomic>
+#include <bitset>
+
+uint64_t newEditToken()
+{
+    static std::atomic<uint64_t> last{0};
+    return ++last;
+}
+
+static void sealed()
+{
+    std::cout << "Transient used after persistent()" << std::endl;
+}
+
+// a null key is the HAMT's mark for a child node, so maps refuse it
+static bool nullKey(Object *key)
+{
+    if (key != nullptr)
+        return false;
+    std::cout << "Null key in a persistent map" << std::endl;
+    return true;
+}
+
+//**************************************************************************** */
+// vector
+
+static VectorNode *newVectorNode(uint64_t edit)
+{
+    VectorNode *node = Factory::as().make<VectorNode>();
+    if (node != nullptr)
+        node->edit = edit;
+    return node;
+}
+
+// the node itself when the transient owns it, a copy otherwise. A node the
+// transient owns is only reached through nodes it owns, so the path above a
+// node changed in place never needs a new allocation that could fail.
+static VectorNode *editable(VectorNode *node, uint64_t edit)
+{
+    if (edit != 0 && node->edit == edit)
+    {
+        Factory::as().remember(node);
+        return node;
+    }
+    VectorNode *copy = newVectorNode(edit);
+    if (copy != nullptr)
+        std::copy(node->slots, node->slots + PERSISTENT_WIDTH, copy->slots);
+    return copy;
+}
+
+static VectorNode *newPath(int level, VectorNode *leaf, uint64_t edit)
+{
+    if (level == 0)
+        return leaf;
+    VectorNode *child = newPath(level - PERSISTENT_BITS, leaf, edit);
+    VectorNode *node = child != nullptr ? newVectorNode(edit) : nullptr;
+    if (node != nullptr)
+        node->slots[0] = child;
+    return node;
+}
+
+const VectorNode *VectorData::leafFor(size_t index) const
+{
+    if (index >= tailOffset())
+        return tail;
+    const VectorNode *node = root;
+    for (int level = shift; level > 0; level -= PERSISTENT_BITS)
+        node = static_cast<const VectorNode *>(node->slots[(index >> level) & PERSISTENT_MASK]);
+    return node;
+}
+
+Object *VectorData::get(size_t index) const
+{
+    return leafFor(index)->slots[index & PERSISTENT_MASK];
+}
+
+// Updates below build the new path bottom up and change the fields only
+// once every node of it was allocated; a failed allocation leaves the data
+// as it was and returns false.
+bool VectorData::push(Object *value, uint64_t edit)
+{
+    if (count - tailOffset() < PERSISTENT_WIDTH)
+    {
+        VectorNode *node = tail == nullptr ? newVectorNode(edit) : editable(tail, edit);
+        if (node == nullptr)
+            return false;
+        tail = node;
+        tail->slots[count & PERSISTENT_MASK] = value;
+        count++;
+        return true;
+    }
+
+    // the tail is full and moves into the tree, which may grow a level
+    VectorNode *next = newVectorNode(edit);
+    VectorNode *top = root != nullptr ? root : newVectorNode(edit);
+    if (next == nullptr || top == nullptr)
+        return false;
+    bool grows = (count >> PERSISTENT_BITS) > ((size_t)1 << shift);
+    if (grows)
+    {
+        VectorNode *path = newPath(shift, tail, edit);
+        VectorNode *grown = path != nullptr ? newVectorNode(edit) : nullptr;
+        if (grown == nullptr)
+            return false;
+        grown->slots[0] = top;
+        grown->slots[1] = path;
+        top = grown;
+    }
+    else if ((top = pushTail(shift, top, tail, edit)) == nullptr)
+        return false;
+
+    root = top;
+    if (grows)
+        shift += PERSISTENT_BITS;
+    tail = next;
+    tail->slots[0] = value;
+    count++;
+    return true;
+}
+
+VectorNode *VectorData::pushTail(int level, VectorNode *parent, VectorNode *leaf, uint64_t edit)
+{
+    size_t sub = ((count - 1) >> level) & PERSISTENT_MASK;
+    VectorNode *child = leaf;
+    if (level != PERSISTENT_BITS)
+    {
+        VectorNode *below = static_cast<VectorNode *>(parent->slots[sub]);
+        child = below != nullptr ? pushTail(level - PERSISTENT_BITS, below, leaf, edit)
+                                 : newPath(level - PERSISTENT_BITS, leaf, edit);
+        if (child == nullptr)
+            return nullptr;
+    }
+    VectorNode *node = editable(parent, edit);
+    if (node != nullptr)
+        node->slots[sub] = child;
+    return node;
+}
+
+bool VectorData::set(size_t index, Object *value, uint64_t edit)
+{
+    if (index >= tailOffset())
+    {
+        VectorNode *node = editable(tail, edit);
+        if (node == nullptr)
+            return false;
+        tail = node;
+        tail->slots[index & PERSISTENT_MASK] = value;
+        return true;
+    }
+    VectorNode *next = assign(shift, root, index, value, edit);
+    if (next == nullptr)
+        return false;
+    root = next;
+    return true;
+}
+
+VectorNode *VectorData::assign(int level, VectorNode *node, size_t index, Object *value, uint64_t edit)
+{
+    size_t sub = (index >> level) & PERSISTENT_MASK;
+    Object *slot = value;
+    if (level > 0)
+    {
+        slot = assign(level - PERSISTENT_BITS, static_cast<VectorNode *>(node->slots[sub]), index, value, edit);
+        if (slot == nullptr)
+            return nullptr;
+    }
+    VectorNode *copy = editable(node, edit);
+    if (copy != nullptr)
+        copy->slots[sub] = slot;
+    return copy;
+}
+
+bool VectorData::pop(uint64_t edit)
+{
+    if (count <= 1)
+    {
+        *this = VectorData();
+        return true;
+    }
+    if (count - tailOffset() > 1)
+    {
+        VectorNode *node = editable(tail, edit);
+        if (node == nullptr)
+            return false;
+        tail = node;
+        tail->slots[(count - 1) & PERSISTENT_MASK] = nullptr;
+        count--;
+        return true;
+    }
+
+    // the tail empties; the last leaf of the tree takes its place
+    VectorNode *leaf = const_cast<VectorNode *>(leafFor(count - 2));
+    bool failed = false;
+    VectorNode *next = popTail(shift, root, edit, failed);
+    if (failed)
+        return false;
+    if (shift > PERSISTENT_BITS && next != nullptr && next->slots[1] == nullptr)
+    {
+        next = static_cast<VectorNode *>(next->slots[0]);
+        shift -= PERSISTENT_BITS;
+    }
+    root = next;
+    tail = leaf;
+    count--;
+    return true;
+}
+
+// nullptr once the node is left empty
+VectorNode *VectorData::popTail(int level, VectorNode *node, uint64_t edit, bool &failed)
+{
+    size_t sub = ((count - 2) >> level) & PERSISTENT_MASK;
+    VectorNode *child = nullptr;
+    if (level > PERSISTENT_BITS)
+    {
+        child = popTail(level - PERSISTENT_BITS, static_cast<VectorNode *>(node->slots[sub]), edit, failed);
+        if (failed || (child == nullptr && sub == 0))
+            return nullptr;
+    }
+    else if (sub == 0)
+        return nullptr;
+    VectorNode *copy = editable(node, edit);
+    if (copy == nullptr)
+    {
+        failed = true;
+        return nullptr;
+    }
+    copy->slots[sub] = child;
+    return copy;
+}
+
+PersistentVector *PersistentVector::push(Object *value) const
+{
+    CollectionPause pause;
+    PersistentVector *next = Factory::as().make<PersistentVector>();
+    if (next == nullptr)
+        return nullptr;
+    next->data = data;
+    return next->data.push(value, 0) ? next : nullptr;
+}
+
+PersistentVector *PersistentVector::set(size_t index, Object *value) const
+{
+    if (index >= data.count)
+    {
+        std::cout << "Index out of range" << std::endl;
+        return nullptr;
+    }
+    CollectionPause pause;
+    PersistentVector *next = Factory::as().make<PersistentVector>();
+    if (next == nullptr)
+        return nullptr;
+    next->data = data;
+    return next->data.set(index, value, 0) ? next : nullptr;
+}
+
+PersistentVector *PersistentVector::pop() const
+{
+    CollectionPause pause;
+    PersistentVector *next = Factory::as().make<PersistentVector>();
+    if (next == nullptr)
+        return nullptr;
+    next->data = data;
+    return next->data.pop(0) ? next : nullptr;
+}
+
+TransientVector *PersistentVector::transient() const
+{
+    CollectionPause pause;
+    TransientVector *transient = Factory::as().make<TransientVector>();
+    if (transient == nullptr)
+        return nullptr;
+    transient->data = data;
+    transient->edit = newEditToken();
+    return transient;
+}
+
+bool TransientVector::push(Object *value)
+{
+    if (edit == 0)
+    {
+        sealed();
+        return false;
+    }
+    CollectionPause pause;
+    Factory::as().remember(this);
+    return data.push(value, edit);
+}
+
+bool TransientVector::set(size_t index, Object *value)
+{
+    if (edit == 0)
+    {
+        sealed();
+        return false;
+    }
+    if (index >= data.count)
+    {
+        std::cout << "Index out of range" << std::endl;
+        return false;
+    }
+    CollectionPause pause;
+    Factory::as().remember(this);
+    return data.set(index, value, edit);
+}
+
+bool TransientVector::pop()
+{
+    if (edit == 0)
+    {
+        sealed();
+        return false;
+    }
+    CollectionPause pause;
+    Factory::as().remember(this);
+    return data.pop(edit);
+}
+
+// a transient whose persistent() failed stays open
+PersistentVector *TransientVector::persistent()
+{
+    if (edit == 0)
+    {
+        sealed();
+        return nullptr;
+    }
+    CollectionPause pause;
+    PersistentVector *vector = Factory::as().make<PersistentVector>();
+    if (vector == nullptr)
+        return nullptr;
+    vector->data = data;
+    edit = 0;
+    return vector;
+}
+
+//**************************************************************************** */
+// hash map
+
+static uint32_t hashOf(Object *key)
+{
+    uint64_t hash = key->hash();
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static bool sameKey(Object *a, Object *b)
+{
+    return a == b || *a == *b;
+}
+
+static uint32_t bitFor(uint32_t hash, int shift)
+{
+    return 1u << ((hash >> shift) & PERSISTENT_MASK);
+}
+
+static size_t pairIndex(uint32_t bitmap, uint32_t bit)
+{
+    return 2 * std::bitset<32>(bitmap & (bit - 1)).count();
+}
+
+static MapNode *newMapNode(uint64_t edit)
+{
+    MapNode *node = Factory::as().make<MapNode>();
+    if (node != nullptr)
+        node->edit = edit;
+    return node;
+}
+
+static MapNode *editable(MapNode *node, uint64_t edit)
+{
+    if (edit != 0 && node->edit == edit)
+    {
+        Factory::as().remember(node);
+        return node;
+    }
+    MapNode *copy = newMapNode(edit);
+    if (copy == nullptr)
+        return nullptr;
+    copy->bitmap = node->bitmap;
+    copy->collision = node->collision;
+    copy->hash = node->hash;
+    copy->array = node->array;
+    return copy;
+}
+
+// two keys that now share a slot go one level down; their hashes differ
+// somewhere in the 32 bits unless they collide outright
+static MapNode *pairNode(int shift, Object *k1, Object *v1, uint32_t h1, Object *k2, Object *v2, uint32_t h2, uint64_t edit)
+{
+    MapNode *node = newMapNode(edit);
+    if (node == nullptr)
+        return nullptr;
+    if (h1 == h2)
+    {
+        node->collision = true;
+        node->hash = h1;
+        node->array = {k1, v1, k2, v2};
+        return node;
+    }
+    uint32_t b1 = bitFor(h1, shift);
+    uint32_t b2 = bitFor(h2, shift);
+    if (b1 == b2)
+    {
+        MapNode *child = pairNode(shift + PERSISTENT_BITS, k1, v1, h1, k2, v2, h2, edit);
+        if (child == nullptr)
+            return nullptr;
+        node->bitmap = b1;
+        node->array = {nullptr, child};
+    }
+    else
+    {
+        node->bitmap = b1 | b2;
+        if (b1 < b2)
+            node->array = {k1, v1, k2, v2};
+        else
+            node->array = {k2, v2, k1, v1};
+    }
+    return node;
+}
+
+// like the vector, nodes change only after what goes below them was
+// allocated; nullptr when an allocation failed
+static MapNode *assoc(MapNode *node, int shift, uint32_t hash, Object *key, Object *value, uint64_t edit, bool &added)
+{
+    if (node->collision)
+    {
+        if (hash != node->hash)
+        {
+            // hang the collision node under a bitmap node and retry there
+            MapNode *parent = newMapNode(edit);
+            if (parent == nullptr)
+                return nullptr;
+            parent->bitmap = bitFor(node->hash, shift);
+            parent->array = {nullptr, node};
+            return assoc(parent, shift, hash, key, value, edit, added);
+        }
+        for (size_t i = 0; i < node->array.size(); i += 2)
+        {
+            if (!sameKey(node->array[i], key))
+                continue;
+            if (node->array[i + 1] == value)
+                return node;
+            MapNode *copy = editable(node, edit);
+            if (copy != nullptr)
+                copy->array[i + 1] = value;
+            return copy;
+        }
+        added = true;
+        MapNode *copy = editable(node, edit);
+        if (copy == nullptr)
+            return nullptr;
+        copy->array.push_back(key);
+        copy->array.push_back(value);
+        return copy;
+    }
+
+    uint32_t bit = bitFor(hash, shift);
+    size_t i = pairIndex(node->bitmap, bit);
+    if ((node->bitmap & bit) == 0)
+    {
+        added = true;
+        MapNode *copy = editable(node, edit);
+        if (copy == nullptr)
+            return nullptr;
+        copy->bitmap |= bit;
+        copy->array.insert(copy->array.begin() + i, {key, value});
+        return copy;
+    }
+
+    Object *k = node->array[i];
+    Object *v = node->array[i + 1];
+    if (k == nullptr)
+    {
+        MapNode *child = assoc(static_cast<MapNode *>(v), shift + PERSISTENT_BITS, hash, key, value, edit, added);
+        if (child == nullptr)
+            return nullptr;
+        if (child == v)
+            return node;
+        MapNode *copy = editable(node, edit);
+        if (copy != nullptr)
+            copy->array[i + 1] = child;
+        return copy;
+    }
+    if (sameKey(k, key))
+    {
+        if (v == value)
+            return node;
+        MapNode *copy = editable(node, edit);
+        if (copy != nullptr)
+            copy->array[i + 1] = value;
+        return copy;
+    }
+
+    added = true;
+    MapNode *child = pairNode(shift + PERSISTENT_BITS, k, v, hashOf(k), key, value, hash, edit);
+    MapNode *copy = child != nullptr ? editable(node, edit) : nullptr;
+    if (copy == nullptr)
+        return nullptr;
+    copy->array[i] = nullptr;
+    copy->array[i + 1] = child;
+    return copy;
+}
+
+// nullptr once the node is left empty or, with failed set, when an
+// allocation failed
+static MapNode *without(MapNode *node, int shift, uint32_t hash, Object *key, uint64_t edit, bool &removed, bool &failed)
+{
+    if (node->collision)
+    {
+        if (hash != node->hash)
+            return node;
+        for (size_t i = 0; i < node->array.size(); i += 2)
+        {
+            if (!sameKey(node->array[i], key))
+                continue;
+            removed = true;
+            if (node->array.size() == 2)
+                return nullptr;
+            MapNode *copy = editable(node, edit);
+            if (copy == nullptr)
+            {
+                failed = true;
+                return nullptr;
+            }
+            copy->array.erase(copy->array.begin() + i, copy->array.begin() + i + 2);
+            return copy;
+        }
+        return node;
+    }
+
+    uint32_t bit = bitFor(hash, shift);
+    if ((node->bitmap & bit) == 0)
+        return node;
+    size_t i = pairIndex(node->bitmap, bit);
+    Object *k = node->array[i];
+    Object *v = node->array[i + 1];
+    if (k == nullptr)
+    {
+        MapNode *child = without(static_cast<MapNode *>(v), shift + PERSISTENT_BITS, hash, key, edit, removed, failed);
+        if (failed)
+            return nullptr;
+        if (child == v)
+            return node;
+        if (child != nullptr)
+        {
+            MapNode *copy = editable(node, edit);
+            if (copy == nullptr)
+                failed = true;
+            else
+                copy->array[i + 1] = child;
+            return copy;
+        }
+    }
+    else if (!sameKey(k, key))
+        return node;
+    else
+        removed = true;
+
+    if (node->bitmap == bit)
+        return nullptr;
+    MapNode *copy = editable(node, edit);
+    if (copy == nullptr)
+    {
+        failed = true;
+        return nullptr;
+    }
+    copy->bitmap ^= bit;
+    copy->array.erase(copy->array.begin() + i, copy->array.begin() + i + 2);
+    return copy;
+}
+
+bool MapData::find(Object *key, Object **value) const
+{
+    if (key == nullptr)
+        return false;
+    uint32_t hash = hashOf(key);
+    const MapNode *node = root;
+    for (int shift = 0; node != nullptr; shift += PERSISTENT_BITS)
+    {
+        if (node->collision)
+        {
+            if (node->hash != hash)
+                return false;
+            for (size_t i = 0; i < node->array.size(); i += 2)
+            {
+                if (sameKey(node->array[i], key))
+                {
+                    *value = node->array[i + 1];
+                    return true;
+                }
+            }
+            return false;
+        }
+        uint32_t bit = bitFor(hash, shift);
+        if ((node->bitmap & bit) == 0)
+            return false;
+        size_t i = pairIndex(node->bitmap, bit);
+        Object *k = node->array[i];
+        if (k == nullptr)
+        {
+            node = static_cast<const MapNode *>(node->array[i + 1]);
+            continue;
+        }
+        if (!sameKey(k, key))
+            return false;
+        *value = node->array[i + 1];
+        return true;
+    }
+    return false;
+}
+
+// false, with the data unchanged, when an allocation failed
+bool MapData::insert(Object *key, Object *value, uint64_t edit)
+{
+    MapNode *node = root != nullptr ? root : newMapNode(edit);
+    bool added = false;
+    if (node != nullptr)
+        node = assoc(node, 0, hashOf(key), key, value, edit, added);
+    if (node == nullptr)
+        return false;
+    root = node;
+    if (added)
+        count++;
+    return true;
+}
+
+bool MapData::remove(Object *key, uint64_t edit)
+{
+    if (root == nullptr)
+        return true;
+    bool removed = false, failed = false;
+    MapNode *node = without(root, 0, hashOf(key), key, edit, removed, failed);
+    if (failed)
+        return false;
+    root = node;
+    if (removed)
+        count--;
+    return true;
+}
+
+PersistentMap *PersistentMap::insert(Object *key, Object *value) const
+{
+    if (nullKey(key))
+        return nullptr;
+    CollectionPause pause;
+    PersistentMap *next = Factory::as().make<PersistentMap>();
+    if (next == nullptr)
+        return nullptr;
+    next->data = data;
+    return next->data.insert(key, value, 0) ? next : nullptr;
+}
+
+PersistentMap *PersistentMap::remove(Object *key) const
+{
+    if (nullKey(key))
+        return nullptr;
+    CollectionPause pause;
+    PersistentMap *next = Factory::as().make<PersistentMap>();
+    if (next == nullptr)
+        return nullptr;
+    next->data = data;
+    return next->data.remove(key, 0) ? next : nullptr;
+}
+
+TransientMap *PersistentMap::transient() const
+{
+    CollectionPause pause;
+    TransientMap *transient = Factory::as().make<TransientMap>();
+    if (transient == nullptr)
+        return nullptr;
+    transient->data = data;
+    transient->edit = newEditToken();
+    return transient;
+}
+
+bool TransientMap::insert(Object *key, Object *value)
+{
+    if (edit == 0)
+    {
+        sealed();
+        return false;
+    }
+    if (nullKey(key))
+        return false;
+    CollectionPause pause;
+    Factory::as().remember(this);
+    return data.insert(key, value, edit);
+}
+
+bool TransientMap::remove(Object *key)
+{
+    if (edit == 0)
+    {
+        sealed();
+        return false;
+    }
+    if (nullKey(key))
+        return false;
+    CollectionPause pause;
+    Factory::as().remember(this);
+    return data.remove(key, edit);
+}
+
+// a transient whose persistent() failed stays open
+PersistentMap *TransientMap::persistent()
+{
+    if (edit == 0)
+    {
+        sealed();
+        return nullptr;
+    }
+    CollectionPause pause;
+    PersistentMap *map = Factory::as().make<PersistentMap>();
+    if (map == nullptr)
+        return nullptr;
+    map->data = data;
+    edit = 0;
+    return map;
+}
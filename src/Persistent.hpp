@@ -0,0 +1,204 @@
+#pragma once
+#include <cstdint>
+
+#include "Garbage.hpp"
+
+// Persistent vector and hash map (HAMT) made of collected nodes, 32 ways
+// wide. An update returns a new version that shares everything but the
+// O(log32 n) nodes on the changed path, so holding on to a version is an
+// O(1) snapshot. A published version is never written again: while it is
+// reachable from a root, another thread may read it without locks.
+//
+// A transient batches updates: nodes it created itself are changed in place,
+// shared nodes are copied once. persistent() seals it; later updates through
+// the transient are refused.
+
+const int PERSISTENT_BITS = 5;
+const size_t PERSISTENT_WIDTH = 1 << PERSISTENT_BITS;
+const size_t PERSISTENT_MASK = PERSISTENT_WIDTH - 1;
+
+// nodes carry the edit token of the transient that may still change them
+uint64_t newEditToken();
+
+struct VectorNode : Object
+{
+    uint64_t edit{0};
+    Ref<Object> slots[PERSISTENT_WIDTH] = {};
+
+    void trace(const Tracer &visit) const
+    {
+        for (Object *slot : slots)
+            visit(slot);
+    }
+};
+
+struct VectorData
+{
+    size_t count{0};
+    int shift{PERSISTENT_BITS};
+    VectorNode *root{nullptr};
+    VectorNode *tail{nullptr};
+
+    Object *get(size_t index) const;
+    // false, with the data unchanged, when a node could not be allocated
+    bool push(Object *value, uint64_t edit);
+    bool set(size_t index, Object *value, uint64_t edit);
+    bool pop(uint64_t edit);
+
+    void trace(const Tracer &visit) const
+    {
+        visit(root);
+        visit(tail);
+    }
+
+private:
+    size_t tailOffset() const { return count < PERSISTENT_WIDTH ? 0 : ((count - 1) >> PERSISTENT_BITS) << PERSISTENT_BITS; }
+    const VectorNode *leafFor(size_t index) const;
+    VectorNode *pushTail(int level, VectorNode *parent, VectorNode *leaf, uint64_t edit);
+    VectorNode *assign(int level, VectorNode *node, size_t index, Object *value, uint64_t edit);
+    VectorNode *popTail(int level, VectorNode *node, uint64_t edit, bool &failed);
+};
+
+struct TransientVector;
+
+struct PersistentVector : Object
+{
+    VectorData data;
+
+    size_t size() const { return data.count; }
+    Object *get(size_t index) const { return index < data.count ? data.get(index) : nullptr; }
+
+    PersistentVector *push(Object *value) const;
+    PersistentVector *set(size_t index, Object *value) const;
+    PersistentVector *pop() const;
+    TransientVector *transient() const;
+
+    template <typename F>
+    void forEach(F &&visit) const
+    {
+        for (size_t i = 0; i < data.count; i++)
+            visit(data.get(i));
+    }
+
+    void trace(const Tracer &visit) const { data.trace(visit); }
+    std::string toString() override { return "PersistentVector"; }
+};
+
+struct TransientVector : Object
+{
+    VectorData data;
+    uint64_t edit{0};
+
+    size_t size() const { return data.count; }
+    Object *get(size_t index) const { return index < data.count ? data.get(index) : nullptr; }
+
+    bool push(Object *value);
+    bool set(size_t index, Object *value);
+    bool pop();
+    PersistentVector *persistent();
+
+    void trace(const Tracer &visit) const { data.trace(visit); }
+    std::string toString() override { return "TransientVector"; }
+};
+
+// A bitmap node keeps key/value pairs; a null key marks a pair whose value
+// is a child node, so the maps take no null keys: insert and remove refuse
+// one and a lookup does not find it. Keys whose 32-bit hashes are equal
+// share a collision node.
+struct MapNode : Object
+{
+    uint64_t edit{0};
+    uint32_t bitmap{0};
+    bool collision{false};
+    uint32_t hash{0};
+    std::vector<Ref<Object>, ArenaAllocator<Ref<Object>>> array;
+
+    void trace(const Tracer &visit) const
+    {
+        for (Object *slot : array)
+            visit(slot);
+    }
+};
+
+struct MapData
+{
+    size_t count{0};
+    MapNode *root{nullptr};
+
+    bool find(Object *key, Object **value) const;
+    Object *get(Object *key) const
+    {
+        Object *value = nullptr;
+        find(key, &value);
+        return value;
+    }
+    bool insert(Object *key, Object *value, uint64_t edit);
+    bool remove(Object *key, uint64_t edit);
+
+    template <typename F>
+    void forEach(F &&visit) const
+    {
+        if (root != nullptr)
+            forEachIn(root, visit);
+    }
+
+    void trace(const Tracer &visit) const { visit(root); }
+
+private:
+    template <typename F>
+    static void forEachIn(const MapNode *node, F &visit)
+    {
+        for (size_t i = 0; i < node->array.size(); i += 2)
+        {
+            if (node->array[i] == nullptr)
+                forEachIn(static_cast<const MapNode *>(node->array[i + 1]), visit);
+            else
+                visit(node->array[i], node->array[i + 1]);
+        }
+    }
+};
+
+struct TransientMap;
+
+struct PersistentMap : Object
+{
+    MapData data;
+
+    size_t size() const { return data.count; }
+    Object *get(Object *key) const { return data.get(key); }
+    bool contains(Object *key) const
+    {
+        Object *value;
+        return data.find(key, &value);
+    }
+
+    PersistentMap *insert(Object *key, Object *value) const;
+    PersistentMap *remove(Object *key) const;
+    TransientMap *transient() const;
+
+    // visit(key, value)
+    template <typename F>
+    void forEach(F &&visit) const { data.forEach(visit); }
+
+    void trace(const Tracer &visit) const { data.trace(visit); }
+    std::string toString() override { return "PersistentMap"; }
+};
+
+struct TransientMap : Object
+{
+    MapData data;
+    uint64_t edit{0};
+
+    size_t size() const { return data.count; }
+    Object *get(Object *key) const { return data.get(key); }
+
+    bool insert(Object *key, Object *value);
+    bool remove(Object *key);
+    PersistentMap *persistent();
+
+    void trace(const Tracer &visit) const { data.trace(visit); }
+    std::string toString() override { return "TransientMap"; }
+};
+
+#define NEW_PERSISTENT_VECTOR() Factory::as().make<PersistentVector>()
+#define NEW_PERSISTENT_MAP() Factory::as().make<PersistentMap>()
@@ -0,0 +1,356 @@
+#include "pch.h"
+#include "Profile.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <random>
+
+static const char *typeNames[] = {"Nil", "Integer", "Real", "String", "Pointer", "List", "Map", "Scope", "WeakRef", "WeakMap",
+                                  "IntArray", "LongArray", "RealArray", "RecordStore"};
+
+static std::string demangle(const char *name)
+{
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    std::string result = status == 0 ? demangled : name;
+    std::free(demangled);
+    return result;
+}
+
+static std::string typeName(int type)
+{
+    if (type >= 0 && type < (int)(sizeof(typeNames) / sizeof(typeNames[0])))
+        return typeNames[type];
+    if (TypeRegistry::as().contains(type))
+        return demangle(TypeRegistry::as().get(type).name);
+    return "Unknown";
+}
+
+struct LiveSample
+{
+    uint32_t site;
+    size_t objects;
+    size_t bytes;
+    size_t collections;
+};
+
+struct Profiler
+{
+    size_t interval{PROFILE_DEFAULT_INTERVAL};
+    std::mt19937_64 random{0x5eed};
+    std::vector<AllocationSite> sites;
+    std::unordered_map<std::string, uint32_t> index;
+    std::unordered_map<Object *, LiveSample> live;
+};
+
+static Profiler profiler;
+
+// the sampler itself; the collector frames below it are dropped on output
+static const int skipFrames = 1;
+
+static size_t nextSample()
+{
+    std::exponential_distribution<double> distance(1.0 / profiler.interval);
+    return (size_t)distance(profiler.random) + 1;
+}
+
+static size_t onSample(Object *obj, size_t size)
+{
+    void *frames[PROFILE_MAX_FRAMES + skipFrames];
+    int depth = backtrace(frames, PROFILE_MAX_FRAMES + skipFrames);
+    int first = std::min(depth, skipFrames);
+
+    std::string key((const char *)&obj->type, sizeof(obj->type));
+    key.append((const char *)(frames + first), (depth - first) * sizeof(void *));
+
+    auto it = profiler.index.find(key);
+    uint32_t site;
+    if (it == profiler.index.end())
+    {
+        site = (uint32_t)profiler.sites.size();
+        profiler.index.emplace(key, site);
+        AllocationSite entry = {std::vector<void *>(frames + first, frames + depth), obj->type, 0, 0, 0, 0, 0, 0};
+        profiler.sites.push_back(entry);
+    }
+    else
+        site = it->second;
+
+    // with Poisson sampling an allocation of size bytes is picked with
+    // probability 1 - exp(-size / interval); weigh it by the inverse
+    double probability = 1.0 - std::exp(-(double)size / (double)profiler.interval);
+    size_t bytes = (size_t)((double)size / probability + 0.5);
+    size_t objects = std::max<size_t>(1, (size_t)(1.0 / probability + 0.5));
+
+    AllocationSite &entry = profiler.sites[site];
+    entry.samples++;
+    entry.objects += objects;
+    entry.bytes += bytes;
+    entry.liveObjects += objects;
+    entry.liveBytes += bytes;
+
+    LiveSample sample = {site, objects, bytes, Factory::as().stats().collections};
+    profiler.live[obj] = sample;
+    return nextSample();
+}
+
+static void onSampleFree(Object *obj)
+{
+    auto it = profiler.live.find(obj);
+    if (it == profiler.live.end())
+        return;
+    AllocationSite &entry = profiler.sites[it->second.site];
+    entry.liveObjects -= it->second.objects;
+    entry.liveBytes -= it->second.bytes;
+    if (Factory::as().stats().collections > it->second.collections)
+        entry.survivedObjects += it->second.objects;
+    profiler.live.erase(it);
+}
+
+void startAllocationProfile(size_t interval)
+{
+    profiler.interval = std::max<size_t>(1, interval);
+    Factory::as().setAllocationSampler(onSample, onSampleFree, nextSample());
+}
+
+void stopAllocationProfile()
+{
+    // keep following the objects already sampled so the live totals stay right
+    Factory::as().setAllocationSampler(nullptr, onSampleFree, 0);
+}
+
+void resetAllocationProfile()
+{
+    profiler.sites.clear();
+    profiler.index.clear();
+    profiler.live.clear();
+}
+
+std::vector<AllocationSite> allocationSites()
+{
+    std::vector<AllocationSite> sites = profiler.sites;
+    size_t collections = Factory::as().stats().collections;
+    for (auto &it : profiler.live)
+        if (collections > it.second.collections)
+            sites[it.second.site].survivedObjects += it.second.objects;
+    return sites;
+}
+
+//**************************************************************************** */
+// symbols
+
+static std::string symbolName(void *address)
+{
+    // return addresses point after the call; look up the call itself
+    void *pc = (char *)address - 1;
+    Dl_info info;
+    if (dladdr(pc, &info) != 0)
+    {
+        if (info.dli_sname != nullptr)
+            return demangle(info.dli_sname);
+        if (info.dli_fname != nullptr)
+        {
+            const char *module = strrchr(info.dli_fname, '/');
+            char buffer[64];
+            snprintf(buffer, sizeof(buffer), "+0x%zx", (size_t)((char *)pc - (char *)info.dli_fbase));
+            return std::string(module ? module + 1 : info.dli_fname) + buffer;
+        }
+    }
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "0x%zx", (size_t)pc);
+    return buffer;
+}
+
+struct Symbols
+{
+    std::unordered_map<void *, std::string> names;
+
+    const std::string &get(void *address)
+    {
+        auto it = names.find(address);
+        if (it == names.end())
+            it = names.emplace(address, symbolName(address)).first;
+        return it->second;
+    }
+
+    // index of the innermost frame outside the sampling path
+    size_t first(const AllocationSite &site)
+    {
+        size_t i = 0;
+        while (i + 1 < site.frames.size())
+        {
+            const std::string &name = get(site.frames[i]);
+            if (name.compare(0, 26, "Factory::sampleAllocation(") != 0 && name.compare(0, 24, "Factory::registerObject(") != 0)
+                break;
+            i++;
+        }
+        return i;
+    }
+};
+
+//**************************************************************************** */
+// folded stacks
+
+bool writeFoldedProfile(const std::string &path, bool live)
+{
+    FILE *out = fopen(path.c_str(), "w");
+    if (out == nullptr)
+    {
+        std::cout << "Cannot open profile file " << path << std::endl;
+        return false;
+    }
+
+    Symbols symbols;
+    for (const AllocationSite &site : profiler.sites)
+    {
+        size_t bytes = live ? site.liveBytes : site.bytes;
+        if (bytes == 0)
+            continue;
+        for (size_t i = site.frames.size(), first = symbols.first(site); i-- > first;)
+            fprintf(out, "%s;", symbols.get(site.frames[i]).c_str());
+        fprintf(out, "[%s] %zu\n", typeName(site.type).c_str(), bytes);
+    }
+    return fclose(out) == 0;
+}
+
+//**************************************************************************** */
+// pprof
+
+// minimal protobuf encoder for profile.proto
+struct Proto
+{
+    std::string data;
+
+    void varint(uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            data += (char)(value | 0x80);
+            value >>= 7;
+        }
+        data += (char)value;
+    }
+    void number(int field, uint64_t value)
+    {
+        varint((uint64_t)field << 3);
+        varint(value);
+    }
+    void bytes(int field, const std::string &value)
+    {
+        varint((uint64_t)field << 3 | 2);
+        varint(value.size());
+        data += value;
+    }
+    void packed(int field, const std::vector<uint64_t> &values)
+    {
+        Proto inner;
+        for (uint64_t value : values)
+            inner.varint(value);
+        bytes(field, inner.data);
+    }
+};
+
+struct StringTable
+{
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, uint64_t> index;
+
+    StringTable() { get(""); }
+
+    uint64_t get(const std::string &value)
+    {
+        auto it = index.find(value);
+        if (it != index.end())
+            return it->second;
+        index.emplace(value, strings.size());
+        strings.push_back(value);
+        return strings.size() - 1;
+    }
+};
+
+static std::string valueType(StringTable &strings, const char *type, const char *unit)
+{
+    Proto message;
+    message.number(1, strings.get(type));
+    message.number(2, strings.get(unit));
+    return message.data;
+}
+
+bool writePprofProfile(const std::string &path)
+{
+    std::vector<AllocationSite> sites = allocationSites();
+    StringTable strings;
+    Symbols symbols;
+    Proto profile;
+
+    const char *types[][2] = {{"alloc_objects", "count"}, {"alloc_space", "bytes"}, {"inuse_objects", "count"},
+                              {"inuse_space", "bytes"}, {"survived_objects", "count"}};
+    for (auto &type : types)
+        profile.bytes(1, valueType(strings, type[0], type[1]));
+
+    // one location and one function per distinct return address
+    std::unordered_map<void *, uint64_t> locations;
+    Proto locationTable, functionTable;
+    uint64_t typeKey = strings.get("type");
+    for (const AllocationSite &site : sites)
+    {
+        std::vector<uint64_t> ids;
+        for (size_t i = symbols.first(site); i < site.frames.size(); i++)
+        {
+            void *frame = site.frames[i];
+            auto it = locations.find(frame);
+            if (it == locations.end())
+            {
+                uint64_t id = locations.size() + 1;
+                it = locations.emplace(frame, id).first;
+                uint64_t name = strings.get(symbols.get(frame));
+
+                Proto function;
+                function.number(1, id);
+                function.number(2, name);
+                function.number(3, name);
+                functionTable.bytes(5, function.data);
+
+                Proto line;
+                line.number(1, id);
+                Proto location;
+                location.number(1, id);
+                location.number(3, (uint64_t)frame);
+                location.bytes(4, line.data);
+                locationTable.bytes(4, location.data);
+            }
+            ids.push_back(it->second);
+        }
+
+        Proto label;
+        label.number(1, typeKey);
+        label.number(2, strings.get(typeName(site.type)));
+
+        Proto sample;
+        sample.packed(1, ids);
+        sample.packed(2, {site.objects, site.bytes, site.liveObjects, site.liveBytes, site.survivedObjects});
+        sample.bytes(3, label.data);
+        profile.bytes(2, sample.data);
+    }
+    profile.data += locationTable.data;
+    profile.data += functionTable.data;
+    profile.bytes(11, valueType(strings, "space", "bytes"));
+    profile.number(12, profiler.interval);
+    for (const std::string &value : strings.strings)
+        profile.bytes(6, value);
+
+    FILE *out = fopen(path.c_str(), "wb");
+    if (out == nullptr)
+    {
+        std::cout << "Cannot open profile file " << path << std::endl;
+        return false;
+    }
+    bool ok = fwrite(profile.data.data(), 1, profile.data.size(), out) == profile.data.size();
+    if (fclose(out) != 0)
+        ok = false;
+    return ok;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Garbage.hpp"
+
+// Sampling allocation profiler. While running, roughly one allocation per
+// `interval` bytes (exponentially distributed, as in tcmalloc) records a
+// backtrace and its ObjectType. Sites are keyed by (stack, type); every
+// sample stands for interval bytes, so objects and bytes are estimates.
+// Sampled objects are followed until they die, which gives the live totals
+// and the number of objects that outlived at least one collection.
+//
+// When the profiler is off the only cost on the allocation path is a null
+// check in Factory::registerObject.
+
+const size_t PROFILE_DEFAULT_INTERVAL = 512 * 1024;
+const int PROFILE_MAX_FRAMES = 64;
+
+struct AllocationSite
+{
+    std::vector<void *> frames; // innermost first
+    int type;
+    size_t samples;
+    size_t objects;
+    size_t bytes;
+    size_t liveObjects;
+    size_t liveBytes;
+    size_t survivedObjects;
+};
+
+void startAllocationProfile(size_t interval = PROFILE_DEFAULT_INTERVAL);
+void stopAllocationProfile();
+void resetAllocationProfile();
+
+std::vector<AllocationSite> allocationSites();
+
+// One line per site: "outer;...;inner;[Type] bytes", for flamegraph.pl or
+// speedscope. With live set, the weight is the bytes still alive.
+bool writeFoldedProfile(const std::string &path, bool live = false);
+
+// Uncompressed pprof protobuf with alloc_objects, alloc_space, inuse_objects,
+// inuse_space and survived_objects sample values and a "type" label.
+bool writePprofProfile(const std::string &path);
@@ -0,0 +1,599 @@
+#include "Simd.hpp"
+
+#include <type_traits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SIMPLESGC_X86 1
+#include <immintrin.h>
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+//**************************************************************************** */
+// scalar
+
+template <typename T>
+static void scalarFill(T *data, size_t count, T value)
+{
+    for (size_t i = 0; i < count; i++)
+        data[i] = value;
+}
+
+// integer arithmetic wraps like the vector instructions do
+template <typename T>
+static T wrapAdd(T a, T b)
+{
+    typedef typename std::make_unsigned<T>::type U;
+    return (T)((U)a + (U)b);
+}
+
+template <typename T>
+static T wrapMul(T a, T b)
+{
+    typedef typename std::make_unsigned<T>::type U;
+    return (T)((U)a * (U)b);
+}
+
+static double wrapAdd(double a, double b) { return a + b; }
+static double wrapMul(double a, double b) { return a * b; }
+
+template <typename T>
+static void scalarAdd(T *data, size_t count, T value)
+{
+    for (size_t i = 0; i < count; i++)
+        data[i] = wrapAdd(data[i], value);
+}
+
+template <typename T>
+static void scalarMul(T *data, size_t count, T value)
+{
+    for (size_t i = 0; i < count; i++)
+        data[i] = wrapMul(data[i], value);
+}
+
+template <typename R, typename T>
+static R scalarSum(const T *data, size_t count, R sum = 0)
+{
+    for (size_t i = 0; i < count; i++)
+        sum = wrapAdd(sum, (R)data[i]);
+    return sum;
+}
+
+// NaNs are skipped like std::fmin skips them: a NaN never wins and a NaN
+// best gives way to the next value. best != best is only true for a NaN.
+template <typename T>
+static T scalarMin(const T *data, size_t count, T best)
+{
+    for (size_t i = 0; i < count; i++)
+        best = data[i] < best || best != best ? data[i] : best;
+    return best;
+}
+
+template <typename T>
+static T scalarMax(const T *data, size_t count, T best)
+{
+    for (size_t i = 0; i < count; i++)
+        best = data[i] > best || best != best ? data[i] : best;
+    return best;
+}
+
+template <typename T>
+static int64_t scalarFind(const T *data, size_t count, T value, size_t offset = 0)
+{
+    for (size_t i = offset; i < count; i++)
+        if (data[i] == value)
+            return (int64_t)i;
+    return -1;
+}
+
+#ifdef SIMPLESGC_X86
+
+static bool hasAvx2()
+{
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+
+//**************************************************************************** */
+// AVX2
+
+AVX2 static void avx2Fill(int32_t *data, size_t count, int32_t value)
+{
+    __m256i v = _mm256_set1_epi32(value);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_si256((__m256i *)(data + i), v);
+    scalarFill(data + i, count - i, value);
+}
+
+AVX2 static void avx2Fill(int64_t *data, size_t count, int64_t value)
+{
+    __m256i v = _mm256_set1_epi64x(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_si256((__m256i *)(data + i), v);
+    scalarFill(data + i, count - i, value);
+}
+
+AVX2 static void avx2Fill(double *data, size_t count, double value)
+{
+    __m256d v = _mm256_set1_pd(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(data + i, v);
+    scalarFill(data + i, count - i, value);
+}
+
+AVX2 static void avx2Add(int32_t *data, size_t count, int32_t value)
+{
+    __m256i v = _mm256_set1_epi32(value);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(data + i));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_add_epi32(x, v));
+    }
+    scalarAdd(data + i, count - i, value);
+}
+
+AVX2 static void avx2Add(int64_t *data, size_t count, int64_t value)
+{
+    __m256i v = _mm256_set1_epi64x(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(data + i));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_add_epi64(x, v));
+    }
+    scalarAdd(data + i, count - i, value);
+}
+
+AVX2 static void avx2Add(double *data, size_t count, double value)
+{
+    __m256d v = _mm256_set1_pd(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(data + i, _mm256_add_pd(_mm256_loadu_pd(data + i), v));
+    scalarAdd(data + i, count - i, value);
+}
+
+AVX2 static void avx2Mul(int32_t *data, size_t count, int32_t value)
+{
+    __m256i v = _mm256_set1_epi32(value);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(data + i));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_mullo_epi32(x, v));
+    }
+    scalarMul(data + i, count - i, value);
+}
+
+AVX2 static void avx2Mul(double *data, size_t count, double value)
+{
+    __m256d v = _mm256_set1_pd(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(data + i, _mm256_mul_pd(_mm256_loadu_pd(data + i), v));
+    scalarMul(data + i, count - i, value);
+}
+
+AVX2 static int64_t avx2Sum(const int32_t *data, size_t count)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(data + i));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(x)));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(x, 1)));
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return scalarSum<int64_t>(data + i, count - i, scalarSum<int64_t>(lanes, 4));
+}
+
+AVX2 static int64_t avx2Sum(const int64_t *data, size_t count)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i *)(data + i)));
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return scalarSum<int64_t>(data + i, count - i, scalarSum<int64_t>(lanes, 4));
+}
+
+AVX2 static double avx2Sum(const double *data, size_t count)
+{
+    __m256d acc = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        acc = _mm256_add_pd(acc, _mm256_loadu_pd(data + i));
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    return scalarSum<double>(data + i, count - i, (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]));
+}
+
+AVX2 static int32_t avx2Min(const int32_t *data, size_t count)
+{
+    __m256i best = _mm256_set1_epi32(data[0]);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        best = _mm256_min_epi32(best, _mm256_loadu_si256((const __m256i *)(data + i)));
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, best);
+    return scalarMin(data + i, count - i, scalarMin(lanes, 8, lanes[0]));
+}
+
+AVX2 static int32_t avx2Max(const int32_t *data, size_t count)
+{
+    __m256i best = _mm256_set1_epi32(data[0]);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        best = _mm256_max_epi32(best, _mm256_loadu_si256((const __m256i *)(data + i)));
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, best);
+    return scalarMax(data + i, count - i, scalarMax(lanes, 8, lanes[0]));
+}
+
+AVX2 static int64_t avx2Min(const int64_t *data, size_t count)
+{
+    __m256i best = _mm256_set1_epi64x(data[0]);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(data + i));
+        best = _mm256_blendv_epi8(best, x, _mm256_cmpgt_epi64(best, x));
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, best);
+    return scalarMin(data + i, count - i, scalarMin(lanes, 4, lanes[0]));
+}
+
+AVX2 static int64_t avx2Max(const int64_t *data, size_t count)
+{
+    __m256i best = _mm256_set1_epi64x(data[0]);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(data + i));
+        best = _mm256_blendv_epi8(best, x, _mm256_cmpgt_epi64(x, best));
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, best);
+    return scalarMax(data + i, count - i, scalarMax(lanes, 4, lanes[0]));
+}
+
+// minpd returns its second operand when either is NaN, so a NaN x keeps
+// best; lanes whose best is NaN take x, as in scalarMin
+AVX2 static double avx2Min(const double *data, size_t count)
+{
+    __m256d best = _mm256_set1_pd(data[0]);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d x = _mm256_loadu_pd(data + i);
+        best = _mm256_blendv_pd(_mm256_min_pd(x, best), x, _mm256_cmp_pd(best, best, _CMP_UNORD_Q));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, best);
+    return scalarMin(data + i, count - i, scalarMin(lanes, 4, lanes[0]));
+}
+
+AVX2 static double avx2Max(const double *data, size_t count)
+{
+    __m256d best = _mm256_set1_pd(data[0]);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d x = _mm256_loadu_pd(data + i);
+        best = _mm256_blendv_pd(_mm256_max_pd(x, best), x, _mm256_cmp_pd(best, best, _CMP_UNORD_Q));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, best);
+    return scalarMax(data + i, count - i, scalarMax(lanes, 4, lanes[0]));
+}
+
+AVX2 static int64_t avx2Find(const int32_t *data, size_t count, int32_t value)
+{
+    __m256i v = _mm256_set1_epi32(value);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(data + i)), v);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+        if (mask != 0)
+            return (int64_t)(i + __builtin_ctz(mask));
+    }
+    return scalarFind(data, count, value, i);
+}
+
+AVX2 static int64_t avx2Find(const int64_t *data, size_t count, int64_t value)
+{
+    __m256i v = _mm256_set1_epi64x(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(data + i)), v);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+        if (mask != 0)
+            return (int64_t)(i + __builtin_ctz(mask));
+    }
+    return scalarFind(data, count, value, i);
+}
+
+AVX2 static int64_t avx2Find(const double *data, size_t count, double value)
+{
+    __m256d v = _mm256_set1_pd(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(data + i), v, _CMP_EQ_OQ));
+        if (mask != 0)
+            return (int64_t)(i + __builtin_ctz(mask));
+    }
+    return scalarFind(data, count, value, i);
+}
+
+//**************************************************************************** */
+// SSE2
+
+static void sse2Fill(int32_t *data, size_t count, int32_t value)
+{
+    __m128i v = _mm_set1_epi32(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_si128((__m128i *)(data + i), v);
+    scalarFill(data + i, count - i, value);
+}
+
+static void sse2Fill(int64_t *data, size_t count, int64_t value)
+{
+    __m128i v = _mm_set1_epi64x(value);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_si128((__m128i *)(data + i), v);
+    scalarFill(data + i, count - i, value);
+}
+
+static void sse2Fill(double *data, size_t count, double value)
+{
+    __m128d v = _mm_set1_pd(value);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(data + i, v);
+    scalarFill(data + i, count - i, value);
+}
+
+static void sse2Add(int32_t *data, size_t count, int32_t value)
+{
+    __m128i v = _mm_set1_epi32(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_add_epi32(x, v));
+    }
+    scalarAdd(data + i, count - i, value);
+}
+
+static void sse2Add(int64_t *data, size_t count, int64_t value)
+{
+    __m128i v = _mm_set1_epi64x(value);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_add_epi64(x, v));
+    }
+    scalarAdd(data + i, count - i, value);
+}
+
+static void sse2Add(double *data, size_t count, double value)
+{
+    __m128d v = _mm_set1_pd(value);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(data + i, _mm_add_pd(_mm_loadu_pd(data + i), v));
+    scalarAdd(data + i, count - i, value);
+}
+
+static void sse2Mul(double *data, size_t count, double value)
+{
+    __m128d v = _mm_set1_pd(value);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(data + i, _mm_mul_pd(_mm_loadu_pd(data + i), v));
+    scalarMul(data + i, count - i, value);
+}
+
+static int64_t sse2Sum(const int32_t *data, size_t count)
+{
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i sign = _mm_srai_epi32(x, 31);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(x, sign));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(x, sign));
+    }
+    int64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return scalarSum<int64_t>(data + i, count - i, wrapAdd(lanes[0], lanes[1]));
+}
+
+static int64_t sse2Sum(const int64_t *data, size_t count)
+{
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+        acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i *)(data + i)));
+    int64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return scalarSum<int64_t>(data + i, count - i, wrapAdd(lanes[0], lanes[1]));
+}
+
+static double sse2Sum(const double *data, size_t count)
+{
+    __m128d acc = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+        acc = _mm_add_pd(acc, _mm_loadu_pd(data + i));
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    return scalarSum<double>(data + i, count - i, lanes[0] + lanes[1]);
+}
+
+// the NaN rule of avx2Min, with and/andnot for the blend SSE2 lacks
+static __m128d sse2Keep(__m128d best, __m128d x, __m128d pick)
+{
+    __m128d nan = _mm_cmpunord_pd(best, best);
+    return _mm_or_pd(_mm_and_pd(nan, x), _mm_andnot_pd(nan, pick));
+}
+
+static double sse2Min(const double *data, size_t count)
+{
+    __m128d best = _mm_set1_pd(data[0]);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128d x = _mm_loadu_pd(data + i);
+        best = sse2Keep(best, x, _mm_min_pd(x, best));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, best);
+    return scalarMin(data + i, count - i, scalarMin(lanes, 2, lanes[0]));
+}
+
+static double sse2Max(const double *data, size_t count)
+{
+    __m128d best = _mm_set1_pd(data[0]);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128d x = _mm_loadu_pd(data + i);
+        best = sse2Keep(best, x, _mm_max_pd(x, best));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, best);
+    return scalarMax(data + i, count - i, scalarMax(lanes, 2, lanes[0]));
+}
+
+static int64_t sse2Find(const int32_t *data, size_t count, int32_t value)
+{
+    __m128i v = _mm_set1_epi32(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(data + i)), v);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        if (mask != 0)
+            return (int64_t)(i + __builtin_ctz(mask));
+    }
+    return scalarFind(data, count, value, i);
+}
+
+static int64_t sse2Find(const double *data, size_t count, double value)
+{
+    __m128d v = _mm_set1_pd(value);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        int mask = _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(data + i), v));
+        if (mask != 0)
+            return (int64_t)(i + __builtin_ctz(mask));
+    }
+    return scalarFind(data, count, value, i);
+}
+
+#define DISPATCH(avx2, sse2, scalar) \
+    if (hasAvx2())                   \
+        return avx2;                 \
+    return sse2;
+
+#define DISPATCH_AVX2(avx2, scalar) \
+    if (hasAvx2())                  \
+        return avx2;                \
+    return scalar;
+
+#else
+
+#define DISPATCH(avx2, sse2, scalar) return scalar;
+#define DISPATCH_AVX2(avx2, scalar) return scalar;
+
+#endif
+
+//**************************************************************************** */
+// entry points
+
+void packedFill(int32_t *data, size_t count, int32_t value) { DISPATCH(avx2Fill(data, count, value), sse2Fill(data, count, value), scalarFill(data, count, value)) }
+void packedFill(int64_t *data, size_t count, int64_t value) { DISPATCH(avx2Fill(data, count, value), sse2Fill(data, count, value), scalarFill(data, count, value)) }
+void packedFill(double *data, size_t count, double value) { DISPATCH(avx2Fill(data, count, value), sse2Fill(data, count, value), scalarFill(data, count, value)) }
+
+void packedAdd(int32_t *data, size_t count, int32_t value) { DISPATCH(avx2Add(data, count, value), sse2Add(data, count, value), scalarAdd(data, count, value)) }
+void packedAdd(int64_t *data, size_t count, int64_t value) { DISPATCH(avx2Add(data, count, value), sse2Add(data, count, value), scalarAdd(data, count, value)) }
+void packedAdd(double *data, size_t count, double value) { DISPATCH(avx2Add(data, count, value), sse2Add(data, count, value), scalarAdd(data, count, value)) }
+
+void packedMul(int32_t *data, size_t count, int32_t value) { DISPATCH_AVX2(avx2Mul(data, count, value), scalarMul(data, count, value)) }
+void packedMul(int64_t *data, size_t count, int64_t value) { scalarMul(data, count, value); }
+void packedMul(double *data, size_t count, double value) { DISPATCH(avx2Mul(data, count, value), sse2Mul(data, count, value), scalarMul(data, count, value)) }
+
+int64_t packedSum(const int32_t *data, size_t count) { DISPATCH(avx2Sum(data, count), sse2Sum(data, count), scalarSum<int64_t>(data, count)) }
+int64_t packedSum(const int64_t *data, size_t count) { DISPATCH(avx2Sum(data, count), sse2Sum(data, count), scalarSum<int64_t>(data, count)) }
+double packedSum(const double *data, size_t count) { DISPATCH(avx2Sum(data, count), sse2Sum(data, count), scalarSum<double>(data, count)) }
+
+int32_t packedMin(const int32_t *data, size_t count)
+{
+    if (count == 0)
+        return 0;
+    DISPATCH_AVX2(avx2Min(data, count), scalarMin(data, count, data[0]))
+}
+
+int64_t packedMin(const int64_t *data, size_t count)
+{
+    if (count == 0)
+        return 0;
+    DISPATCH_AVX2(avx2Min(data, count), scalarMin(data, count, data[0]))
+}
+
+double packedMin(const double *data, size_t count)
+{
+    if (count == 0)
+        return 0;
+    DISPATCH(avx2Min(data, count), sse2Min(data, count), scalarMin(data, count, data[0]))
+}
+
+int32_t packedMax(const int32_t *data, size_t count)
+{
+    if (count == 0)
+        return 0;
+    DISPATCH_AVX2(avx2Max(data, count), scalarMax(data, count, data[0]))
+}
+
+int64_t packedMax(const int64_t *data, size_t count)
+{
+    if (count == 0)
+        return 0;
+    DISPATCH_AVX2(avx2Max(data, count), scalarMax(data, count, data[0]))
+}
+
+double packedMax(const double *data, size_t count)
+{
+    if (count == 0)
+        return 0;
+    DISPATCH(avx2Max(data, count), sse2Max(data, count), scalarMax(data, count, data[0]))
+}
+
+int64_t packedFind(const int32_t *data, size_t count, int32_t value) { DISPATCH(avx2Find(data, count, value), sse2Find(data, count, value), scalarFind(data, count, value)) }
+int64_t packedFind(const int64_t *data, size_t count, int64_t value) { DISPATCH_AVX2(avx2Find(data, count, value), scalarFind(data, count, value)) }
+int64_t packedFind(const double *data, size_t count, double value) { DISPATCH(avx2Find(data, count, value), sse2Find(data, count, value), scalarFind(data, count, value)) }
+
+const char *packedBackend()
+{
+#ifdef SIMPLESGC_X86
+    return hasAvx2() ? "avx2" : "sse2";
+#else
+    return "scalar";
+#endif
+}
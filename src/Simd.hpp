@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Bulk kernels for packed numeric arrays. On x86-64 they dispatch at run
+// time to AVX2 or SSE2, anything else uses the scalar loops. min/max of an
+// empty range are 0, find returns the first matching index or -1. Every
+// backend gives the same double min/max: NaNs are skipped as std::fmin and
+// std::fmax skip them, and the result is NaN only if all values are.
+
+void packedFill(int32_t *data, size_t count, int32_t value);
+void packedFill(int64_t *data, size_t count, int64_t value);
+void packedFill(double *data, size_t count, double value);
+
+void packedAdd(int32_t *data, size_t count, int32_t value);
+void packedAdd(int64_t *data, size_t count, int64_t value);
+void packedAdd(double *data, size_t count, double value);
+
+void packedMul(int32_t *data, size_t count, int32_t value);
+void packedMul(int64_t *data, size_t count, int64_t value);
+void packedMul(double *data, size_t count, double value);
+
+int64_t packedSum(const int32_t *data, size_t count);
+int64_t packedSum(const int64_t *data, size_t count);
+double packedSum(const double *data, size_t count);
+
+int32_t packedMin(const int32_t *data, size_t count);
+int64_t packedMin(const int64_t *data, size_t count);
+double packedMin(const double *data, size_t count);
+
+int32_t packedMax(const int32_t *data, size_t count);
+int64_t packedMax(const int64_t *data, size_t count);
+double packedMax(const double *data, size_t count);
+
+int64_t packedFind(const int32_t *data, size_t count, int32_t value);
+int64_t packedFind(const int64_t *data, size_t count, int64_t value);
+int64_t packedFind(const double *data, size_t count, double value);
+
+const char *packedBackend();
@@ -0,0 +1,142 @@
+#include "pch.h"
+#include "Snapshot.hpp"
+
+template <typename Map>
+static size_t hashTableSize(const Map &map)
+{
+    typedef typename Map::value_type Entry;
+    // one node per entry (value plus next pointer and cached hash) and one bucket pointer
+    return map.size() * (sizeof(Entry) + 2 * sizeof(void *)) + map.bucket_count() * sizeof(void *);
+}
+
+static size_t stringSize(const std::string &value)
+{
+    // short strings live inside the object
+    return value.capacity() > 15 ? value.capacity() + 1 : 0;
+}
+
+size_t shallowSize(Object *obj)
+{
+    switch (obj->type)
+    {
+    case ObjectType::NIL:
+        return sizeof(Object);
+    case ObjectType::INT:
+        return sizeof(Integer);
+    case ObjectType::REAL:
+        return sizeof(Real);
+    case ObjectType::STRING:
+        return sizeof(String) + stringSize(static_cast<String *>(obj)->value);
+    case ObjectType::POINTER:
+        return sizeof(Pointer);
+    case ObjectType::LIST:
+        return sizeof(List) + static_cast<List *>(obj)->values.capacity() * sizeof(Ref<Object>);
+    case ObjectType::MAP:
+    case ObjectType::WEAK_MAP:
+        return sizeof(Map) + hashTableSize(static_cast<Map *>(obj)->values);
+    case ObjectType::WEAK_REF:
+        return sizeof(WeakRef);
+    case ObjectType::INT_ARRAY:
+        return sizeof(IntArray) + static_cast<IntArray *>(obj)->values.capacity() * sizeof(int32_t);
+    case ObjectType::LONG_ARRAY:
+        return sizeof(LongArray) + static_cast<LongArray *>(obj)->values.capacity() * sizeof(int64_t);
+    case ObjectType::REAL_ARRAY:
+        return sizeof(RealArray) + static_cast<RealArray *>(obj)->values.capacity() * sizeof(double);
+    case ObjectType::RECORD_STORE:
+    {
+        RecordStore *store = static_cast<RecordStore *>(obj);
+        size_t size = sizeof(RecordStore) + store->layout.fields.capacity() * sizeof(RecordField) +
+                      (store->ids.capacity() + store->slots.capacity() + store->freeIds.capacity()) * sizeof(uint32_t);
+        for (auto &column : store->columns)
+            size += sizeof(column) + column.capacity();
+        return size;
+    }
+    case ObjectType::SCOPE:
+    {
+        Scope *scope = static_cast<Scope *>(obj);
+        size_t size = sizeof(Scope) + hashTableSize(scope->values);
+        for (auto &it : scope->values)
+            size += stringSize(it.first);
+        return size;
+    }
+    }
+    if (TypeRegistry::as().contains(obj->type))
+        return TypeRegistry::as().get(obj->type).size;
+    return sizeof(Object);
+}
+
+class SnapshotWriter
+{
+public:
+    explicit SnapshotWriter(FILE *out) : out(out), ok(true) {}
+
+    void write(const void *data, size_t size)
+    {
+        if (ok && fwrite(data, 1, size, out) != size)
+            ok = false;
+    }
+
+    template <typename T>
+    void put(T value)
+    {
+        write(&value, sizeof(T));
+    }
+
+    FILE *out;
+    bool ok;
+};
+
+bool writeHeapSnapshot(FILE *out)
+{
+    if (out == nullptr)
+        return false;
+
+    SnapshotWriter writer(out);
+    writer.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    writer.put<uint32_t>(SNAPSHOT_VERSION);
+    writer.put<uint32_t>(sizeof(void *));
+
+    Factory &factory = Factory::as();
+    uint64_t count = 0;
+    auto object = [&](Object *obj, bool root)
+    {
+        uint32_t edges = 0;
+        forEachChild(obj, [&](Object *)
+                     { edges++; });
+
+        writer.put<uint8_t>(SNAPSHOT_OBJECT);
+        writer.put<uint64_t>((uint64_t)(uintptr_t)obj);
+        writer.put<uint8_t>((uint8_t)obj->type);
+        writer.put<uint8_t>(root ? SNAPSHOT_ROOT : 0);
+        writer.put<uint32_t>((uint32_t)shallowSize(obj));
+        writer.put<uint32_t>(edges);
+        forEachChild(obj, [&](Object *child)
+                     { writer.put<uint64_t>((uint64_t)(uintptr_t)child); });
+        count++;
+    };
+    for (Object *obj : factory.heap())
+        object(obj, factory.isRoot(obj));
+    // collections keep every object of an open region, so they count as roots
+    factory.forEachRegionObject([&](Object *obj)
+                                { object(obj, true); });
+
+    writer.put<uint8_t>(SNAPSHOT_END);
+    writer.put<uint64_t>(count);
+    return writer.ok && fflush(out) == 0;
+}
+
+bool writeHeapSnapshot(const std::string &path)
+{
+    FILE *out = fopen(path.c_str(), "wb");
+    if (out == nullptr)
+    {
+        std::cout << "Cannot open snapshot file " << path << std::endl;
+        return false;
+    }
+    std::vector<char> buffer(1 << 16);
+    setvbuf(out, buffer.data(), _IOFBF, buffer.size());
+    bool ok = writeHeapSnapshot(out);
+    if (fclose(out) != 0)
+        ok = false;
+    return ok;
+}
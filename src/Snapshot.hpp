@@ -0,0 +1,27 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <string>
+
+#include "Garbage.hpp"
+
+// Heap snapshot file layout (native endianness):
+//
+//   header : "SGCHEAP1" u32 version u32 pointerSize
+//   object : u8 'O' u64 id u8 type u8 flags u32 shallowSize u32 edgeCount u64 edges[edgeCount]
+//   footer : u8 'E' u64 objectCount
+//
+// Objects are written one at a time straight from Factory::heap(), then
+// those of the regions still open, flagged as roots; the writer never holds
+// more than one record in memory.
+
+const char SNAPSHOT_MAGIC[8] = {'S', 'G', 'C', 'H', 'E', 'A', 'P', '1'};
+const uint32_t SNAPSHOT_VERSION = 1;
+const uint8_t SNAPSHOT_OBJECT = 'O';
+const uint8_t SNAPSHOT_END = 'E';
+const uint8_t SNAPSHOT_ROOT = 1;
+
+size_t shallowSize(Object *obj);
+
+bool writeHeapSnapshot(FILE *out);
+bool writeHeapSnapshot(const std::string &path);
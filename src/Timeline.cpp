@@ -0,0 +1,213 @@
+#include "pch.h"
+#include "Timeline.hpp"
+
+#include <cstdio>
+#include <map>
+#include <thread>
+
+struct TimelineEntry
+{
+    int64_t start; // steady_clock ns
+    int64_t end;
+    const char *name; // application spans
+    size_t arg;
+    uint32_t thread;
+    int phase; // -1 for application spans
+};
+
+struct Timeline
+{
+    std::vector<TimelineEntry> entries;
+    std::atomic<uint64_t> next{0};
+    std::atomic<bool> running{false};
+    std::atomic<int> writers{0}; // record() calls in flight
+    std::atomic<uint32_t> nextThread{1};
+    std::mutex namesMutex;
+    std::map<uint32_t, const char *> names;
+};
+
+static Timeline timeline;
+
+static const char *phaseNames[] = {"trigger", "collect", "roots", "mark", "remark", "sweep", "finalize", "release", "cycle end"};
+static const char *reasonNames[] = {"threshold", "external", "pressure", "explicit"};
+
+static uint32_t threadId()
+{
+    thread_local uint32_t id = 0;
+    if (id == 0)
+        id = timeline.nextThread.fetch_add(1, std::memory_order_relaxed);
+    return id;
+}
+
+static int64_t nanoseconds(std::chrono::steady_clock::time_point time)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+static void record(int phase, const char *name, std::chrono::steady_clock::time_point start,
+                   std::chrono::steady_clock::time_point end, size_t arg)
+{
+    // a thread that loaded onPhase before stopTimeline may get here after
+    // it; it registers first, so stopTimeline can wait for it, and then
+    // leaves the buffer alone
+    timeline.writers.fetch_add(1);
+    if (timeline.running)
+    {
+        uint64_t slot = timeline.next.fetch_add(1, std::memory_order_relaxed);
+        TimelineEntry &entry = timeline.entries[slot % timeline.entries.size()];
+        entry.start = nanoseconds(start);
+        entry.end = nanoseconds(end);
+        entry.name = name;
+        entry.arg = arg;
+        entry.thread = threadId();
+        entry.phase = phase;
+    }
+    timeline.writers.fetch_sub(1);
+}
+
+static void onTimelinePhase(const PhaseEvent &event)
+{
+    record(event.phase, nullptr, event.start, event.end, event.arg);
+}
+
+bool startTimeline(size_t capacity)
+{
+    if (timeline.running || capacity == 0)
+        return false;
+    timeline.entries.assign(capacity, TimelineEntry());
+    timeline.next = 0;
+    {
+        std::lock_guard<std::mutex> lock(timeline.namesMutex);
+        timeline.names.emplace(threadId(), "main");
+    }
+    timeline.running = true;
+    onPhase = onTimelinePhase;
+    return true;
+}
+
+// waits out the writers still in record(), so a later start may replace
+// the buffer and the export reads it whole
+void stopTimeline()
+{
+    onPhase = nullptr;
+    timeline.running = false;
+    while (timeline.writers != 0)
+        std::this_thread::yield();
+}
+
+bool timelineRunning()
+{
+    return timeline.running.load(std::memory_order_relaxed);
+}
+
+size_t timelineDropped()
+{
+    uint64_t next = timeline.next;
+    return next > timeline.entries.size() ? (size_t)(next - timeline.entries.size()) : 0;
+}
+
+void timelineSpan(const char *name, std::chrono::steady_clock::time_point start,
+                  std::chrono::steady_clock::time_point end)
+{
+    if (timelineRunning())
+        record(-1, name, start, end, 0);
+}
+
+void setTimelineThreadName(const char *name)
+{
+    std::lock_guard<std::mutex> lock(timeline.namesMutex);
+    timeline.names[threadId()] = name;
+}
+
+//**************************************************************************** */
+// Chrome trace-event JSON
+
+static void writeString(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', out);
+        if ((unsigned char)*s >= 0x20)
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static void writeArgs(FILE *out, const TimelineEntry &entry)
+{
+    switch (entry.phase)
+    {
+    case PHASE_TRIGGER:
+        if (entry.arg < sizeof(reasonNames) / sizeof(reasonNames[0]))
+            fprintf(out, ",\"args\":{\"reason\":\"%s\"}", reasonNames[entry.arg]);
+        break;
+    case PHASE_SWEEP:
+        fprintf(out, ",\"args\":{\"freed\":%zu}", entry.arg);
+        break;
+    case PHASE_FINALIZE:
+        fprintf(out, ",\"args\":{\"finalized\":%zu}", entry.arg);
+        break;
+    case PHASE_RELEASE:
+        fprintf(out, ",\"args\":{\"blocks\":%zu}", entry.arg);
+        break;
+    default:
+        break;
+    }
+}
+
+bool writeChromeTrace(const std::string &path)
+{
+    FILE *out = fopen(path.c_str(), "w");
+    if (out == nullptr)
+    {
+        std::cout << "Cannot open timeline file " << path << std::endl;
+        return false;
+    }
+
+    uint64_t next = timeline.next;
+    uint64_t count = std::min<uint64_t>(next, timeline.entries.size());
+    // threads without a name that only ran collector phases
+    std::map<uint32_t, bool> collectorOnly;
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"simplesgc\"}}");
+    for (uint64_t i = next - count; i < next; i++)
+    {
+        const TimelineEntry &entry = timeline.entries[i % timeline.entries.size()];
+        auto seen = collectorOnly.emplace(entry.thread, true).first;
+        seen->second = seen->second && entry.phase >= 0;
+
+        fprintf(out, ",\n{\"name\":");
+        writeString(out, entry.phase < 0 ? entry.name : phaseNames[entry.phase]);
+        fprintf(out, ",\"cat\":\"%s\"", entry.phase < 0 ? "app" : "gc");
+        if (entry.phase == PHASE_TRIGGER)
+            fprintf(out, ",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f", entry.start / 1000.0);
+        else
+            fprintf(out, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f", entry.start / 1000.0, (entry.end - entry.start) / 1000.0);
+        fprintf(out, ",\"pid\":1,\"tid\":%u", entry.thread);
+        writeArgs(out, entry);
+        fputc('}', out);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(timeline.namesMutex);
+        for (auto &it : collectorOnly)
+        {
+            auto named = timeline.names.find(it.first);
+            const char *name = named != timeline.names.end() ? named->second : it.second ? "gc thread" : nullptr;
+            if (name == nullptr)
+                continue;
+            fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", it.first);
+            writeString(out, name);
+            fprintf(out, "}}");
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    bool ok = !ferror(out);
+    if (fclose(out) != 0)
+        ok = false;
+    return ok;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "Garbage.hpp"
+
+// GC phase timeline. While running, every collector phase (onPhase) and
+// every span the program adds goes into a fixed ring buffer, the newest
+// overwriting the oldest, from any thread. writeChromeTrace saves what the
+// buffer holds as Chrome trace-event JSON, which chrome://tracing and
+// ui.perfetto.dev open: one track per thread, collections with their root
+// scan, mark and sweep nested inside, finalizers and block releases on the
+// threads that ran them, triggers as instants with their reason.
+//
+// Timestamps are std::chrono::steady_clock microseconds, so other traces
+// taken with that clock line up. Span names are kept as pointers and must
+// outlive the export; string literals do.
+
+const size_t TIMELINE_DEFAULT_CAPACITY = 64 * 1024;
+
+// false if already running
+bool startTimeline(size_t capacity = TIMELINE_DEFAULT_CAPACITY);
+void stopTimeline();
+bool timelineRunning();
+
+// events overwritten since the start
+size_t timelineDropped();
+
+void timelineSpan(const char *name, std::chrono::steady_clock::time_point start,
+                  std::chrono::steady_clock::time_point end);
+
+// names the calling thread's track
+void setTimelineThreadName(const char *name);
+
+// Export after stopTimeline, or at a point where no collection runs.
+bool writeChromeTrace(const std::string &path);
+
+// an application span for the scope it lives in
+class TimelineSpan
+{
+public:
+    explicit TimelineSpan(const char *name) : name(name), on(timelineRunning())
+    {
+        if (on)
+            start = std::chrono::steady_clock::now();
+    }
+    ~TimelineSpan()
+    {
+        if (on)
+            timelineSpan(name, start, std::chrono::steady_clock::now());
+    }
+    TimelineSpan(const TimelineSpan &) = delete;
+    TimelineSpan &operator=(const TimelineSpan &) = delete;
+
+private:
+    const char *name;
+    bool on;
+    std::chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,767 @@
+#include "pch.h"
+#include "Trace.hpp"
+#include "Snapshot.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+//**************************************************************************** */
+// recording
+
+struct TraceWriter
+{
+    FILE *out{nullptr};
+    std::vector<uint8_t> buffer;
+    uint64_t nextId{1};
+    uint64_t events{0};
+    std::unordered_map<Object *, uint64_t> ids;
+    std::unordered_map<std::string, uint64_t> names;
+    bool failed{false};
+
+    void flush()
+    {
+        if (!buffer.empty() && fwrite(buffer.data(), 1, buffer.size(), out) != buffer.size())
+            failed = true;
+        buffer.clear();
+    }
+    void byte(uint8_t value)
+    {
+        buffer.push_back(value);
+    }
+    void varint(uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            buffer.push_back((uint8_t)(value | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back((uint8_t)value);
+    }
+    void bytes(const void *data, size_t size)
+    {
+        const uint8_t *p = static_cast<const uint8_t *>(data);
+        buffer.insert(buffer.end(), p, p + size);
+    }
+    void name(const std::string &value)
+    {
+        auto it = names.find(value);
+        if (it != names.end())
+        {
+            varint(it->second);
+            return;
+        }
+        names.emplace(value, names.size() + 1);
+        varint(0);
+        varint(value.size());
+        bytes(value.data(), value.size());
+    }
+
+    uint64_t id(Object *obj);
+    void alloc(Object *obj, size_t size);
+};
+
+static TraceWriter writer;
+
+uint64_t TraceWriter::id(Object *obj)
+{
+    if (obj == nullptr)
+        return 0;
+    auto it = ids.find(obj);
+    if (it != ids.end())
+        return it->second;
+    // allocated before recording started
+    alloc(obj, shallowSize(obj));
+    return ids[obj];
+}
+
+void TraceWriter::alloc(Object *obj, size_t size)
+{
+    // objects named by the payload get their ids first
+    uint64_t link = 0;
+    if (obj->type == ObjectType::SCOPE)
+        link = id(static_cast<Scope *>(obj)->parent);
+    else if (obj->type == ObjectType::WEAK_REF)
+        link = id(static_cast<WeakRef *>(obj)->target);
+
+    ids[obj] = nextId++;
+    events++;
+    byte(TRACE_ALLOC);
+    byte((uint8_t)obj->type);
+    varint(size);
+    switch (obj->type)
+    {
+    case ObjectType::INT:
+    {
+        int64_t value = static_cast<Integer *>(obj)->value;
+        varint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+        break;
+    }
+    case ObjectType::REAL:
+        bytes(&static_cast<Real *>(obj)->value, sizeof(double));
+        break;
+    case ObjectType::STRING:
+    {
+        const std::string &value = static_cast<String *>(obj)->value;
+        varint(value.size());
+        bytes(value.data(), value.size());
+        break;
+    }
+    case ObjectType::POINTER:
+        varint(static_cast<Pointer *>(obj)->tag);
+        break;
+    case ObjectType::SCOPE:
+    case ObjectType::WEAK_REF:
+        varint(link);
+        break;
+    default:
+        break;
+    }
+}
+
+static void record(const TraceEvent &event)
+{
+    if (event.op == TRACE_ALLOC)
+    {
+        writer.alloc(event.owner, event.index);
+    }
+    else if (event.op == TRACE_BATCH)
+    {
+        writer.events++;
+        writer.byte(TRACE_BATCH);
+        writer.varint(event.index);
+    }
+    else
+    {
+        // lazy allocations of the objects involved go first
+        uint64_t owner = writer.id(event.owner);
+        uint64_t key = writer.id(event.key);
+        uint64_t value = writer.id(event.value);
+
+        writer.events++;
+        writer.byte((uint8_t)event.op);
+        switch (event.op)
+        {
+        case TRACE_ROOT:
+        case TRACE_UNROOT:
+        case TRACE_LIST_POP:
+            writer.varint(owner);
+            break;
+        case TRACE_LIST_ADD:
+            writer.varint(owner);
+            writer.varint(value);
+            break;
+        case TRACE_LIST_SET:
+            writer.varint(owner);
+            writer.varint(event.index);
+            writer.varint(value);
+            break;
+        case TRACE_LIST_ERASE:
+        case TRACE_EXTERNAL:
+            writer.varint(owner);
+            writer.varint(event.index);
+            break;
+        case TRACE_MAP_INSERT:
+            writer.varint(owner);
+            writer.varint(key);
+            writer.varint(value);
+            break;
+        case TRACE_MAP_REMOVE:
+            writer.varint(owner);
+            writer.varint(key);
+            break;
+        case TRACE_SCOPE_DEFINE:
+            writer.varint(owner);
+            writer.name(*event.name);
+            writer.varint(value);
+            break;
+        case TRACE_SCOPE_REMOVE:
+            writer.varint(owner);
+            writer.name(*event.name);
+            break;
+        case TRACE_COLLECT:
+            writer.byte((uint8_t)event.index);
+            break;
+        case TRACE_PAUSE:
+        case TRACE_RESUME:
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (writer.buffer.size() >= 64 * 1024)
+        writer.flush();
+}
+
+// What was reachable when recording started, written parent first so a
+// replay never holds an object it cannot reach yet
+static void recordHeap()
+{
+    std::vector<Object *> pending;
+    auto link = [&](const TraceEvent &event)
+    {
+        if (event.value != nullptr && writer.ids.count(event.value) == 0)
+            pending.push_back(event.value);
+        if (event.key != nullptr && writer.ids.count(event.key) == 0)
+            pending.push_back(event.key);
+        record(event);
+    };
+
+    for (Object *obj : Factory::as().heap())
+    {
+        if (!Factory::as().isRoot(obj))
+            continue;
+        if (writer.ids.count(obj) == 0)
+            pending.push_back(obj);
+        record({TRACE_ROOT, obj, nullptr, nullptr, 0, nullptr});
+    }
+    while (!pending.empty())
+    {
+        Object *obj = pending.back();
+        pending.pop_back();
+        if (obj->type == ObjectType::LIST)
+        {
+            for (Object *value : static_cast<List *>(obj)->values)
+                link({TRACE_LIST_ADD, obj, nullptr, value, 0, nullptr});
+        }
+        else if (obj->type == ObjectType::MAP || obj->type == ObjectType::WEAK_MAP)
+        {
+            for (auto &it : static_cast<Map *>(obj)->values)
+                link({TRACE_MAP_INSERT, obj, it.first, it.second, 0, nullptr});
+        }
+        else if (obj->type == ObjectType::SCOPE)
+        {
+            for (auto &it : static_cast<Scope *>(obj)->values)
+                link({TRACE_SCOPE_DEFINE, obj, nullptr, it.second, 0, &it.first});
+        }
+    }
+}
+
+bool startTrace(const std::string &path)
+{
+    if (writer.out != nullptr)
+        return false;
+    writer.out = fopen(path.c_str(), "wb");
+    if (writer.out == nullptr)
+    {
+        std::cout << "Cannot open trace file " << path << std::endl;
+        return false;
+    }
+    writer.nextId = 1;
+    writer.events = 0;
+    writer.failed = false;
+    writer.bytes(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    writer.bytes(&TRACE_VERSION, sizeof(TRACE_VERSION));
+    recordHeap();
+    onTrace = record;
+    return true;
+}
+
+bool stopTrace()
+{
+    if (writer.out == nullptr)
+        return false;
+    onTrace = nullptr;
+    writer.byte(TRACE_END);
+    writer.varint(writer.events);
+    writer.flush();
+    bool ok = !writer.failed;
+    if (fclose(writer.out) != 0)
+        ok = false;
+    writer.out = nullptr;
+    writer.ids.clear();
+    writer.names.clear();
+    return ok;
+}
+
+bool tracing()
+{
+    return writer.out != nullptr;
+}
+
+//**************************************************************************** */
+// replay
+
+struct TraceReader
+{
+    FILE *in{nullptr};
+    std::vector<uint8_t> buffer = std::vector<uint8_t>(64 * 1024);
+    size_t position{0};
+    size_t length{0};
+    uint64_t fileSize{0};
+    uint64_t read{0}; // bytes fread so far
+
+    // counts and lengths in a trace never exceed what is left of the file
+    uint64_t remaining() const
+    {
+        return fileSize - read + (length - position);
+    }
+    bool byte(uint8_t &value)
+    {
+        if (position == length)
+        {
+            length = fread(buffer.data(), 1, buffer.size(), in);
+            read += length;
+            position = 0;
+            if (length == 0)
+                return false;
+        }
+        value = buffer[position++];
+        return true;
+    }
+    bool varint(uint64_t &value)
+    {
+        value = 0;
+        uint8_t b;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (!byte(b))
+                return false;
+            value |= (uint64_t)(b & 0x7f) << shift;
+            if ((b & 0x80) == 0)
+                return true;
+        }
+        return false;
+    }
+    bool bytes(void *data, size_t size)
+    {
+        uint8_t *p = static_cast<uint8_t *>(data);
+        for (size_t i = 0; i < size; i++)
+            if (!byte(p[i]))
+                return false;
+        return true;
+    }
+    bool string(std::string &value)
+    {
+        uint64_t size;
+        if (!varint(size) || size > remaining())
+            return false;
+        value.resize(size);
+        return bytes(&value[0], size);
+    }
+};
+
+// the replayed object of every trace id, null once collected
+struct Replay
+{
+    std::vector<Object *> objects{nullptr};
+    std::unordered_map<Object *, uint64_t> live;
+    uint64_t next{1}; // id of the next object registered
+    size_t pauses{0};
+    std::vector<std::string> names;
+    ReplayResult *result{nullptr};
+
+    Object *get(uint64_t id) const { return id < objects.size() ? objects[id] : nullptr; }
+};
+
+static Replay replay;
+
+static size_t onReplayAllocation(Object *obj, size_t size)
+{
+    replay.live[obj] = replay.next++;
+    return 0;
+}
+
+static void onReplayFree(Object *obj)
+{
+    auto it = replay.live.find(obj);
+    if (it == replay.live.end())
+        return;
+    replay.objects[it->second] = nullptr;
+    replay.live.erase(it);
+}
+
+static void onReplayCollect(const GCStats &stats)
+{
+    replay.result->pauses.push_back(stats.lastPause);
+}
+
+// element count of a packed array of size bytes
+static size_t elements(size_t size, size_t header, size_t element)
+{
+    return size > header ? (size - header) / element : 0;
+}
+
+struct AllocRecord
+{
+    uint8_t type;
+    uint64_t size;
+    uint64_t value; // Integer (zigzag), Pointer tag, Scope parent, WeakRef target
+    double real;
+    std::string text;
+};
+
+static bool readAlloc(TraceReader &reader, AllocRecord &record)
+{
+    if (!reader.byte(record.type) || !reader.varint(record.size))
+        return false;
+    switch (record.type)
+    {
+    case ObjectType::INT:
+    case ObjectType::POINTER:
+    case ObjectType::SCOPE:
+    case ObjectType::WEAK_REF:
+        return reader.varint(record.value);
+    case ObjectType::REAL:
+        return reader.bytes(&record.real, sizeof(record.real));
+    case ObjectType::STRING:
+        return reader.string(record.text);
+    default:
+        return true;
+    }
+}
+
+static int integerOf(const AllocRecord &record)
+{
+    return (int)((int64_t)(record.value >> 1) ^ -(int64_t)(record.value & 1));
+}
+
+// user types and record stores come back as opaque arrays of their size
+static void replayAlloc(const AllocRecord &record)
+{
+    Factory &factory = Factory::as();
+    replay.next = replay.objects.size();
+    replay.objects.push_back(nullptr);
+    Object *obj = nullptr;
+    switch (record.type)
+    {
+    case ObjectType::NIL:
+        obj = factory.newNil();
+        break;
+    case ObjectType::INT:
+        obj = factory.newInteger(integerOf(record));
+        break;
+    case ObjectType::REAL:
+        obj = factory.newReal(record.real);
+        break;
+    case ObjectType::STRING:
+        obj = factory.newString(record.text);
+        break;
+    case ObjectType::POINTER:
+        obj = factory.newPointer(record.value);
+        break;
+    case ObjectType::LIST:
+        obj = factory.newList();
+        break;
+    case ObjectType::MAP:
+        obj = factory.newMap();
+        break;
+    case ObjectType::WEAK_MAP:
+        obj = factory.newWeakMap();
+        break;
+    case ObjectType::SCOPE:
+    {
+        Object *parent = replay.get(record.value);
+        if (parent != nullptr && parent->type != ObjectType::SCOPE)
+            parent = nullptr;
+        obj = factory.newScope(static_cast<Scope *>(parent));
+        break;
+    }
+    case ObjectType::WEAK_REF:
+        obj = factory.newWeakRef(replay.get(record.value));
+        break;
+    case ObjectType::LONG_ARRAY:
+        obj = factory.newLongArray(elements(record.size, sizeof(LongArray), sizeof(int64_t)));
+        break;
+    case ObjectType::REAL_ARRAY:
+        obj = factory.newRealArray(elements(record.size, sizeof(RealArray), sizeof(double)));
+        break;
+    default:
+        obj = factory.newIntArray(elements(record.size, sizeof(IntArray), sizeof(int32_t)));
+        break;
+    }
+    // the object is registered, and its id known to the free hook, only now
+    replay.objects.back() = obj;
+}
+
+// a batch goes through the same batch call, so it is collected as one
+// allocation again instead of piece by piece
+static bool replayBatch(TraceReader &reader, ReplayResult &result)
+{
+    uint64_t count;
+    // every record takes at least an op, a type and a size byte
+    if (!reader.varint(count) || count > reader.remaining() / 3)
+        return false;
+    std::vector<AllocRecord> records(count);
+    for (AllocRecord &record : records)
+    {
+        uint8_t op;
+        if (!reader.byte(op) || op != TRACE_ALLOC || !readAlloc(reader, record))
+            return false;
+        if (record.type != records[0].type)
+            return false;
+    }
+    result.events += count;
+    if (count == 0)
+        return true;
+
+    Factory &factory = Factory::as();
+    size_t first = replay.objects.size();
+    replay.next = first;
+    replay.objects.resize(first + count, nullptr);
+    std::vector<Object *> batch(count, nullptr);
+    switch (records[0].type)
+    {
+    case ObjectType::INT:
+        if (factory.newIntegers(count, 0, reinterpret_cast<Integer **>(batch.data())))
+            for (size_t i = 0; i < count; i++)
+                static_cast<Integer *>(batch[i])->value = integerOf(records[i]);
+        break;
+    case ObjectType::REAL:
+        if (factory.newReals(count, 0.0, reinterpret_cast<Real **>(batch.data())))
+            for (size_t i = 0; i < count; i++)
+                static_cast<Real *>(batch[i])->value = records[i].real;
+        break;
+    case ObjectType::STRING:
+        if (factory.newStrings(count, reinterpret_cast<String **>(batch.data())))
+            for (size_t i = 0; i < count; i++)
+                static_cast<String *>(batch[i])->value = records[i].text;
+        break;
+    case ObjectType::POINTER:
+        if (factory.newPointers(count, 0, reinterpret_cast<Pointer **>(batch.data())))
+            for (size_t i = 0; i < count; i++)
+                static_cast<Pointer *>(batch[i])->tag = records[i].value;
+        break;
+    default:
+        replay.objects.resize(first);
+        for (const AllocRecord &record : records)
+            replayAlloc(record);
+        return true;
+    }
+    std::copy(batch.begin(), batch.end(), replay.objects.begin() + first);
+    return true;
+}
+
+static bool replayEvent(TraceReader &reader, uint8_t op, const ReplayOptions &options, ReplayResult &result)
+{
+    uint64_t owner = 0, key = 0, value = 0, index = 0;
+    std::string *name = nullptr;
+
+    auto readName = [&]() -> bool
+    {
+        uint64_t n;
+        if (!reader.varint(n))
+            return false;
+        if (n == 0)
+        {
+            replay.names.emplace_back();
+            if (!reader.string(replay.names.back()))
+                return false;
+            n = replay.names.size();
+        }
+        if (n > replay.names.size())
+            return false;
+        name = &replay.names[n - 1];
+        return true;
+    };
+
+    bool ok = true;
+    switch (op)
+    {
+    case TRACE_ROOT:
+    case TRACE_UNROOT:
+    case TRACE_LIST_POP:
+        ok = reader.varint(owner);
+        break;
+    case TRACE_LIST_ADD:
+        ok = reader.varint(owner) && reader.varint(value);
+        break;
+    case TRACE_LIST_SET:
+        ok = reader.varint(owner) && reader.varint(index) && reader.varint(value);
+        break;
+    case TRACE_LIST_ERASE:
+    case TRACE_EXTERNAL:
+        ok = reader.varint(owner) && reader.varint(index);
+        break;
+    case TRACE_MAP_INSERT:
+        ok = reader.varint(owner) && reader.varint(key) && reader.varint(value);
+        break;
+    case TRACE_MAP_REMOVE:
+        ok = reader.varint(owner) && reader.varint(key);
+        break;
+    case TRACE_SCOPE_DEFINE:
+        ok = reader.varint(owner) && readName() && reader.varint(value);
+        break;
+    case TRACE_SCOPE_REMOVE:
+        ok = reader.varint(owner) && readName();
+        break;
+    case TRACE_COLLECT:
+    {
+        uint8_t full;
+        ok = reader.byte(full);
+        if (ok && options.explicitCollects)
+        {
+            if (full)
+                Factory::as().collectFull();
+            else
+                Factory::as().collect();
+        }
+        return ok;
+    }
+    case TRACE_PAUSE:
+        replay.pauses++;
+        Factory::as().pauseCollection();
+        return true;
+    case TRACE_RESUME:
+        // the pause began before recording did
+        if (replay.pauses == 0)
+        {
+            result.skipped++;
+            return true;
+        }
+        replay.pauses--;
+        Factory::as().resumeCollection();
+        return true;
+    default:
+        return false;
+    }
+    if (!ok)
+        return false;
+
+    // everything named must still be alive, and the owner of the right kind
+    Object *target = replay.get(owner);
+    Object *keyObject = replay.get(key);
+    Object *valueObject = replay.get(value);
+    if (target == nullptr || (key != 0 && keyObject == nullptr) || (value != 0 && valueObject == nullptr))
+    {
+        result.skipped++;
+        return true;
+    }
+
+    List *list = target->type == ObjectType::LIST ? static_cast<List *>(target) : nullptr;
+    Map *map = target->type == ObjectType::MAP || target->type == ObjectType::WEAK_MAP ? static_cast<Map *>(target) : nullptr;
+    Scope *scope = target->type == ObjectType::SCOPE ? static_cast<Scope *>(target) : nullptr;
+    bool applied = true;
+    switch (op)
+    {
+    case TRACE_ROOT:
+        Factory::as().addRoot(target);
+        break;
+    case TRACE_UNROOT:
+        Factory::as().removeRoot(target);
+        break;
+    case TRACE_LIST_ADD:
+        if ((applied = list != nullptr && valueObject != nullptr))
+            list->add(valueObject);
+        break;
+    case TRACE_LIST_SET:
+        if ((applied = list != nullptr && valueObject != nullptr && index < list->values.size()))
+            list->set((int)index, valueObject);
+        break;
+    case TRACE_LIST_ERASE:
+        if ((applied = list != nullptr && index < list->values.size()))
+            list->erase((int)index);
+        break;
+    case TRACE_LIST_POP:
+        if ((applied = list != nullptr && !list->values.empty()))
+            list->pop();
+        break;
+    case TRACE_MAP_INSERT:
+        if ((applied = map != nullptr && keyObject != nullptr))
+            map->insert(keyObject, valueObject);
+        break;
+    case TRACE_MAP_REMOVE:
+        if ((applied = map != nullptr && keyObject != nullptr))
+            map->remove(keyObject);
+        break;
+    case TRACE_SCOPE_DEFINE:
+        if ((applied = scope != nullptr))
+            scope->define(*name, valueObject);
+        break;
+    case TRACE_SCOPE_REMOVE:
+        if ((applied = scope != nullptr))
+            scope->remove(*name);
+        break;
+    case TRACE_EXTERNAL:
+        if ((applied = target->type == ObjectType::POINTER))
+            Factory::as().setExternalSize(static_cast<Pointer *>(target), index);
+        break;
+    }
+    if (!applied)
+        result.skipped++;
+    return true;
+}
+
+bool replayTrace(const std::string &path, const ReplayOptions &options, ReplayResult &result)
+{
+    TraceReader reader;
+    reader.in = fopen(path.c_str(), "rb");
+    if (reader.in == nullptr)
+    {
+        std::cout << "Cannot open trace file " << path << std::endl;
+        return false;
+    }
+    fseek(reader.in, 0, SEEK_END);
+    reader.fileSize = (uint64_t)ftell(reader.in);
+    fseek(reader.in, 0, SEEK_SET);
+
+    char magic[8];
+    uint32_t version = 0;
+    if (!reader.bytes(magic, sizeof(magic)) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+        !reader.bytes(&version, sizeof(version)) || version != TRACE_VERSION)
+    {
+        std::cout << path << " is not a trace" << std::endl;
+        fclose(reader.in);
+        return false;
+    }
+
+    Factory &factory = Factory::as();
+    result = ReplayResult();
+    replay.objects.assign(1, nullptr);
+    replay.live.clear();
+    replay.names.clear();
+    replay.pauses = 0;
+    replay.result = &result;
+
+    Arena::as().setCollectGrowth(options.growth);
+    factory.setGenerational(options.generational);
+    factory.setConcurrentMarking(options.concurrent);
+    factory.setSweepThreads(options.sweepThreads);
+    factory.setMarkOrder(options.markOrder);
+    factory.setAllocationSampler(onReplayAllocation, onReplayFree, 0);
+    factory.setOnCollect(onReplayCollect);
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = false;
+    uint8_t op;
+    while (reader.byte(op))
+    {
+        if (op == TRACE_END)
+        {
+            uint64_t count = 0;
+            ok = reader.varint(count) && count == result.events;
+            break;
+        }
+        AllocRecord record;
+        if (op == TRACE_ALLOC)
+        {
+            if (!readAlloc(reader, record))
+                break;
+            replayAlloc(record);
+        }
+        else if (!(op == TRACE_BATCH ? replayBatch(reader, result) : replayEvent(reader, op, options, result)))
+            break;
+        result.events++;
+        result.peakSize = std::max(result.peakSize, Arena::as().size());
+        result.peakCommitted = std::max(result.peakCommitted, Arena::as().committed());
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.seconds = elapsed.count();
+
+    // a trace stopped inside a pause leaves it open
+    for (; replay.pauses > 0; replay.pauses--)
+        factory.resumeCollection();
+    factory.setOnCollect(nullptr);
+    factory.setAllocationSampler(nullptr, nullptr, 0);
+    const GCStats &stats = factory.stats();
+    result.collections = stats.collections;
+    result.minorCollections = stats.minorCollections;
+    result.maxPause = stats.maxPause;
+    result.totalPause = stats.totalPause;
+
+    fclose(reader.in);
+    if (!ok)
+        std::cout << path << " is truncated or corrupt" << std::endl;
+    return ok;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Garbage.hpp"
+
+// Allocation trace recording and replay. While recording, every allocation,
+// root change, container store made through the List/Map/Scope methods,
+// external size change and explicit collection is appended to a compact
+// binary file, as are collection pauses. Replaying it in a fresh process rebuilds the same object
+// graph step by step under other collector settings, so thresholds and
+// modes can be compared on the exact same mutator behaviour.
+//
+// Not recorded: writes to List::values done directly, fields of user types
+// and record store contents. Objects only reachable through those die
+// early in a replay; events touching them are skipped and counted.
+//
+// File layout (integers are LEB128 varints, object ids count allocations
+// from 1, 0 is null):
+//
+//   header : "SGCTRACE" u32 version
+//   event  : u8 op, then by op
+//            ALLOC         u8 type, size, payload by type
+//                            Integer zigzag value, Real f64, String length
+//                            bytes, Pointer tag, Scope parent, WeakRef target
+//            BATCH         count, then count ALLOC events of one type
+//            ROOT, UNROOT, LIST_POP          owner
+//            LIST_ADD                        owner value
+//            LIST_SET                        owner index value
+//            LIST_ERASE                      owner index
+//            MAP_INSERT                      owner key value
+//            MAP_REMOVE                      owner key
+//            SCOPE_DEFINE                    owner name value
+//            SCOPE_REMOVE                    owner name
+//            EXTERNAL                        owner bytes
+//            COLLECT                         u8 full
+//            PAUSE, RESUME
+//   footer : u8 TRACE_END, event count
+//
+// A name is its index in the order of first use; 0 is followed by the
+// length and bytes of a name not seen before. The trace starts with what
+// was reachable when recording started, as allocations and stores from the
+// roots down; other objects from before are written as allocations on
+// first use.
+
+const char TRACE_MAGIC[8] = {'S', 'G', 'C', 'T', 'R', 'A', 'C', 'E'};
+const uint32_t TRACE_VERSION = 1;
+const uint8_t TRACE_END = 0xff;
+
+bool startTrace(const std::string &path);
+bool stopTrace();
+bool tracing();
+
+struct ReplayOptions
+{
+    size_t growth{0}; // Arena::setCollectGrowth, 0 for the adaptive threshold
+    bool generational{false};
+    bool concurrent{false}; // Factory::setConcurrentMarking
+    size_t sweepThreads{1};
+    MarkOrder markOrder{MARK_DEPTH_FIRST};
+    bool explicitCollects{true}; // run the collections the program asked for
+};
+
+struct ReplayResult
+{
+    size_t events{0};
+    size_t skipped{0}; // touched an object the replay had already collected
+    size_t collections{0};
+    size_t minorCollections{0};
+    std::vector<double> pauses; // ms, in order
+    double maxPause{0.0};
+    double totalPause{0.0};
+    size_t peakSize{0};
+    size_t peakCommitted{0};
+    double seconds{0.0};
+};
+
+// Replays into the process-wide Factory, which should be fresh.
+bool replayTrace(const std::string &path, const ReplayOptions &options, ReplayResult &result);
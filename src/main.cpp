@@ -216,13 +216,17 @@ int main()
         int mouse_x=  local->getInt("mouse_x");
         int mouse_y=  local->getInt("mouse_y");
         int down=     local->getInt("down");
-        if (down)
+        Pointer *batch[50];
+        // no burst this frame when the batch cannot be had
+        if (down && Factory::as().newPointers(50, 0, batch))
         {
             for (int j = 0;j<50;j++)
             {
             count++;
-            Pointer *buffer = NEW_POINTER(count);
+            Pointer *buffer = batch[j];
+            buffer->tag = count;
             buffer->value=(void*) new Bunny();
+            Factory::as().setExternalSize(buffer, sizeof(Bunny));
             list->add(buffer);
             }
         }
@@ -235,32 +239,20 @@ int main()
 
         DrawCircle(mouse_x, mouse_y, 10, GREEN);
 
-        int i = 0;
+        list->removeIf([](Object *p)
+                       {
+                           Pointer *ob = static_cast<Pointer *>(p);
+                           return ob->value && static_cast<Bunny *>(ob->value)->die;
+                       });
+
         int count = list->size();
-        while (i < (int)count)
+        for (int i = 0; i < count; i++)
         {
-            Object *p = list->get(i);
-            Pointer *ob = static_cast<Pointer *>(p);
-            if (!ob) 
-            {
-                i++;
-                continue;
-            }
-            if (!ob->value)
-            {
-                i++;
+            Pointer *ob = static_cast<Pointer *>(list->get(i));
+            if (!ob || !ob->value)
                 continue;
-            }
             Bunny *bunny = static_cast<Bunny*>(ob->value);
-            if (bunny->die)
-            {
-                list->erase(i);
-                count = list->size();
-                i++;
-                continue;
-            }
             bunny->render();
-            i++;
         }
 
         DrawFPS(10, 10);
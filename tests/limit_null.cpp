@@ -0,0 +1,67 @@
+#include "pch.h"
+#include "Garbage.hpp"
+
+#include <cstdio>
+
+// Under a memory limit NEW_* returns nullptr, and code that does not check
+// stores it. The collections that follow must step over the empty slots.
+
+static int failed = 0;
+
+static void check(bool condition, const char *what)
+{
+    if (!condition)
+    {
+        fprintf(stderr, "FAILED: %s\n", what);
+        failed++;
+    }
+}
+
+int main()
+{
+    std::cout.setstate(std::ios::failbit);
+
+    List *list = NEW_LIST();
+    ADD_ROOT(list);
+    Map *map = NEW_MAP();
+    ADD_ROOT(map);
+    Scope *scope = NEW_SCOPE(nullptr);
+    ADD_ROOT(scope);
+    list->values.reserve(1000000);
+
+    Arena::as().setLimit(Arena::as().committed() + 4 * 1024 * 1024);
+    bool defineFailed = false;
+    for (int i = 0; i < 1000000 && Arena::as().failures() < 100; i++)
+    {
+        list->add(NEW_INTEGER(i));
+        if (Arena::as().failures() > 0 && i % 64 == 0)
+        {
+            map->insert(NEW_INTEGER(i), NEW_INTEGER(i));
+            defineFailed = !scope->define("value", i) || defineFailed;
+        }
+    }
+    check(Arena::as().failures() >= 100, "the limit was reached");
+    check(defineFailed, "Scope::define reports a failed allocation");
+
+    size_t empty = 0;
+    for (Object *value : list->values)
+        empty += value == nullptr;
+    check(empty > 0, "the list holds empty slots");
+
+    Factory::as().collectEmergency();
+    Factory::as().collect();
+    check(list->size() > 0, "the list survived");
+
+    Arena::as().setLimit(0);
+    list->values.clear();
+    check(NEW_INTEGER(0) != nullptr, "allocation recovers once the limit is lifted");
+
+    REMOVE_ROOT(scope);
+    REMOVE_ROOT(map);
+    REMOVE_ROOT(list);
+    Factory::as().clean();
+
+    if (failed == 0)
+        printf("limit_null: ok\n");
+    return failed == 0 ? 0 : 1;
+}
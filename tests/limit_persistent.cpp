@@ -0,0 +1,102 @@
+#include "pch.h"
+#include "Garbage.hpp"
+#include "Persistent.hpp"
+
+#include <cstdio>
+
+// Under a memory limit a persistent update that cannot allocate its nodes
+// returns nullptr (false for a transient) and leaves what it started from
+// whole.
+
+static int failed = 0;
+
+static void check(bool condition, const char *what)
+{
+    if (!condition)
+    {
+        fprintf(stderr, "FAILED: %s\n", what);
+        failed++;
+    }
+}
+
+static const int KEYS = 200000;
+
+int main()
+{
+    std::cout.setstate(std::ios::failbit);
+
+    // keys and versions are held here, made before the limit
+    List *keys = NEW_LIST();
+    ADD_ROOT(keys);
+    for (int i = 0; i < KEYS; i++)
+        keys->add(NEW_INTEGER(i));
+    List *held = NEW_LIST();
+    ADD_ROOT(held);
+    held->values.reserve(3);
+    held->add(NEW_PERSISTENT_VECTOR());
+    held->add(NEW_PERSISTENT_MAP());
+
+    Arena::as().setLimit(Arena::as().committed() + 1024 * 1024);
+
+    size_t pushed = 0;
+    for (; pushed < (size_t)KEYS; pushed++)
+    {
+        PersistentVector *next = static_cast<PersistentVector *>(held->get(0))->push(keys->get((int)pushed));
+        if (next == nullptr)
+            break;
+        held->set(0, next);
+    }
+    check(pushed < (size_t)KEYS, "a vector push failed under the limit");
+    PersistentVector *vector = static_cast<PersistentVector *>(held->get(0));
+    bool whole = vector->size() == pushed;
+    for (size_t i = 0; i < vector->size() && whole; i++)
+        whole = vector->get(i) == keys->get((int)i);
+    check(whole, "the last vector version is whole");
+
+    // the vector goes, so the map gets the room back and runs into the limit
+    held->set(0, nullptr);
+    Factory::as().collect();
+    size_t inserted = 0;
+    for (; inserted < (size_t)KEYS; inserted++)
+    {
+        Object *key = keys->get((int)inserted);
+        PersistentMap *next = static_cast<PersistentMap *>(held->get(1))->insert(key, key);
+        if (next == nullptr)
+            break;
+        held->set(1, next);
+    }
+    check(inserted < (size_t)KEYS, "a map insert failed under the limit");
+    PersistentMap *map = static_cast<PersistentMap *>(held->get(1));
+    whole = map->size() == inserted;
+    for (size_t i = 0; i < inserted && whole; i++)
+        whole = map->get(keys->get((int)i)) == keys->get((int)i);
+    check(whole, "the last map version is whole");
+
+    // a transient that fails keeps what it had
+    TransientMap *transient = map->transient();
+    if (transient != nullptr)
+    {
+        held->add(transient);
+        size_t size = transient->size();
+        size_t next = inserted;
+        while (next < (size_t)KEYS && transient->insert(keys->get((int)next), keys->get((int)next)))
+            next++;
+        check(next < (size_t)KEYS, "a transient insert failed under the limit");
+        check(transient->size() == size + (next - inserted), "a failed transient insert leaves the size");
+        whole = true;
+        for (size_t i = 0; i < next && whole; i++)
+            whole = transient->get(keys->get((int)i)) == keys->get((int)i);
+        check(whole, "the transient is whole after a failed insert");
+    }
+
+    Arena::as().setLimit(0);
+    check(map->insert(keys->get(KEYS - 1), nullptr) != nullptr, "updates recover once the limit is lifted");
+
+    REMOVE_ROOT(held);
+    REMOVE_ROOT(keys);
+    Factory::as().clean();
+
+    if (failed == 0)
+        printf("limit_persistent: ok\n");
+    return failed == 0 ? 0 : 1;
+}
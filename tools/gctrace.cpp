@@ -0,0 +1,109 @@
+#include "pch.h"
+#include "Trace.hpp"
+#include "Timeline.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Replays an allocation trace written by startTrace() (bunnysim --trace)
+// under the given collector settings and prints pause times and peak
+// memory as one JSON object. Run it once per configuration to compare.
+
+static double percentile(std::vector<double> values, double p)
+{
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t index = (size_t)(p * (values.size() - 1) + 0.5);
+    return values[index];
+}
+
+static long peakRss()
+{
+#ifndef _WIN32
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#else
+    return 0;
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    ReplayOptions options;
+    const char *path = nullptr;
+    const char *timeline = nullptr;
+    bool usage = argc < 2;
+
+    for (int i = 1; i < argc && !usage; i++)
+    {
+        bool value = i + 1 < argc;
+        if ((strcmp(argv[i], "--growth") == 0 || strcmp(argv[i], "--threshold") == 0) && value)
+            options.growth = (size_t)atol(argv[++i]);
+        else if (strcmp(argv[i], "--sweep-threads") == 0 && value)
+            options.sweepThreads = (size_t)std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--generational") == 0)
+            options.generational = true;
+        else if (strcmp(argv[i], "--concurrent") == 0)
+            options.concurrent = true;
+        else if (strcmp(argv[i], "--bfs") == 0)
+            options.markOrder = MARK_BREADTH_FIRST;
+        else if (strcmp(argv[i], "--no-collects") == 0)
+            options.explicitCollects = false;
+        else if (strcmp(argv[i], "--timeline") == 0 && value)
+            timeline = argv[++i];
+        else if (argv[i][0] != '-' && path == nullptr)
+            path = argv[i];
+        else
+            usage = true;
+    }
+    if (usage || path == nullptr)
+    {
+        fprintf(stderr, "usage: gctrace <trace> [--growth BYTES] [--generational] [--sweep-threads N]\n"
+                        "               [--concurrent] [--bfs] [--no-collects] [--timeline FILE.json]\n"
+                        "  --growth 0 (the default) keeps the adaptive threshold\n");
+        return 1;
+    }
+
+    // the collector logs to std::cout; the report goes to stdout on its own
+    std::cout.setstate(std::ios::failbit);
+
+    if (timeline != nullptr)
+        startTimeline();
+    ReplayResult result;
+    if (!replayTrace(path, options, result))
+    {
+        fprintf(stderr, "cannot replay %s\n", path);
+        return 1;
+    }
+    if (timeline != nullptr)
+    {
+        Factory::as().finishCollection();
+        stopTimeline();
+        if (!writeChromeTrace(timeline))
+            fprintf(stderr, "cannot write timeline %s\n", timeline);
+    }
+
+    printf("{\"trace\":\"%s\",\"growth\":%zu,\"generational\":%s,\"concurrent\":%s,\"sweep_threads\":%zu,\"mark_order\":\"%s\","
+           "\"events\":%zu,\"skipped\":%zu,\"collections\":%zu,\"minor_collections\":%zu,"
+           "\"pause_ms\":{\"total\":%.4f,\"p50\":%.4f,\"p99\":%.4f,\"max\":%.4f},"
+           "\"peak_arena_bytes\":%zu,\"peak_committed_bytes\":%zu,\"peak_rss_kb\":%ld,\"seconds\":%.4f}\n",
+           path, options.growth, options.generational ? "true" : "false",
+           options.concurrent ? "true" : "false", options.sweepThreads,
+           options.markOrder == MARK_BREADTH_FIRST ? "bfs" : "dfs", result.events, result.skipped,
+           result.collections, result.minorCollections, result.totalPause, percentile(result.pauses, 0.50),
+           percentile(result.pauses, 0.99), result.maxPause, result.peakSize, result.peakCommitted, peakRss(),
+           result.seconds);
+    fflush(stdout);
+
+    Factory::as().setSweepThreads(1);
+    Factory::as().setConcurrentMarking(false);
+    Factory::as().clean();
+    return 0;
+}
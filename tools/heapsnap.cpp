@@ -0,0 +1,288 @@
+#include "pch.h"
+#include "Snapshot.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Offline analyzer for heap snapshots written by writeHeapSnapshot().
+// Builds the dominator tree of the object graph (Cooper, Harvey, Kennedy,
+// "A Simple, Fast Dominance Algorithm") below a virtual root that points
+// at every GC root, and reports retained sizes per type and per object.
+
+static const char *typeNames[] = {"Nil", "Integer", "Real", "String", "Pointer", "List", "Map", "Scope", "WeakRef", "WeakMap",
+                                   "IntArray", "LongArray", "RealArray", "RecordStore"};
+
+static const char *typeName(uint8_t type)
+{
+    if (type < sizeof(typeNames) / sizeof(typeNames[0]))
+        return typeNames[type];
+    return "Unknown";
+}
+
+struct Graph
+{
+    std::vector<uint64_t> ids;
+    std::vector<uint8_t> types;
+    std::vector<uint8_t> flags;
+    std::vector<uint64_t> shallow;
+    std::vector<size_t> edgeStart; // edge offsets pass 2^32 on big heaps
+    std::vector<uint64_t> rawEdges;
+    std::vector<uint32_t> edges;
+};
+
+template <typename T>
+static bool get(FILE *in, T &value)
+{
+    return fread(&value, sizeof(T), 1, in) == 1;
+}
+
+static bool load(const char *path, Graph &graph)
+{
+    FILE *in = fopen(path, "rb");
+    if (in == nullptr)
+    {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+
+    char magic[8];
+    uint32_t version = 0;
+    uint32_t pointerSize = 0;
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 ||
+        !get(in, version) || version != SNAPSHOT_VERSION || !get(in, pointerSize))
+    {
+        fprintf(stderr, "%s is not a heap snapshot\n", path);
+        fclose(in);
+        return false;
+    }
+    // edge counts are checked against what is left of the file
+    uint64_t position = ftell(in);
+    fseek(in, 0, SEEK_END);
+    uint64_t fileSize = ftell(in);
+    fseek(in, (long)position, SEEK_SET);
+
+    // index 0 is the virtual root
+    graph.ids.push_back(0);
+    graph.types.push_back(ObjectType::NIL);
+    graph.flags.push_back(0);
+    graph.shallow.push_back(0);
+    graph.edgeStart.push_back(0);
+
+    bool ok = false;
+    uint8_t tag;
+    while (get(in, tag))
+    {
+        if (tag == SNAPSHOT_END)
+        {
+            uint64_t count = 0;
+            ok = get(in, count) && count == graph.ids.size() - 1;
+            break;
+        }
+        uint64_t id;
+        uint8_t type, flags;
+        uint32_t size, count;
+        if (tag != SNAPSHOT_OBJECT || !get(in, id) || !get(in, type) || !get(in, flags) || !get(in, size) || !get(in, count))
+            break;
+        position += sizeof(tag) + sizeof(id) + sizeof(type) + sizeof(flags) + sizeof(size) + sizeof(count);
+        if (count > (fileSize - position) / sizeof(uint64_t))
+            break;
+        position += count * sizeof(uint64_t);
+
+        graph.ids.push_back(id);
+        graph.types.push_back(type);
+        graph.flags.push_back(flags);
+        graph.shallow.push_back(size);
+        graph.edgeStart.push_back(graph.rawEdges.size());
+        size_t first = graph.rawEdges.size();
+        graph.rawEdges.resize(first + count);
+        if (count != 0 && fread(&graph.rawEdges[first], sizeof(uint64_t), count, in) != count)
+            break;
+    }
+    fclose(in);
+    if (!ok)
+    {
+        fprintf(stderr, "%s is truncated or corrupt\n", path);
+        return false;
+    }
+    graph.edgeStart.push_back(graph.rawEdges.size());
+
+    std::unordered_map<uint64_t, uint32_t> index;
+    index.reserve(graph.ids.size());
+    for (uint32_t i = 1; i < graph.ids.size(); i++)
+        index[graph.ids[i]] = i;
+
+    // translate ids to node indices; edges to objects missing from the heap are dropped
+    std::vector<size_t> start(graph.ids.size() + 1, 0);
+    for (uint32_t n = 1; n < graph.ids.size(); n++)
+        if (graph.flags[n] & SNAPSHOT_ROOT)
+            graph.edges.push_back(n);
+    for (uint32_t n = 1; n < graph.ids.size(); n++)
+    {
+        start[n] = graph.edges.size();
+        for (size_t e = graph.edgeStart[n]; e < graph.edgeStart[n + 1]; e++)
+        {
+            auto it = index.find(graph.rawEdges[e]);
+            if (it != index.end())
+                graph.edges.push_back(it->second);
+        }
+    }
+    start[graph.ids.size()] = graph.edges.size();
+    graph.edgeStart.swap(start);
+    std::vector<uint64_t>().swap(graph.rawEdges);
+    return true;
+}
+
+static void dominators(const Graph &graph, std::vector<uint32_t> &idom, std::vector<uint32_t> &order)
+{
+    const uint32_t none = UINT32_MAX;
+    size_t n = graph.ids.size();
+
+    // iterative DFS for the reverse postorder
+    std::vector<uint32_t> postorder;
+    std::vector<uint8_t> visited(n, 0);
+    std::vector<std::pair<uint32_t, size_t>> stack;
+    stack.push_back(std::make_pair(0u, graph.edgeStart[0]));
+    visited[0] = 1;
+    while (!stack.empty())
+    {
+        auto &top = stack.back();
+        if (top.second < graph.edgeStart[top.first + 1])
+        {
+            uint32_t next = graph.edges[top.second++];
+            if (!visited[next])
+            {
+                visited[next] = 1;
+                stack.push_back(std::make_pair(next, graph.edgeStart[next]));
+            }
+        }
+        else
+        {
+            postorder.push_back(top.first);
+            stack.pop_back();
+        }
+    }
+    order.assign(postorder.rbegin(), postorder.rend());
+
+    std::vector<uint32_t> rpo(n, none);
+    for (uint32_t i = 0; i < order.size(); i++)
+        rpo[order[i]] = i;
+
+    // predecessor lists in CSR form, reachable nodes only
+    std::vector<size_t> predStart(n + 1, 0);
+    for (uint32_t v = 0; v < n; v++)
+        if (rpo[v] != none)
+            for (size_t e = graph.edgeStart[v]; e < graph.edgeStart[v + 1]; e++)
+                predStart[graph.edges[e] + 1]++;
+    for (size_t v = 0; v < n; v++)
+        predStart[v + 1] += predStart[v];
+    std::vector<uint32_t> preds(predStart[n]);
+    std::vector<size_t> fill(predStart.begin(), predStart.end() - 1);
+    for (uint32_t v = 0; v < n; v++)
+        if (rpo[v] != none)
+            for (size_t e = graph.edgeStart[v]; e < graph.edgeStart[v + 1]; e++)
+                preds[fill[graph.edges[e]]++] = v;
+
+    idom.assign(n, none);
+    idom[0] = 0;
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t i = 1; i < order.size(); i++)
+        {
+            uint32_t v = order[i];
+            uint32_t best = none;
+            for (size_t p = predStart[v]; p < predStart[v + 1]; p++)
+            {
+                uint32_t u = preds[p];
+                if (idom[u] == none)
+                    continue;
+                if (best == none)
+                {
+                    best = u;
+                    continue;
+                }
+                uint32_t a = u, b = best;
+                while (a != b)
+                {
+                    while (rpo[a] > rpo[b])
+                        a = idom[a];
+                    while (rpo[b] > rpo[a])
+                        b = idom[b];
+                }
+                best = a;
+            }
+            if (best != none && idom[v] != best)
+            {
+                idom[v] = best;
+                changed = true;
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: heapsnap <snapshot> [top]\n");
+        return 1;
+    }
+    size_t top = argc > 2 ? (size_t)atoi(argv[2]) : 20;
+
+    Graph graph;
+    if (!load(argv[1], graph))
+        return 1;
+
+    std::vector<uint32_t> idom, order;
+    dominators(graph, idom, order);
+
+    size_t n = graph.ids.size();
+    std::vector<uint64_t> retained(graph.shallow);
+    for (size_t i = order.size(); i-- > 1;)
+        retained[idom[order[i]]] += retained[order[i]];
+
+    const size_t types = sizeof(typeNames) / sizeof(typeNames[0]) + 1;
+    std::vector<uint64_t> typeCount(types, 0), typeShallow(types, 0), typeUnreachable(types, 0);
+    uint64_t totalShallow = 0;
+    for (size_t v = 1; v < n; v++)
+    {
+        size_t t = std::min<size_t>(graph.types[v], types - 1);
+        typeCount[t]++;
+        typeShallow[t] += graph.shallow[v];
+        totalShallow += graph.shallow[v];
+        if (idom[v] == UINT32_MAX)
+            typeUnreachable[t]++;
+    }
+
+    printf("objects: %zu  shallow: %llu bytes  reachable: %llu bytes\n\n", n - 1,
+           (unsigned long long)totalShallow, (unsigned long long)retained[0]);
+    printf("%-10s %12s %16s %12s\n", "type", "count", "shallow", "unreachable");
+    for (size_t t = 0; t < types; t++)
+        if (typeCount[t])
+            printf("%-10s %12llu %16llu %12llu\n", typeName((uint8_t)t), (unsigned long long)typeCount[t],
+                   (unsigned long long)typeShallow[t], (unsigned long long)typeUnreachable[t]);
+
+    std::vector<uint32_t> reachable(order.begin() + 1, order.end());
+    size_t count = std::min(top, reachable.size());
+    std::partial_sort(reachable.begin(), reachable.begin() + count, reachable.end(),
+                      [&](uint32_t a, uint32_t b)
+                      { return retained[a] > retained[b]; });
+
+    printf("\n%-18s %-8s %5s %12s %14s  %s\n", "id", "type", "root", "shallow", "retained", "dominator");
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t v = reachable[i];
+        uint32_t d = idom[v];
+        printf("0x%016llx %-8s %5s %12llu %14llu  ", (unsigned long long)graph.ids[v], typeName(graph.types[v]),
+               (graph.flags[v] & SNAPSHOT_ROOT) ? "yes" : "", (unsigned long long)graph.shallow[v],
+               (unsigned long long)retained[v]);
+        if (d == 0)
+            printf("<roots>\n");
+        else
+            printf("0x%016llx %s\n", (unsigned long long)graph.ids[d], typeName(graph.types[d]));
+    }
+    return 0;
+}